@@ -0,0 +1,139 @@
+#include "commonSubstring.h"
+
+#include <new>
+
+SubstringMatcher::SubstringMatcher()
+    : mStates(0), mEdges(0), mCapacity(0),
+      mStateCount(0), mEdgeCount(0), mLast(0)
+{
+}
+
+SubstringMatcher::~SubstringMatcher()
+{
+    delete[] mStates;
+    delete[] mEdges;
+}
+
+bool
+SubstringMatcher::Reserve(size_t length)
+{
+    if (length <= mCapacity && mStates)
+        return true;
+
+    // An automaton for n units has at most 2n states and 3n edges.
+    State *states = new (std::nothrow) State[length * 2 + 2];
+    Edge *edges = new (std::nothrow) Edge[length * 3 + 4];
+    if (!states || !edges) {
+        delete[] states;
+        delete[] edges;
+        return false;
+    }
+
+    delete[] mStates;
+    delete[] mEdges;
+    mStates = states;
+    mEdges = edges;
+    mCapacity = length;
+    return true;
+}
+
+int32_t
+SubstringMatcher::Find(int32_t state, uint16_t unit) const
+{
+    for (int32_t e = mStates[state].edges; e >= 0; e = mEdges[e].next)
+        if (mEdges[e].unit == unit)
+            return e;
+    return -1;
+}
+
+void
+SubstringMatcher::AddEdge(int32_t state, uint16_t unit, int32_t target)
+{
+    Edge &edge = mEdges[mEdgeCount];
+    edge.unit = unit;
+    edge.target = target;
+    edge.next = mStates[state].edges;
+    mStates[state].edges = mEdgeCount++;
+}
+
+void
+SubstringMatcher::Extend(uint16_t unit)
+{
+    int32_t cur = mStateCount++;
+    mStates[cur].length = mStates[mLast].length + 1;
+    mStates[cur].edges = -1;
+
+    int32_t p = mLast, e = -1;
+    for (; p >= 0 && (e = Find(p, unit)) < 0; p = mStates[p].link)
+        AddEdge(p, unit, cur);
+
+    if (p < 0)
+        mStates[cur].link = 0;
+    else {
+        int32_t q = mEdges[e].target;
+        if (mStates[p].length + 1 == mStates[q].length)
+            mStates[cur].link = q;
+        else {
+            int32_t clone = mStateCount++;
+            mStates[clone].length = mStates[p].length + 1;
+            mStates[clone].link = mStates[q].link;
+            mStates[clone].edges = -1;
+            for (int32_t f = mStates[q].edges; f >= 0; f = mEdges[f].next)
+                AddEdge(clone, mEdges[f].unit, mEdges[f].target);
+
+            for (; p >= 0 && (e = Find(p, unit)) >= 0 && mEdges[e].target == q;
+                 p = mStates[p].link)
+                mEdges[e].target = clone;
+
+            mStates[q].link = mStates[cur].link = clone;
+        }
+    }
+    mLast = cur;
+}
+
+bool
+SubstringMatcher::Init(const uint16_t *string, size_t length)
+{
+    if (!Reserve(length))
+        return false;
+
+    mStates[0].length = 0;
+    mStates[0].link = -1;
+    mStates[0].edges = -1;
+    mStateCount = 1;
+    mEdgeCount = 0;
+    mLast = 0;
+
+    for (size_t i = length; i--; )
+        Extend(string[i]);
+    return true;
+}
+
+void
+SubstringMatcher::Match(const uint16_t *text, size_t length,
+                        uint32_t *lengths) const
+{
+    // Reading the text backwards, the longest suffix of what's been read
+    // which the reversed string contains is, read forwards, the longest
+    // prefix from here which the string contains.
+    int32_t state = 0;
+    uint32_t matched = 0;
+    for (size_t i = length; i--; ) {
+        int32_t e;
+        while ((e = Find(state, text[i])) < 0 && state) {
+            state = mStates[state].link;
+            matched = mStates[state].length;
+        }
+
+        if (e >= 0) {
+            state = mEdges[e].target;
+            matched++;
+        }
+        else
+            matched = 0;
+
+        lengths[i] = matched;
+    }
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
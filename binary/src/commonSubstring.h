@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+ * Finding what a string has in common with others, for completing the
+ * longest match. Like stringSearch, these have no XPCOM dependencies.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Finds, for each position in a text, the longest prefix of the text
+ * from there which appears anywhere in a given string, in time linear
+ * in the lengths of both. It's built on a suffix automaton of the
+ * string reversed, through which the text is run backwards.
+ */
+class SubstringMatcher {
+public:
+    SubstringMatcher();
+    ~SubstringMatcher();
+
+    /* Returns false if it can't allocate room for *string*. */
+    bool Init(const uint16_t *string, size_t length);
+
+    /*
+     * Sets lengths[i], for each i up to *length*, to the length of the
+     * longest prefix of text + i which appears in the string.
+     */
+    void Match(const uint16_t *text, size_t length, uint32_t *lengths) const;
+
+private:
+    SubstringMatcher(const SubstringMatcher&);
+    SubstringMatcher &operator=(const SubstringMatcher&);
+
+    struct State {
+        uint32_t length;
+        int32_t link;
+        int32_t edges;
+    };
+
+    struct Edge {
+        uint16_t unit;
+        int32_t target;
+        int32_t next;
+    };
+
+    bool Reserve(size_t length);
+    int32_t Find(int32_t state, uint16_t unit) const;
+    void AddEdge(int32_t state, uint16_t unit, int32_t target);
+    void Extend(uint16_t unit);
+
+    State *mStates;
+    Edge *mEdges;
+    size_t mCapacity;
+    int32_t mStateCount;
+    int32_t mEdgeCount;
+    int32_t mLast;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,202 @@
+#include "completionTokenizer.h"
+
+#include <string.h>
+
+// Stand-ins for the characters which javascript.jsm has as undefined
+// before it's seen the first, and as "" after an escape.
+enum {
+    UNDEFINED = -1,
+    EMPTY     = -2
+};
+
+/*
+ * The character classes of the regular expressions _buildStack tests
+ * characters with. A regular expression tests undefined as the string
+ * "undefined", which is made of word characters, and "" as nothing.
+ */
+
+static inline bool
+IsSpace(PRInt32 c)
+{
+    switch (c) {
+    case '\t': case '\n': case '\v': case '\f': case '\r': case ' ':
+    case 0x00A0: case 0x1680: case 0x180E: case 0x2028: case 0x2029:
+    case 0x202F: case 0x205F: case 0x3000: case 0xFEFF:
+        return true;
+    }
+    return c >= 0x2000 && c <= 0x200A;
+}
+
+/* /[a-zA-Z_$]/ */
+static inline bool
+IsIdentStart(PRInt32 c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           c == '_' || c == '$' || c == UNDEFINED;
+}
+
+/* /[\w$]/ */
+static inline bool
+IsWord(PRInt32 c)
+{
+    return IsIdentStart(c) || (c >= '0' && c <= '9');
+}
+
+/* /[\w$\])"']/, what a "." or "[" dereferences. */
+static inline bool
+IsDereferenced(PRInt32 c)
+{
+    return IsWord(c) || c == ']' || c == ')' || c == '"' || c == '\'';
+}
+
+/* Frames opened by these hold strings and regular expressions. */
+static inline bool
+IsQuote(PRUnichar c)
+{
+    return c == '"' || c == '\'' || c == '/';
+}
+
+CompletionTokenizer::CompletionTokenizer()
+    : mValid(false), mLastChar(UNDEFINED), mLastNonwhite(UNDEFINED),
+      mResumed(false), mPopStatement(false), mLastIndex(0),
+      mCaretMatch(-1), mErrorOffset(0), mErrorLength(0)
+{
+}
+
+void
+CompletionTokenizer::Push(PRUint32 offset, PRUnichar opener)
+{
+    Frame *frame = mStack.AppendElement();
+    frame->offset = offset;
+    frame->opener = opener;
+    frame->statements.AppendElement(offset);
+}
+
+bool
+CompletionTokenizer::Pop(PRUnichar opener, PRUint32 i, PRInt32 caret)
+{
+    Frame &top = Top();
+    if (PRInt32(i) == caret - 1)
+        mCaretMatch = top.offset;
+
+    if (top.opener != opener) {
+        mErrorOffset = top.offset;
+        mErrorLength = i - top.offset;
+        return false;
+    }
+
+    mStack.RemoveElementAt(mStack.Length() - 1);
+    return true;
+}
+
+bool
+CompletionTokenizer::Build(const nsAString &aText, PRInt32 caret)
+{
+    const PRUnichar *text = aText.BeginReading();
+    PRUint32 length = aText.Length();
+    PRUint32 i = 0;
+
+    mCaretMatch = -1;
+    mResumed = mValid && !mText.IsEmpty() && length >= mText.Length() &&
+               !memcmp(text, mText.get(), mText.Length() * sizeof *text);
+
+    if (mResumed) {
+        i = mText.Length();
+        if (mPopStatement && !Top().statements.IsEmpty())
+            Top().statements.RemoveElementAt(Top().statements.Length() - 1);
+    }
+    else {
+        mStack.Clear();
+        mFunctions.Clear();
+        Push(0, 0);
+    }
+
+    mText.Assign(aText);
+    mValid = false;
+
+    PRInt32 c = EMPTY;
+    for (; i < length; mLastChar = c, i++) {
+        c = text[i];
+
+        if (IsQuote(Top().opener)) {
+            // Escapes skip the next character, whatever it may be, and
+            // the one after it, as _buildStack's do.
+            if (mLastChar == '\\') {
+                c = EMPTY;
+                i++;
+            }
+            else if (c == Top().opener && !Pop(c, i, caret))
+                return false;
+            continue;
+        }
+
+        nsTArray<PRUint32> &statements = Top().statements;
+
+        // A word character following a non-word character, or simply a
+        // non-word character, starts a new statement.
+        if ((IsIdentStart(c) && !IsWord(mLastChar)) || !(IsWord(c) || IsSpace(c)))
+            statements.AppendElement(i);
+
+        // A "." or a "[" dereferences the last statement, and so joins it
+        // to this one.
+        if (((c == '.' || c == '[') && IsDereferenced(mLastNonwhite)) ||
+            (mLastNonwhite == '.' && IsIdentStart(c))) {
+            if (!statements.IsEmpty())
+                statements.RemoveElementAt(statements.Length() - 1);
+        }
+
+        switch (c) {
+        case '(':
+            // A function call, or if/while/for/...
+            if (IsWord(mLastNonwhite)) {
+                mFunctions.AppendElement(i);
+                Top().functions.AppendElement(i);
+                if (!statements.IsEmpty())
+                    statements.RemoveElementAt(statements.Length() - 1);
+            }
+        case '"':
+        case '\'':
+        case '/':
+        case '{':
+        case '[':
+            Push(i, c);
+            break;
+        case '.':
+            Top().dots.AppendElement(i);
+            break;
+        case ')':
+            if (!Pop('(', i, caret))
+                return false;
+            break;
+        case ']':
+            if (!Pop('[', i, caret))
+                return false;
+            break;
+        case '}':
+            if (!Pop('{', i, caret))
+                return false;
+            // Fall through.
+        case ';':
+            Top().fullStatements.AppendElement(i);
+            break;
+        case ',':
+            Top().comma.AppendElement(i);
+            break;
+        }
+
+        if (!IsSpace(c))
+            mLastNonwhite = c;
+    }
+
+    mPopStatement = false;
+    if (!IsWord(mLastChar) && mLastNonwhite != '.') {
+        mPopStatement = true;
+        Top().statements.AppendElement(i);
+    }
+
+    mLastIndex = i;
+    mValid = true;
+    return true;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
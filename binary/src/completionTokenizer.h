@@ -0,0 +1,81 @@
+#pragma once
+
+#include "config.h"
+
+#include "nsStringAPI.h"
+#include "nsTArray.h"
+
+/*
+ * Builds the stack of open brackets, strings and statements which
+ * JavaScript completion walks to find what's being completed, exactly as
+ * JavaScript._buildStack in javascript.jsm does, down to the way it
+ * treats characters it hasn't yet seen. When a new line extends the
+ * last one, it carries on from where that left off.
+ */
+class CompletionTokenizer {
+public:
+    /*
+     * A level of the stack: where it was opened and by what, or zero
+     * for the root, and the offsets of what's been seen in it.
+     */
+    struct Frame {
+        PRUint32 offset;
+        PRUnichar opener;
+        nsTArray<PRUint32> statements;
+        nsTArray<PRUint32> dots;
+        nsTArray<PRUint32> fullStatements;
+        nsTArray<PRUint32> comma;
+        nsTArray<PRUint32> functions;
+    };
+
+    CompletionTokenizer() NS_HIDDEN;
+
+    /*
+     * Builds the stack for *text*. Returns false if a closing bracket
+     * doesn't match the one opened, which leaves the stack to be rebuilt
+     * from scratch by the next call.
+     */
+    NS_HIDDEN_(bool) Build(const nsAString &text, PRInt32 caret);
+
+    const nsTArray<Frame> &Stack() const { return mStack; }
+    const nsTArray<PRUint32> &Functions() const { return mFunctions; }
+
+    // Whether the last build carried on from the one before it.
+    bool Resumed() const { return mResumed; }
+    // Whether it ended by opening a statement which the next will close.
+    bool PopStatement() const { return mPopStatement; }
+    PRUint32 LastIndex() const { return mLastIndex; }
+
+    // The offset of the bracket closed just before the caret, or -1.
+    PRInt32 CaretMatch() const { return mCaretMatch; }
+
+    // Where the bracket which failed to match was opened, and how far
+    // from there it was closed.
+    PRUint32 ErrorOffset() const { return mErrorOffset; }
+    PRUint32 ErrorLength() const { return mErrorLength; }
+
+private:
+    Frame &Top() { return mStack[mStack.Length() - 1]; }
+
+    void Push(PRUint32 offset, PRUnichar opener);
+    bool Pop(PRUnichar opener, PRUint32 i, PRInt32 caret);
+
+    nsString mText;
+    bool mValid;
+
+    nsTArray<Frame> mStack;
+    nsTArray<PRUint32> mFunctions;
+
+    // Characters, or the stand-ins for undefined and "" in the .cpp.
+    PRInt32 mLastChar;
+    PRInt32 mLastNonwhite;
+
+    bool mResumed;
+    bool mPopStatement;
+    PRUint32 mLastIndex;
+    PRInt32 mCaretMatch;
+    PRUint32 mErrorOffset;
+    PRUint32 mErrorLength;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
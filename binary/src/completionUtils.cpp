@@ -0,0 +1,1005 @@
+/*
+ * The parts of dactylUtils which do the heavy lifting for completion.
+ */
+
+#include "dactylUtils.h"
+#include "commonSubstring.h"
+#include "completionTokenizer.h"
+#include "foldCache.h"
+#include "fuzzyMatch.h"
+#include "stringSearch.h"
+#include "trigramIndex.h"
+
+#include "nsAlgorithm.h"
+#include "nsAutoPtr.h"
+#include "nsTArray.h"
+
+#include "jsapi.h"
+#include "jstypedarray.h"
+
+#include <string.h>
+
+/*
+ * Collects the strings in the JS array *aStrings*. Anything which isn't
+ * a string is converted into one, which is kept alive in *converted*
+ * for as long as it's on our stack.
+ */
+static nsresult
+GetStringList(JSContext *cx, const jsval &aStrings,
+              nsTArray<JSString*> &strings, JSObject **converted)
+{
+    NS_ENSURE_FALSE(JSVAL_IS_PRIMITIVE(aStrings), NS_ERROR_XPC_BAD_CONVERT_JS);
+    JSObject *array = JSVAL_TO_OBJECT(aStrings);
+    NS_ENSURE_TRUE(JS_IsArrayObject(cx, array), NS_ERROR_XPC_BAD_CONVERT_JS);
+
+    jsuint length;
+    NS_ENSURE_TRUE(JS_GetArrayLength(cx, array, &length), NS_ERROR_FAILURE);
+    NS_ENSURE_TRUE(strings.SetCapacity(length), NS_ERROR_OUT_OF_MEMORY);
+
+    *converted = nsnull;
+    for (jsuint i = 0; i < length; i++) {
+        jsval v;
+        NS_ENSURE_TRUE(JS_GetElement(cx, array, i, &v), NS_ERROR_FAILURE);
+
+        if (!JSVAL_IS_STRING(v)) {
+            JSString *str = JS_ValueToString(cx, v);
+            NS_ENSURE_TRUE(str, NS_ERROR_FAILURE);
+            v = STRING_TO_JSVAL(str);
+
+            if (!*converted)
+                *converted = JS_NewArrayObject(cx, 0, nsnull);
+            NS_ENSURE_TRUE(*converted &&
+                           JS_SetElement(cx, *converted, i, &v),
+                           NS_ERROR_FAILURE);
+        }
+        strings.AppendElement(JSVAL_TO_STRING(v));
+    }
+    return NS_OK;
+}
+
+static inline bool
+Matches(const jschar *haystack, size_t length,
+        const jschar *needle, size_t needleLength, bool anchored)
+{
+    if (anchored)
+        return length >= needleLength &&
+               !memcmp(haystack, needle, needleLength * sizeof *needle);
+
+    return FindSubstring(reinterpret_cast<const uint16_t*>(haystack), length,
+                         reinterpret_cast<const uint16_t*>(needle),
+                         needleLength) != kNotFound;
+}
+
+/*
+ * Where the filter appears in each of a list of strings, for
+ * highlighting. The spans for the *i*th string are the [start, length]
+ * pairs from spans[offsets[i] * 2] up to spans[offsets[i + 1] * 2].
+ */
+struct SpanList {
+    nsTArray<PRUint32> offsets;
+    nsTArray<PRUint32> spans;
+};
+
+/*
+ * Appends to *spans* the next string's spans: each place *filter* appears
+ * in *text*, without overlapping, as highlightFilter would find them.
+ */
+static void
+AppendSpans(const jschar *text, size_t length, const nsTArray<jschar> &filter,
+            SpanList &spans)
+{
+    spans.offsets.AppendElement(spans.spans.Length() / 2);
+    if (filter.IsEmpty())
+        return;
+
+    for (size_t start = 0; start + filter.Length() <= length; ) {
+        size_t index = FindSubstring(reinterpret_cast<const uint16_t*>(text + start),
+                                     length - start,
+                                     reinterpret_cast<const uint16_t*>(filter.Elements()),
+                                     filter.Length());
+        if (index == kNotFound)
+            break;
+
+        spans.spans.AppendElement(start + index);
+        spans.spans.AppendElement(filter.Length());
+        start += index + filter.Length();
+    }
+}
+
+/*
+ * Appends to *matches* the indices of those of *strings* which match
+ * *filter*, either all of them or only those listed in *candidates*, and
+ * their spans to *spans*, if it's given. Their folded text is matched if
+ * *folded* is given.
+ */
+static bool
+MatchStrings(JSContext *cx, const nsTArray<JSString*> &strings,
+             const FoldedStrings *folded, const nsTArray<PRUint32> *candidates,
+             const nsTArray<jschar> &filter, bool anchored,
+             nsTArray<PRUint32> &matches, SpanList *spans)
+{
+    PRUint32 count = candidates ? candidates->Length() : strings.Length();
+    for (PRUint32 n = 0; n < count; n++) {
+        PRUint32 i = candidates ? candidates->ElementAt(n) : n;
+
+        size_t length;
+        const jschar *chars = folded ? folded->Text(i, &length)
+                                     : JS_GetStringCharsAndLength(cx, strings[i],
+                                                                  &length);
+        if (!chars)
+            return false;
+
+        if (Matches(chars, length, filter.Elements(), filter.Length(), anchored)) {
+            matches.AppendElement(i);
+            if (spans)
+                AppendSpans(chars, length, filter, *spans);
+        }
+    }
+
+    if (spans)
+        spans->offsets.AppendElement(spans->spans.Length() / 2);
+    return true;
+}
+
+/* Copies *aString* into *out*, lowercased if *ignoreCase*. */
+static bool
+CopyString(JSContext *cx, const nsAString &aString, bool ignoreCase,
+           nsTArray<jschar> &out)
+{
+    out.Clear();
+    if (!ignoreCase)
+        return out.AppendElements(aString.BeginReading(), aString.Length());
+
+    JSString *str = JS_NewUCStringCopyN(cx,
+                                        reinterpret_cast<const jschar*>(aString.BeginReading()),
+                                        aString.Length());
+    return str && FoldCase(cx, str, out);
+}
+
+/* Returns a new typed array of *type* holding *count* *values*. */
+static JSObject*
+NewTypedArray(JSContext *cx, jsint type, const void *values, PRUint32 count,
+              size_t size)
+{
+    JSObject *obj = js_CreateTypedArray(cx, type, count);
+    if (!obj)
+        return nsnull;
+
+    void *data = js::TypedArray::getDataOffset(js::TypedArray::getTypedArray(obj));
+    memcpy(data, values, count * size);
+    return obj;
+}
+
+/* Defines *obj*'s spanOffsets and spans properties as Uint32Arrays. */
+static bool
+DefineSpans(JSContext *cx, JSObject *obj, const SpanList &spans)
+{
+    JSObject *offsets = NewTypedArray(cx, js::TypedArray::TYPE_UINT32,
+                                      spans.offsets.Elements(),
+                                      spans.offsets.Length(), sizeof(PRUint32));
+    if (!offsets ||
+        !JS_DefineProperty(cx, obj, "spanOffsets", OBJECT_TO_JSVAL(offsets),
+                           nsnull, nsnull, JSPROP_ENUMERATE))
+        return false;
+
+    JSObject *array = NewTypedArray(cx, js::TypedArray::TYPE_UINT32,
+                                    spans.spans.Elements(),
+                                    spans.spans.Length(), sizeof(PRUint32));
+    return array &&
+           JS_DefineProperty(cx, obj, "spans", OBJECT_TO_JSVAL(array),
+                             nsnull, nsnull, JSPROP_ENUMERATE);
+}
+
+/*
+ * Returns what filterStrings returns for *matches*: a Uint32Array of
+ * them, or with *spans*, { indices, spanOffsets, spans }.
+ */
+static JSObject*
+NewFilterResult(JSContext *cx, const nsTArray<PRUint32> &matches,
+                const SpanList *spans)
+{
+    JSObject *indices = NewTypedArray(cx, js::TypedArray::TYPE_UINT32,
+                                      matches.Elements(), matches.Length(),
+                                      sizeof(PRUint32));
+    if (!indices || !spans)
+        return indices;
+
+    JSObject *result = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    if (!result ||
+        !JS_DefineProperty(cx, result, "indices", OBJECT_TO_JSVAL(indices),
+                           nsnull, nsnull, JSPROP_ENUMERATE) ||
+        !DefineSpans(cx, result, *spans))
+        return nsnull;
+    return result;
+}
+
+NS_IMETHODIMP
+dactylUtils::FilterStrings(const jsval &aStrings,
+                           const nsAString &aFilter,
+                           PRUint32 aFlags,
+                           JSContext *cx,
+                           jsval *retval)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsTArray<JSString*> strings;
+    JSObject *converted;
+    rv = GetStringList(cx, aStrings, strings, &converted);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    bool ignoreCase = aFlags & FILTER_IGNORE_CASE;
+
+    nsTArray<jschar> filter;
+    NS_ENSURE_TRUE(CopyString(cx, aFilter, ignoreCase, filter),
+                   NS_ERROR_FAILURE);
+
+    FoldCache::Entry *folded = nsnull;
+    if (ignoreCase) {
+        folded = mFoldCache.Get(cx, strings);
+        NS_ENSURE_TRUE(folded, NS_ERROR_FAILURE);
+    }
+
+    SpanList spans;
+    SpanList *wantSpans = aFlags & FILTER_SPANS ? &spans : nsnull;
+
+    nsTArray<PRUint32> matches;
+    NS_ENSURE_TRUE(MatchStrings(cx, strings, folded, nsnull, filter,
+                                aFlags & FILTER_ANCHORED, matches, wantSpans),
+                   NS_ERROR_FAILURE);
+
+    JSObject *result = NewFilterResult(cx, matches, wantSpans);
+    NS_ENSURE_TRUE(result, NS_ERROR_OUT_OF_MEMORY);
+
+    *retval = OBJECT_TO_JSVAL(result);
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::MatchSpans(const jsval &aStrings,
+                        const nsAString &aFilter,
+                        PRUint32 aFlags,
+                        JSContext *cx,
+                        jsval *retval)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsTArray<JSString*> strings;
+    JSObject *converted;
+    rv = GetStringList(cx, aStrings, strings, &converted);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    bool ignoreCase = aFlags & FILTER_IGNORE_CASE;
+
+    nsTArray<jschar> filter;
+    NS_ENSURE_TRUE(CopyString(cx, aFilter, ignoreCase, filter),
+                   NS_ERROR_FAILURE);
+
+    // A page of rows is seldom seen twice, so isn't worth caching.
+    FoldedStrings folded;
+    if (ignoreCase)
+        NS_ENSURE_TRUE(folded.Fold(cx, strings), NS_ERROR_FAILURE);
+
+    SpanList spans;
+    for (PRUint32 i = 0; i < strings.Length(); i++) {
+        size_t length;
+        const jschar *chars = ignoreCase ? folded.Text(i, &length)
+                                         : JS_GetStringCharsAndLength(cx, strings[i],
+                                                                      &length);
+        NS_ENSURE_TRUE(chars, NS_ERROR_FAILURE);
+
+        AppendSpans(chars, length, filter, spans);
+    }
+    spans.offsets.AppendElement(spans.spans.Length() / 2);
+
+    JSObject *result = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    NS_ENSURE_TRUE(result, NS_ERROR_OUT_OF_MEMORY);
+    *retval = OBJECT_TO_JSVAL(result);
+
+    NS_ENSURE_TRUE(DefineSpans(cx, result, spans), NS_ERROR_FAILURE);
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::ScoreStrings(const jsval &aStrings,
+                          const nsAString &aFilter,
+                          PRUint32 aLimit,
+                          PRUint32 aFlags,
+                          JSContext *cx,
+                          jsval *retval)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsTArray<JSString*> strings;
+    JSObject *converted;
+    rv = GetStringList(cx, aStrings, strings, &converted);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    bool anchored = aFlags & FILTER_ANCHORED;
+    bool ignoreCase = aFlags & FILTER_IGNORE_CASE;
+
+    nsTArray<jschar> filter;
+    NS_ENSURE_TRUE(CopyString(cx, aFilter, ignoreCase, filter),
+                   NS_ERROR_FAILURE);
+
+    FoldCache::Entry *folded = nsnull;
+    if (ignoreCase) {
+        folded = mFoldCache.Get(cx, strings);
+        NS_ENSURE_TRUE(folded, NS_ERROR_FAILURE);
+    }
+
+    TopScores top;
+    NS_ENSURE_TRUE(top.Init(aLimit ? NS_MIN<PRUint32>(aLimit, strings.Length())
+                                   : strings.Length()),
+                   NS_ERROR_OUT_OF_MEMORY);
+
+    FuzzyScorer scorer;
+    for (PRUint32 i = 0; i < strings.Length(); i++) {
+        size_t length;
+        const jschar *chars = JS_GetStringCharsAndLength(cx, strings[i], &length);
+        NS_ENSURE_TRUE(chars, NS_ERROR_FAILURE);
+
+        // Word boundaries are found in the original text, unless folding
+        // changed its length.
+        const jschar *foldedChars = chars;
+        if (folded) {
+            size_t foldedLength;
+            foldedChars = folded->Text(i, &foldedLength);
+            if (foldedLength != length) {
+                chars = foldedChars;
+                length = foldedLength;
+            }
+        }
+
+        int32_t score;
+        if (scorer.Score(reinterpret_cast<const uint16_t*>(chars),
+                         reinterpret_cast<const uint16_t*>(foldedChars), length,
+                         reinterpret_cast<const uint16_t*>(filter.Elements()),
+                         filter.Length(), anchored, &score))
+            top.Add(score, i);
+    }
+
+    size_t count;
+    const TopScores::Item *items = top.Sort(&count);
+
+    nsTArray<PRUint32> indices(count);
+    nsTArray<PRInt32> scores(count);
+    for (size_t i = 0; i < count; i++) {
+        indices.AppendElement(items[i].index);
+        scores.AppendElement(items[i].score);
+    }
+
+    JSObject *result = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    NS_ENSURE_TRUE(result, NS_ERROR_OUT_OF_MEMORY);
+    *retval = OBJECT_TO_JSVAL(result);
+
+    JSObject *indexArray = NewTypedArray(cx, js::TypedArray::TYPE_UINT32,
+                                         indices.Elements(), indices.Length(),
+                                         sizeof(PRUint32));
+    NS_ENSURE_TRUE(indexArray, NS_ERROR_OUT_OF_MEMORY);
+    NS_ENSURE_TRUE(JS_DefineProperty(cx, result, "indices",
+                                     OBJECT_TO_JSVAL(indexArray),
+                                     nsnull, nsnull, JSPROP_ENUMERATE),
+                   NS_ERROR_FAILURE);
+
+    JSObject *scoreArray = NewTypedArray(cx, js::TypedArray::TYPE_INT32,
+                                         scores.Elements(), scores.Length(),
+                                         sizeof(PRInt32));
+    NS_ENSURE_TRUE(scoreArray, NS_ERROR_OUT_OF_MEMORY);
+    NS_ENSURE_TRUE(JS_DefineProperty(cx, result, "scores",
+                                     OBJECT_TO_JSVAL(scoreArray),
+                                     nsnull, nsnull, JSPROP_ENUMERATE),
+                   NS_ERROR_FAILURE);
+
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::CommonSubstrings(const nsAString &aText,
+                              const jsval &aStrings,
+                              const nsAString &aFilter,
+                              PRUint32 aFlags,
+                              JSContext *cx,
+                              jsval *retval)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsTArray<JSString*> strings;
+    JSObject *converted;
+    rv = GetStringList(cx, aStrings, strings, &converted);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    bool ignoreCase = aFlags & FILTER_IGNORE_CASE;
+
+    nsTArray<jschar> text, filter;
+    NS_ENSURE_TRUE(CopyString(cx, aText, ignoreCase, text) &&
+                   CopyString(cx, aFilter, ignoreCase, filter),
+                   NS_ERROR_FAILURE);
+
+    FoldCache::Entry *folded = nsnull;
+    if (ignoreCase) {
+        folded = mFoldCache.Get(cx, strings);
+        NS_ENSURE_TRUE(folded, NS_ERROR_FAILURE);
+    }
+
+    // The candidates are the text itself, when anchored, or else each
+    // suffix of it which begins with the filter. Each is cut short to
+    // the longest prefix of it which every string has in common with
+    // it, as a prefix or anywhere at all respectively.
+    nsTArray<PRUint32> starts, lengths;
+    if (aFlags & FILTER_ANCHORED) {
+        starts.AppendElement(0);
+        lengths.AppendElement(text.Length());
+    }
+    else
+        for (PRUint32 start = 0; start < text.Length(); ) {
+            size_t index = FindSubstring(reinterpret_cast<const uint16_t*>(text.Elements() + start),
+                                         text.Length() - start,
+                                         reinterpret_cast<const uint16_t*>(filter.Elements()),
+                                         filter.Length());
+            if (index == kNotFound)
+                break;
+
+            starts.AppendElement(start + index);
+            lengths.AppendElement(text.Length() - start - index);
+            start += index + 1;
+        }
+
+    SubstringMatcher matcher;
+    nsTArray<PRUint32> found;
+    NS_ENSURE_TRUE(found.SetLength(text.Length()), NS_ERROR_OUT_OF_MEMORY);
+
+    for (PRUint32 i = 0; i < strings.Length() && !starts.IsEmpty(); i++) {
+        size_t length;
+        const jschar *chars = folded ? folded->Text(i, &length)
+                                     : JS_GetStringCharsAndLength(cx, strings[i],
+                                                                  &length);
+        NS_ENSURE_TRUE(chars, NS_ERROR_FAILURE);
+
+        if (aFlags & FILTER_ANCHORED) {
+            PRUint32 n = 0;
+            while (n < lengths[0] && n < length && chars[n] == text[n])
+                n++;
+            lengths[0] = n;
+            continue;
+        }
+
+        NS_ENSURE_TRUE(matcher.Init(reinterpret_cast<const uint16_t*>(chars),
+                                    length),
+                       NS_ERROR_OUT_OF_MEMORY);
+        matcher.Match(reinterpret_cast<const uint16_t*>(text.Elements()),
+                      text.Length(), found.Elements());
+
+        bool any = false;
+        for (PRUint32 c = 0; c < starts.Length(); c++) {
+            lengths[c] = NS_MIN(lengths[c], found[starts[c]]);
+            any |= lengths[c] > 0;
+        }
+        if (!any)
+            break;
+    }
+
+    JSObject *result = JS_NewArrayObject(cx, 0, nsnull);
+    NS_ENSURE_TRUE(result, NS_ERROR_OUT_OF_MEMORY);
+    *retval = OBJECT_TO_JSVAL(result);
+
+    for (PRUint32 c = 0; c < starts.Length(); c++) {
+        JSString *str = JS_NewUCStringCopyN(cx, text.Elements() + starts[c],
+                                            lengths[c]);
+        NS_ENSURE_TRUE(str, NS_ERROR_OUT_OF_MEMORY);
+
+        jsval v = STRING_TO_JSVAL(str);
+        NS_ENSURE_TRUE(JS_SetElement(cx, result, c, &v), NS_ERROR_FAILURE);
+    }
+    return NS_OK;
+}
+
+/*
+ * The native half of a handle from createCompletionFilter: its strings,
+ * their folded text if case is ignored, and the last filter along with
+ * the strings which matched it. The handle's reserved slot holds an
+ * array of the strings, so that they live as long as it does.
+ */
+struct CompletionFilter {
+    nsTArray<JSString*> strings;
+    FoldedStrings folded;
+    bool anchored;
+    bool ignoreCase;
+    bool spans;
+
+    bool filtered;
+    nsTArray<jschar> filter;
+    nsTArray<PRUint32> candidates;
+};
+
+enum {
+    COMPLETION_FILTER_STRINGS_SLOT,
+    COMPLETION_FILTER_SLOTS
+};
+
+static void
+CompletionFilterFinalize(JSContext *cx, JSObject *obj)
+{
+    delete static_cast<CompletionFilter*>(JS_GetPrivate(cx, obj));
+}
+
+static JSClass gCompletionFilterClass = {
+    "CompletionFilter",
+    JSCLASS_HAS_PRIVATE | JSCLASS_HAS_RESERVED_SLOTS(COMPLETION_FILTER_SLOTS),
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, CompletionFilterFinalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+/*
+ * Whether every string matching *filter* must also match *previous*, so
+ * that only the strings which matched it need be tried.
+ */
+static bool
+Narrows(const nsTArray<jschar> &filter, const nsTArray<jschar> &previous,
+        bool anchored)
+{
+    return Matches(filter.Elements(), filter.Length(),
+                   previous.Elements(), previous.Length(), anchored);
+}
+
+/* handle.filter(filter) */
+static JSBool
+CompletionFilterFilter(JSContext *cx, uintN argc, jsval *vp)
+{
+    JSObject *obj = JS_THIS_OBJECT(cx, vp);
+    if (!obj)
+        return JS_FALSE;
+
+    CompletionFilter *cf = static_cast<CompletionFilter*>(
+        JS_GetInstancePrivate(cx, obj, &gCompletionFilterClass, JS_ARGV(cx, vp)));
+    if (!cf)
+        return JS_FALSE;
+
+    JSString *filterStr;
+    if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "S", &filterStr))
+        return JS_FALSE;
+
+    size_t length;
+    const jschar *chars = JS_GetStringCharsAndLength(cx, filterStr, &length);
+    if (!chars)
+        return JS_FALSE;
+
+    nsTArray<jschar> filter;
+    if (!CopyString(cx, nsDependentString(reinterpret_cast<const PRUnichar*>(chars),
+                                         length),
+                   cf->ignoreCase, filter))
+        return JS_FALSE;
+
+    // Strings are folded the first time they're needed.
+    if (cf->ignoreCase && cf->folded.offsets.IsEmpty() &&
+        !cf->folded.Fold(cx, cf->strings))
+        return JS_FALSE;
+
+    bool narrow = cf->filtered && Narrows(filter, cf->filter, cf->anchored);
+
+    SpanList spans;
+    SpanList *wantSpans = cf->spans ? &spans : nsnull;
+
+    nsTArray<PRUint32> matches;
+    if (!MatchStrings(cx, cf->strings, cf->ignoreCase ? &cf->folded : nsnull,
+                      narrow ? &cf->candidates : nsnull, filter, cf->anchored,
+                      matches, wantSpans))
+        return JS_FALSE;
+
+    JSObject *result = NewFilterResult(cx, matches, wantSpans);
+    if (!result)
+        return JS_FALSE;
+
+    cf->filtered = true;
+    cf->filter.SwapElements(filter);
+    cf->candidates.SwapElements(matches);
+
+    JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(result));
+    return JS_TRUE;
+}
+
+static JSFunctionSpec gCompletionFilterFun[] = {
+    {"filter",  CompletionFilterFilter, 1,0},
+    {nsnull,nsnull,0,0}
+};
+
+NS_IMETHODIMP
+dactylUtils::CreateCompletionFilter(const jsval &aStrings,
+                                    PRUint32 aFlags,
+                                    JSContext *cx,
+                                    jsval *rval)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsAutoPtr<CompletionFilter> cf(new CompletionFilter());
+    JSObject *converted;
+    rv = GetStringList(cx, aStrings, cf->strings, &converted);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    cf->anchored = aFlags & FILTER_ANCHORED;
+    cf->ignoreCase = aFlags & FILTER_IGNORE_CASE;
+    cf->spans = aFlags & FILTER_SPANS;
+    cf->filtered = false;
+
+    nsTArray<jsval> vals(cf->strings.Length());
+    for (PRUint32 i = 0; i < cf->strings.Length(); i++)
+        vals.AppendElement(STRING_TO_JSVAL(cf->strings[i]));
+
+    JSObject *strings = JS_NewArrayObject(cx, vals.Length(), vals.Elements());
+    NS_ENSURE_TRUE(strings, NS_ERROR_OUT_OF_MEMORY);
+
+    JSObject *obj = JS_NewObject(cx, &gCompletionFilterClass, nsnull, nsnull);
+    NS_ENSURE_TRUE(obj, NS_ERROR_OUT_OF_MEMORY);
+
+    // From here on, the finalizer frees it.
+    NS_ENSURE_TRUE(JS_SetPrivate(cx, obj, cf), NS_ERROR_FAILURE);
+    cf.forget();
+
+    NS_ENSURE_TRUE(JS_SetReservedSlot(cx, obj, COMPLETION_FILTER_STRINGS_SLOT,
+                                      OBJECT_TO_JSVAL(strings)) &&
+                   JS_DefineFunctions(cx, obj, gCompletionFilterFun),
+                   NS_ERROR_FAILURE);
+
+    *rval = OBJECT_TO_JSVAL(obj);
+    return NS_OK;
+}
+
+/*
+ * The native half of a handle from createTrigramIndex, along with
+ * whether its texts and filters are folded.
+ */
+struct TrigramIndexHandle {
+    TrigramIndex index;
+    bool ignoreCase;
+};
+
+static void
+TrigramIndexFinalize(JSContext *cx, JSObject *obj)
+{
+    delete static_cast<TrigramIndexHandle*>(JS_GetPrivate(cx, obj));
+}
+
+static JSClass gTrigramIndexClass = {
+    "TrigramIndex",
+    JSCLASS_HAS_PRIVATE,
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, TrigramIndexFinalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+static TrigramIndexHandle*
+GetTrigramIndex(JSContext *cx, jsval *vp)
+{
+    JSObject *obj = JS_THIS_OBJECT(cx, vp);
+    if (!obj)
+        return nsnull;
+
+    return static_cast<TrigramIndexHandle*>(
+        JS_GetInstancePrivate(cx, obj, &gTrigramIndexClass, JS_ARGV(cx, vp)));
+}
+
+/*
+ * Appends *str* to *out*, folded if need be. Text is indexed and
+ * searched as jschars, which are PRUnichars by another name.
+ */
+static bool
+AppendText(JSContext *cx, JSString *str, bool ignoreCase, nsString &out)
+{
+    nsTArray<jschar> chars;
+    if (ignoreCase) {
+        if (!FoldCase(cx, str, chars))
+            return false;
+    }
+    else {
+        size_t length;
+        const jschar *c = JS_GetStringCharsAndLength(cx, str, &length);
+        if (!c || !chars.AppendElements(c, length))
+            return false;
+    }
+
+    out.Append(reinterpret_cast<const PRUnichar*>(chars.Elements()),
+               chars.Length());
+    return true;
+}
+
+/* handle.add(id, text, ...) */
+static JSBool
+TrigramIndexAdd(JSContext *cx, uintN argc, jsval *vp)
+{
+    TrigramIndexHandle *handle = GetTrigramIndex(cx, vp);
+    if (!handle)
+        return JS_FALSE;
+
+    uint32 id;
+    if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "u", &id))
+        return JS_FALSE;
+
+    // Each of an entry's texts, such as its URL and title, is kept apart
+    // from the others by a NUL, which no filter contains.
+    nsString text;
+    for (uintN i = 1; i < argc; i++) {
+        JSString *str = JS_ValueToString(cx, JS_ARGV(cx, vp)[i]);
+        if (!str)
+            return JS_FALSE;
+
+        if (i > 1)
+            text.Append(PRUnichar(0));
+        if (!AppendText(cx, str, handle->ignoreCase, text))
+            return JS_FALSE;
+    }
+
+    if (!handle->index.Add(id, text)) {
+        JS_ReportOutOfMemory(cx);
+        return JS_FALSE;
+    }
+
+    JS_SET_RVAL(cx, vp, JSVAL_VOID);
+    return JS_TRUE;
+}
+
+/* handle.remove(id) */
+static JSBool
+TrigramIndexRemove(JSContext *cx, uintN argc, jsval *vp)
+{
+    TrigramIndexHandle *handle = GetTrigramIndex(cx, vp);
+    if (!handle)
+        return JS_FALSE;
+
+    uint32 id;
+    if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "u", &id))
+        return JS_FALSE;
+
+    handle->index.Remove(id);
+
+    JS_SET_RVAL(cx, vp, JSVAL_VOID);
+    return JS_TRUE;
+}
+
+/* handle.query(filter) */
+static JSBool
+TrigramIndexQuery(JSContext *cx, uintN argc, jsval *vp)
+{
+    TrigramIndexHandle *handle = GetTrigramIndex(cx, vp);
+    if (!handle)
+        return JS_FALSE;
+
+    JSString *filterStr;
+    if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "S", &filterStr))
+        return JS_FALSE;
+
+    nsString filter;
+    if (!AppendText(cx, filterStr, handle->ignoreCase, filter))
+        return JS_FALSE;
+
+    nsTArray<PRUint32> ids;
+    if (!handle->index.Query(filter, ids)) {
+        JS_ReportOutOfMemory(cx);
+        return JS_FALSE;
+    }
+
+    JSObject *result = NewTypedArray(cx, js::TypedArray::TYPE_UINT32,
+                                     ids.Elements(), ids.Length(),
+                                     sizeof(PRUint32));
+    if (!result)
+        return JS_FALSE;
+
+    JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(result));
+    return JS_TRUE;
+}
+
+/* handle.count() */
+static JSBool
+TrigramIndexCount(JSContext *cx, uintN argc, jsval *vp)
+{
+    TrigramIndexHandle *handle = GetTrigramIndex(cx, vp);
+    if (!handle)
+        return JS_FALSE;
+
+    JS_SET_RVAL(cx, vp, UINT_TO_JSVAL(handle->index.Count()));
+    return JS_TRUE;
+}
+
+static JSFunctionSpec gTrigramIndexFun[] = {
+    {"add",     TrigramIndexAdd,    2,0},
+    {"remove",  TrigramIndexRemove, 1,0},
+    {"query",   TrigramIndexQuery,  1,0},
+    {"count",   TrigramIndexCount,  0,0},
+    {nsnull,nsnull,0,0}
+};
+
+NS_IMETHODIMP
+dactylUtils::CreateTrigramIndex(PRUint32 aFlags,
+                                JSContext *cx,
+                                jsval *rval)
+{
+    JSAutoRequest ar(cx);
+
+    nsAutoPtr<TrigramIndexHandle> handle(new TrigramIndexHandle());
+    handle->ignoreCase = aFlags & FILTER_IGNORE_CASE;
+    NS_ENSURE_TRUE(handle->index.Init(), NS_ERROR_OUT_OF_MEMORY);
+
+    JSObject *obj = JS_NewObject(cx, &gTrigramIndexClass, nsnull, nsnull);
+    NS_ENSURE_TRUE(obj, NS_ERROR_OUT_OF_MEMORY);
+
+    // From here on, the finalizer frees it.
+    NS_ENSURE_TRUE(JS_SetPrivate(cx, obj, handle), NS_ERROR_FAILURE);
+    handle.forget();
+
+    NS_ENSURE_TRUE(JS_DefineFunctions(cx, obj, gTrigramIndexFun),
+                   NS_ERROR_FAILURE);
+
+    *rval = OBJECT_TO_JSVAL(obj);
+    return NS_OK;
+}
+
+static void
+CompletionTokenizerFinalize(JSContext *cx, JSObject *obj)
+{
+    delete static_cast<CompletionTokenizer*>(JS_GetPrivate(cx, obj));
+}
+
+static JSClass gCompletionTokenizerClass = {
+    "CompletionTokenizer",
+    JSCLASS_HAS_PRIVATE,
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, CompletionTokenizerFinalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+static bool
+DefineProperty(JSContext *cx, JSObject *obj, const char *name, jsval v)
+{
+    return JS_DefineProperty(cx, obj, name, v, nsnull, nsnull, JSPROP_ENUMERATE);
+}
+
+/* Defines *obj*[*name*] as a plain array of *offsets*. */
+static bool
+DefineOffsets(JSContext *cx, JSObject *obj, const char *name,
+              const nsTArray<PRUint32> &offsets)
+{
+    JSObject *array = JS_NewArrayObject(cx, 0, nsnull);
+    if (!array || !DefineProperty(cx, obj, name, OBJECT_TO_JSVAL(array)))
+        return false;
+
+    for (PRUint32 i = 0; i < offsets.Length(); i++) {
+        jsval v = UINT_TO_JSVAL(offsets[i]);
+        if (!JS_SetElement(cx, array, i, &v))
+            return false;
+    }
+    return true;
+}
+
+/* Returns a frame as javascript.jsm's _push makes them. */
+static JSObject*
+NewFrame(JSContext *cx, const CompletionTokenizer::Frame &frame)
+{
+    JSObject *obj = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    if (!obj)
+        return nsnull;
+
+    JSString *opener = frame.opener
+        ? JS_NewUCStringCopyN(cx, reinterpret_cast<const jschar*>(&frame.opener), 1)
+        : JS_NewStringCopyZ(cx, "#root");
+
+    if (!opener ||
+        !DefineProperty(cx, obj, "offset", UINT_TO_JSVAL(frame.offset)) ||
+        !DefineProperty(cx, obj, "char", STRING_TO_JSVAL(opener)) ||
+        !DefineOffsets(cx, obj, "statements", frame.statements) ||
+        !DefineOffsets(cx, obj, "dots", frame.dots) ||
+        !DefineOffsets(cx, obj, "fullStatements", frame.fullStatements) ||
+        !DefineOffsets(cx, obj, "comma", frame.comma) ||
+        !DefineOffsets(cx, obj, "functions", frame.functions))
+        return nsnull;
+    return obj;
+}
+
+/* handle.build(text, [caret]) */
+static JSBool
+CompletionTokenizerBuild(JSContext *cx, uintN argc, jsval *vp)
+{
+    JSObject *obj = JS_THIS_OBJECT(cx, vp);
+    if (!obj)
+        return JS_FALSE;
+
+    CompletionTokenizer *tokenizer = static_cast<CompletionTokenizer*>(
+        JS_GetInstancePrivate(cx, obj, &gCompletionTokenizerClass, JS_ARGV(cx, vp)));
+    if (!tokenizer)
+        return JS_FALSE;
+
+    JSString *textStr;
+    int32 caret = -1;
+    if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "S / i",
+                             &textStr, &caret))
+        return JS_FALSE;
+
+    size_t length;
+    const jschar *chars = JS_GetStringCharsAndLength(cx, textStr, &length);
+    if (!chars)
+        return JS_FALSE;
+
+    bool ok = tokenizer->Build(nsDependentString(reinterpret_cast<const PRUnichar*>(chars),
+                                                 length),
+                               caret);
+
+    JSObject *result = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    if (!result)
+        return JS_FALSE;
+    JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(result));
+
+    if (!DefineProperty(cx, result, "caretMatch",
+                        INT_TO_JSVAL(tokenizer->CaretMatch())))
+        return JS_FALSE;
+
+    if (!ok) {
+        jsval error[] = {
+            UINT_TO_JSVAL(tokenizer->ErrorOffset()),
+            UINT_TO_JSVAL(tokenizer->ErrorLength())
+        };
+        JSObject *errorObj = JS_NewArrayObject(cx, 2, error);
+        return errorObj &&
+               DefineProperty(cx, result, "error", OBJECT_TO_JSVAL(errorObj));
+    }
+
+    const nsTArray<CompletionTokenizer::Frame> &frames = tokenizer->Stack();
+    JSObject *stack = JS_NewArrayObject(cx, 0, nsnull);
+    if (!stack ||
+        !DefineProperty(cx, result, "stack", OBJECT_TO_JSVAL(stack)) ||
+        !DefineOffsets(cx, result, "functions", tokenizer->Functions()) ||
+        !DefineProperty(cx, result, "resumed",
+                        BOOLEAN_TO_JSVAL(tokenizer->Resumed())) ||
+        !DefineProperty(cx, result, "popStatement",
+                        BOOLEAN_TO_JSVAL(tokenizer->PopStatement())) ||
+        !DefineProperty(cx, result, "lastIdx",
+                        UINT_TO_JSVAL(tokenizer->LastIndex())))
+        return JS_FALSE;
+
+    for (PRUint32 i = 0; i < frames.Length(); i++) {
+        JSObject *frame = NewFrame(cx, frames[i]);
+        if (!frame)
+            return JS_FALSE;
+
+        jsval v = OBJECT_TO_JSVAL(frame);
+        if (!JS_SetElement(cx, stack, i, &v))
+            return JS_FALSE;
+    }
+    return JS_TRUE;
+}
+
+static JSFunctionSpec gCompletionTokenizerFun[] = {
+    {"build",   CompletionTokenizerBuild,   2,0},
+    {nsnull,nsnull,0,0}
+};
+
+NS_IMETHODIMP
+dactylUtils::CreateCompletionTokenizer(JSContext *cx, jsval *rval)
+{
+    JSAutoRequest ar(cx);
+
+    JSObject *obj = JS_NewObject(cx, &gCompletionTokenizerClass, nsnull, nsnull);
+    NS_ENSURE_TRUE(obj, NS_ERROR_OUT_OF_MEMORY);
+
+    // From here on, the finalizer frees it.
+    CompletionTokenizer *tokenizer = new CompletionTokenizer();
+    if (!JS_SetPrivate(cx, obj, tokenizer)) {
+        delete tokenizer;
+        return NS_ERROR_FAILURE;
+    }
+
+    NS_ENSURE_TRUE(JS_DefineFunctions(cx, obj, gCompletionTokenizerFun),
+                   NS_ERROR_FAILURE);
+
+    *rval = OBJECT_TO_JSVAL(obj);
+    return NS_OK;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -36,22 +36,15 @@
  */
 
 #include "dactylUtils.h"
+#include "mappedSource.h"
+#include "utf8Decoder.h"
 
 #include "jsdbgapi.h"
+#include "jstypedarray.h"
 // #include "jsobj.h"
 
 #include "nsStringAPI.h"
 
-#if GECKO_MAJOR < 10
-    static inline JSObject*
-    JS_GetGlobalForScopeChain(JSContext *cx) {
-        JSObject *callingScope = JS_GetScopeChain(cx);
-        if (!callingScope)
-            return nsnull;
-        return JS_GetGlobalForObject(cx, callingScope);
-    }
-#endif
-
 /*
  * Evil. Evil, evil, evil.
  */
@@ -72,12 +65,26 @@ typedef nsString nsSubstring;
 #include "nsIDOMXULElement.h"
 #include "nsIXULTemplateBuilder.h"
 #include "nsIObserverService.h"
+#include "nsISupportsPrimitives.h"
+#include "nsPIDOMWindow.h"
+#include "nsIXULAppInfo.h"
+#include "nsILocalFile.h"
+#include "nsXPCOM.h"
+#include "nsAppDirectoryServiceDefs.h"
+#include "nsDirectoryServiceUtils.h"
 #include "nsIScriptSecurityManager.h"
 #include "nsIXPCScriptable.h"
 
 #include "nsComponentManagerUtils.h"
 #include "nsServiceManagerUtils.h"
+#include "nsTArray.h"
+#include "nsThreadUtils.h"
+
+#include "prlink.h"
+
 
+// Plenty for the snippets of a long session.
+#define EVAL_CACHE_LIMIT (1 << 20)
 
 class autoDropPrincipals {
 public:
@@ -119,13 +126,17 @@ static JSFunctionSpec gGlobalFun[] = {
 static dactylUtils* gService = nsnull;
 
 dactylUtils::dactylUtils()
-    : mRuntime(nsnull)
+    : mRuntime(nsnull), mThreadsShutDown(false)
 {
     NS_ASSERTION(gService == nsnull, "Service already exists");
 }
 
 dactylUtils::~dactylUtils()
 {
+    if (mDecodeThread)
+        mDecodeThread->Shutdown();
+    mDecodeThread = nsnull;
+
     mRuntimeService = nsnull;
     gService = nsnull;
 }
@@ -147,17 +158,163 @@ dactylUtils::Init()
     NS_ENSURE_TRUE(secman, NS_ERROR_FAILURE);
 
     rv = secman->GetSystemPrincipal(getter_AddRefs(mSystemPrincipal));
-    NS_ENSURE_TRUE(rv, rv);
+    NS_ENSURE_SUCCESS(rv, rv);
     NS_ENSURE_TRUE(mSystemPrincipal, NS_ERROR_FAILURE);
 
+    // Choose now, before the decoder thread might race us to it.
+    SetDecoderKernel(DECODER_KERNEL_BEST);
+
+    rv = mScriptCache.Init(mRuntime);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    rv = mEvalCache.Init(mRuntime);
+    NS_ENSURE_SUCCESS(rv, rv);
+    mEvalCache.SetLimit(EVAL_CACHE_LIMIT);
+
+    mFoldCache.Init(mRuntime);
+    mPropertyCache.Init(mRuntime);
+
+    NS_ENSURE_TRUE(mLoadStatistics.Init(64), NS_ERROR_OUT_OF_MEMORY);
+    NS_ENSURE_TRUE(mLazySubScripts.Init(32), NS_ERROR_OUT_OF_MEMORY);
+
+    // The prebuilt bundle lives beside us, if it was built at all.
+    char *path = PR_GetLibraryFilePathname("dactyl",
+                                           reinterpret_cast<PRFuncPtr>(Dump));
+    if (path) {
+        nsCOMPtr<nsILocalFile> file;
+        rv = NS_NewNativeLocalFile(nsDependentCString(path), PR_TRUE,
+                                   getter_AddRefs(file));
+        PR_Free(path);
+
+        nsCOMPtr<nsIFile> dir;
+        if (NS_SUCCEEDED(rv))
+            rv = file->GetParent(getter_AddRefs(dir));
+        if (NS_SUCCEEDED(rv))
+            rv = dir->AppendNative(NS_LITERAL_CSTRING("scripts.bundle"));
+        if (NS_SUCCEEDED(rv))
+            mScriptBundle.Open(dir);
+    }
+
+    // Cached scripts must be unrooted while the runtime is still alive.
+    nsCOMPtr<nsIObserverService> obs =
+        do_GetService("@mozilla.org/observer-service;1", &rv);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    rv = obs->AddObserver(this, "xpcom-shutdown", PR_FALSE);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    // As must the decoder thread, before XPCOM stops every thread.
+    rv = obs->AddObserver(this, "xpcom-shutdown-threads", PR_FALSE);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    // Cached prototypes mustn't outlive their windows' compartments.
+    rv = obs->AddObserver(this, "inner-window-destroyed", PR_FALSE);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    // And mapped jars mustn't stay locked once the jar cache lets go.
+    rv = obs->AddObserver(this, "flush-cache-entry", PR_FALSE);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    gService = this;
+
+    // Last, since it fills itself from GetService, and registers with the
+    // idle service, which would keep it around if we failed.
+    mGlobalPool = new GlobalPool();
+    mGlobalPool->Init();
+
     return NS_OK;
 }
 
-NS_IMPL_ISUPPORTS1(dactylUtils,
-                   dactylIUtils)
+dactylUtils*
+dactylUtils::GetService()
+{
+    return gService;
+}
 
 NS_IMETHODIMP
-dactylUtils::CreateGlobal(JSContext *cx, jsval *out)
+dactylUtils::Observe(nsISupports *aSubject, const char *aTopic,
+                     const PRUnichar *aData)
+{
+    if (!strcmp(aTopic, "xpcom-shutdown")) {
+        mScriptCache.Clear();
+        mEvalCache.Clear();
+        mFoldCache.Clear();
+        mPropertyCache.Clear();
+        if (mGlobalPool)
+            mGlobalPool->Shutdown();
+        mScriptStore.Close();
+        mScriptBundle.Close();
+        MappedSource::ReleaseJars();
+
+        nsCOMPtr<nsIObserverService> obs =
+            do_GetService("@mozilla.org/observer-service;1");
+        if (obs) {
+            obs->RemoveObserver(this, "xpcom-shutdown");
+            obs->RemoveObserver(this, "inner-window-destroyed");
+            obs->RemoveObserver(this, "flush-cache-entry");
+        }
+    }
+    else if (!strcmp(aTopic, "xpcom-shutdown-threads")) {
+        // Waits for any decode in progress, whose load then finishes on
+        // the main thread as usual.
+        mThreadsShutDown = true;
+        if (mDecodeThread)
+            mDecodeThread->Shutdown();
+        mDecodeThread = nsnull;
+
+        nsCOMPtr<nsIObserverService> obs =
+            do_GetService("@mozilla.org/observer-service;1");
+        if (obs)
+            obs->RemoveObserver(this, "xpcom-shutdown-threads");
+    }
+    else if (!strcmp(aTopic, "inner-window-destroyed")) {
+        nsCOMPtr<nsISupportsPRUint64> id = do_QueryInterface(aSubject);
+        PRUint64 windowID;
+        if (id && NS_SUCCEEDED(id->GetData(&windowID)))
+            mPropertyCache.RemoveWindow(windowID);
+    }
+    else if (!strcmp(aTopic, "flush-cache-entry")) {
+        // Sent with the jar, as for the jar cache, when an add-on is
+        // uninstalled or updated.
+        nsCOMPtr<nsIFile> file = do_QueryInterface(aSubject);
+        if (file)
+            MappedSource::ReleaseJar(file);
+    }
+    return NS_OK;
+}
+
+nsresult
+dactylUtils::GetDecodeThread(nsIThread **aThread)
+{
+    NS_ENSURE_FALSE(mThreadsShutDown, NS_ERROR_NOT_AVAILABLE);
+
+    if (!mDecodeThread) {
+        nsresult rv = NS_NewThread(getter_AddRefs(mDecodeThread));
+        NS_ENSURE_SUCCESS(rv, rv);
+    }
+
+    NS_ADDREF(*aThread = mDecodeThread);
+    return NS_OK;
+}
+
+void
+dactylUtils::RecordLoad(const nsACString &url,
+                        const ScriptLoadStatistics &stats)
+{
+    ScriptLoadStatistics *entry;
+    if (!mLoadStatistics.Get(url, &entry)) {
+        entry = new ScriptLoadStatistics();
+        mLoadStatistics.Put(url, entry);
+    }
+    entry->Add(stats);
+}
+
+NS_IMPL_ISUPPORTS2(dactylUtils,
+                   dactylIUtils,
+                   nsIObserver)
+
+nsresult
+dactylUtils::NewGlobal(JSContext *cx, nsIXPConnectJSObjectHolder **aHolder)
 {
     nsresult rv;
 
@@ -197,44 +354,85 @@ dactylUtils::CreateGlobal(JSContext *cx, jsval *out)
     NS_ENSURE_TRUE(JS_DefineProfilingFunctions(cx, global),
                    NS_ERROR_FAILURE);
 
-    *out = OBJECT_TO_JSVAL(global);
+    holder.forget(aHolder);
     return NS_OK;
 }
 
 NS_IMETHODIMP
-dactylUtils::EvalInContext(const nsAString &aSource,
-                           const jsval &aTarget,
-                           const nsACString &aFilename,
-                           PRInt32 aLineNumber,
-                           JSContext *cx,
-                           jsval *rval)
+dactylUtils::CreateGlobal(JSContext *cx, jsval *out)
 {
     nsresult rv;
 
-    nsCOMPtr<nsIXPConnect> xpc(do_GetService(nsIXPConnect::GetCID(), &rv));
+    nsCOMPtr<nsIXPConnectJSObjectHolder> holder;
+    if (!mGlobalPool || !mGlobalPool->Take(getter_AddRefs(holder))) {
+        rv = NewGlobal(cx, getter_AddRefs(holder));
+        NS_ENSURE_SUCCESS(rv, rv);
+    }
+
+    JSObject *global;
+    rv = holder->GetJSObject(&global);
     NS_ENSURE_SUCCESS(rv, rv);
 
-    nsCString filename;
+    *out = OBJECT_TO_JSVAL(global);
+    return NS_OK;
+}
 
-    if (!aFilename.IsEmpty())
+NS_IMETHODIMP
+dactylUtils::GetGlobalPoolSize(PRUint32 *aSize)
+{
+    NS_ENSURE_TRUE(mGlobalPool, NS_ERROR_NOT_INITIALIZED);
+    *aSize = mGlobalPool->Size();
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::SetGlobalPoolSize(PRUint32 aSize)
+{
+    NS_ENSURE_TRUE(mGlobalPool, NS_ERROR_NOT_INITIALIZED);
+    mGlobalPool->SetSize(aSize);
+    return NS_OK;
+}
+
+/*
+ * Fills in the filename and line number an evaluation is reported as
+ * coming from, which default to those of our caller.
+ */
+static nsresult
+GetEvalLocation(const nsACString &aFilename, nsCString &filename,
+                PRInt32 *lineNumber)
+{
+    nsresult rv;
+
+    if (!aFilename.IsEmpty()) {
         filename.Assign(aFilename);
-    else {
-        nsCOMPtr<nsIStackFrame> frame;
-        xpc->GetCurrentJSStack(getter_AddRefs(frame));
-        NS_ENSURE_TRUE(frame, NS_ERROR_FAILURE);
-        frame->GetFilename(getter_Copies(filename));
-        frame->GetLineNumber(&aLineNumber);
+        return NS_OK;
     }
 
-    JSObject *target;
-    NS_ENSURE_FALSE(JSVAL_IS_PRIMITIVE(aTarget), NS_ERROR_UNEXPECTED);
-    target = JSVAL_TO_OBJECT(aTarget);
+    nsCOMPtr<nsIXPConnect> xpc(do_GetService(nsIXPConnect::GetCID(), &rv));
+    NS_ENSURE_SUCCESS(rv, rv);
 
+    nsCOMPtr<nsIStackFrame> frame;
+    xpc->GetCurrentJSStack(getter_AddRefs(frame));
+    NS_ENSURE_TRUE(frame, NS_ERROR_FAILURE);
+    frame->GetFilename(getter_Copies(filename));
+    frame->GetLineNumber(lineNumber);
+    return NS_OK;
+}
 
-    JSObject *result = target;
-    target = JS_FindCompilationScope(cx, target);
-    NS_ENSURE_TRUE(target, NS_ERROR_FAILURE);
+/*
+ * Finds the scope in which code is evaluated for *aTarget*, and the
+ * principals it's compiled with, which the caller must drop.
+ */
+static nsresult
+GetEvalScope(JSContext *cx, const jsval &aTarget, JSObject **scope,
+             JSPrincipals **jsPrincipals)
+{
+    nsresult rv;
 
+    NS_ENSURE_FALSE(JSVAL_IS_PRIMITIVE(aTarget), NS_ERROR_UNEXPECTED);
+
+    JSObject *target = JS_FindCompilationScope(cx, JSVAL_TO_OBJECT(aTarget));
+    NS_ENSURE_TRUE(target, NS_ERROR_FAILURE);
 
     nsCOMPtr<nsIScriptSecurityManager> secman =
         do_GetService(NS_SCRIPTSECURITYMANAGER_CONTRACTID);
@@ -244,9 +442,30 @@ dactylUtils::EvalInContext(const nsAString &aSource,
     rv = secman->GetObjectPrincipal(cx, target, getter_AddRefs(principal));
     NS_ENSURE_SUCCESS(rv, rv);
 
+    rv = principal->GetJSPrincipals(cx, jsPrincipals);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    *scope = target;
+    return NS_OK;
+}
 
+NS_IMETHODIMP
+dactylUtils::EvalInContext(const nsAString &aSource,
+                           const jsval &aTarget,
+                           const nsACString &aFilename,
+                           PRInt32 aLineNumber,
+                           JSContext *cx,
+                           jsval *rval)
+{
+    nsresult rv;
+
+    nsCString filename;
+    rv = GetEvalLocation(aFilename, filename, &aLineNumber);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    JSObject *target;
     JSPrincipals *jsPrincipals;
-    rv = principal->GetJSPrincipals(cx, &jsPrincipals);
+    rv = GetEvalScope(cx, aTarget, &target, &jsPrincipals);
     NS_ENSURE_SUCCESS(rv, rv);
     autoDropPrincipals adp(cx, jsPrincipals);
 
@@ -265,13 +484,8 @@ dactylUtils::EvalInContext(const nsAString &aSource,
 
         NS_ENSURE_TRUE(ac.enter(cx, target), NS_ERROR_FAILURE);
 
-        JSBool ok =
-            JS_EvaluateUCScriptForPrincipals(cx, target,
-                                             jsPrincipals,
-                                             reinterpret_cast<const jschar*>
-                                                (PromiseFlatString(aSource).get()),
-                                             aSource.Length(),
-                                             filename.get(), aLineNumber, &v);
+        JSBool ok = EvaluateScript(cx, target, jsPrincipals, aSource,
+                                   filename.get(), aLineNumber, &v);
 
         if (!ok) {
             jsval exn;
@@ -300,6 +514,410 @@ dactylUtils::EvalInContext(const nsAString &aSource,
     return rv;
 }
 
+NS_IMETHODIMP
+dactylUtils::EvalManyInContext(const jsval &aSources,
+                               const jsval &aTarget,
+                               const nsACString &aFilename,
+                               const jsval &aLineNumbers,
+                               JSContext *cx,
+                               jsval *rval)
+{
+    nsresult rv;
+
+    JSAutoRequest req(cx);
+
+    // Copy the sources out before anything they do can change them.
+    nsTArray<nsString> sources;
+    nsTArray<PRInt32> lineNumbers;
+    nsTArray<bool> haveLineNumbers;
+    {
+        NS_ENSURE_FALSE(JSVAL_IS_PRIMITIVE(aSources), NS_ERROR_INVALID_ARG);
+        JSObject *array = JSVAL_TO_OBJECT(aSources);
+
+        JSObject *lines = nsnull;
+        if (!JSVAL_IS_PRIMITIVE(aLineNumbers))
+            lines = JSVAL_TO_OBJECT(aLineNumbers);
+
+        jsuint length;
+        NS_ENSURE_TRUE(JS_IsArrayObject(cx, array) &&
+                       JS_GetArrayLength(cx, array, &length),
+                       NS_ERROR_INVALID_ARG);
+
+        for (jsuint i = 0; i < length; i++) {
+            jsval v;
+            NS_ENSURE_TRUE(JS_GetElement(cx, array, i, &v), NS_ERROR_FAILURE);
+
+            JSString *str = JS_ValueToString(cx, v);
+            NS_ENSURE_TRUE(str, NS_ERROR_FAILURE);
+
+            size_t len;
+            const jschar *chars = JS_GetStringCharsAndLength(cx, str, &len);
+            NS_ENSURE_TRUE(chars, NS_ERROR_FAILURE);
+            sources.AppendElement()->Assign(reinterpret_cast<const PRUnichar*>(chars),
+                                            len);
+
+            // Missing line numbers default as they do for evalInContext,
+            // but an explicit 0 is kept.
+            int32 line = 0;
+            bool haveLine = false;
+            if (lines) {
+                NS_ENSURE_TRUE(JS_GetElement(cx, lines, i, &v),
+                               NS_ERROR_FAILURE);
+                haveLine = !JSVAL_IS_VOID(v);
+                if (haveLine && !JS_ValueToECMAInt32(cx, v, &line))
+                    return NS_ERROR_FAILURE;
+            }
+            lineNumbers.AppendElement(line);
+            haveLineNumbers.AppendElement(haveLine);
+        }
+    }
+
+    // Sources without line numbers get our caller's, as evalInContext
+    // does when it's given no filename.
+    nsCString filename;
+    PRInt32 callerLine = 0;
+    rv = GetEvalLocation(aFilename, filename, &callerLine);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    JSObject *target;
+    JSPrincipals *jsPrincipals;
+    rv = GetEvalScope(cx, aTarget, &target, &jsPrincipals);
+    NS_ENSURE_SUCCESS(rv, rv);
+    autoDropPrincipals adp(cx, jsPrincipals);
+
+    JSObject *results = JS_NewArrayObject(cx, 0, nsnull);
+    NS_ENSURE_TRUE(results, NS_ERROR_OUT_OF_MEMORY);
+    *rval = OBJECT_TO_JSVAL(results);
+
+    for (PRUint32 i = 0; i < sources.Length(); i++) {
+        PRInt32 line = haveLineNumbers[i] ? lineNumbers[i] : callerLine;
+
+        jsval v;
+        JSBool ok;
+        {
+            JSAutoEnterCompartment ac;
+            NS_ENSURE_TRUE(ac.enter(cx, target), NS_ERROR_FAILURE);
+
+            ok = EvaluateScript(cx, target, jsPrincipals, sources[i],
+                                filename.get(), line, &v);
+
+            // Anything uncatchable stops the whole batch.
+            if (!ok && !JS_GetPendingException(cx, &v))
+                return NS_ERROR_FAILURE;
+            JS_ClearPendingException(cx);
+        }
+
+        // Each entry's result is reported as { value } or, if it threw,
+        // { exception }, in our caller's compartment.
+        JSObject *entry = JS_NewObject(cx, nsnull, nsnull, nsnull);
+        NS_ENSURE_TRUE(entry, NS_ERROR_OUT_OF_MEMORY);
+
+        jsval entryVal = OBJECT_TO_JSVAL(entry);
+        NS_ENSURE_TRUE(JS_WrapValue(cx, &v) &&
+                       JS_DefineProperty(cx, entry, ok ? "value" : "exception",
+                                         v, nsnull, nsnull, JSPROP_ENUMERATE) &&
+                       JS_SetElement(cx, results, i, &entryVal),
+                       NS_ERROR_FAILURE);
+    }
+
+    return NS_OK;
+}
+
+/*
+ * The native half of a handle from bindEvalContext: the scope and
+ * principals which evalInContext would look up for its target, and the
+ * service which made it, whose eval cache it uses. The handle's reserved
+ * slot holds a wrapper for the scope, so that it lives as long as the
+ * handle does.
+ */
+struct EvalContext {
+    JSObject              *scope;
+    JSPrincipals          *principals;
+    nsRefPtr<dactylUtils>  utils;
+};
+
+enum {
+    EVAL_CONTEXT_SCOPE_SLOT,
+    EVAL_CONTEXT_SLOTS
+};
+
+static void
+EvalContextFinalize(JSContext *cx, JSObject *obj)
+{
+    EvalContext *ecx = static_cast<EvalContext*>(JS_GetPrivate(cx, obj));
+    if (ecx) {
+        JSPRINCIPALS_DROP(cx, ecx->principals);
+        delete ecx;
+    }
+}
+
+static JSClass gEvalContextClass = {
+    "EvalContext",
+    JSCLASS_HAS_PRIVATE | JSCLASS_HAS_RESERVED_SLOTS(EVAL_CONTEXT_SLOTS),
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, EvalContextFinalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+/* handle.eval(source, [filename], [lineNumber]) */
+static JSBool
+EvalContextEval(JSContext *cx, uintN argc, jsval *vp)
+{
+    JSObject *obj = JS_THIS_OBJECT(cx, vp);
+    if (!obj)
+        return JS_FALSE;
+
+    EvalContext *ecx = static_cast<EvalContext*>(
+        JS_GetInstancePrivate(cx, obj, &gEvalContextClass, JS_ARGV(cx, vp)));
+    if (!ecx)
+        return JS_FALSE;
+
+    JSString *source, *filenameStr = nsnull;
+    int32 lineNumber = 0;
+    if (!JS_ConvertArguments(cx, argc, JS_ARGV(cx, vp), "S / S i",
+                             &source, &filenameStr, &lineNumber))
+        return JS_FALSE;
+
+    nsCString given, filename;
+    if (filenameStr) {
+        JSAutoByteString bytes(cx, filenameStr);
+        if (!bytes)
+            return JS_FALSE;
+        given.Assign(bytes.ptr());
+    }
+
+    PRInt32 line = lineNumber;
+    if (NS_FAILED(GetEvalLocation(given, filename, &line))) {
+        JS_ReportError(cx, "Can't find the caller's location");
+        return JS_FALSE;
+    }
+
+    size_t length;
+    const jschar *chars = JS_GetStringCharsAndLength(cx, source, &length);
+    if (!chars)
+        return JS_FALSE;
+
+    jsval v;
+    JSBool ok;
+    {
+        JSAutoEnterCompartment ac;
+        if (!ac.enter(cx, ecx->scope))
+            return JS_FALSE;
+
+        ok = ecx->utils->EvaluateScript(cx, ecx->scope, ecx->principals,
+                                        nsDependentString(reinterpret_cast<const PRUnichar*>(chars),
+                                                          length),
+                                        filename.get(), line, &v);
+        if (!ok && !JS_GetPendingException(cx, &v))
+            return JS_FALSE;
+    }
+
+    // Whatever came back, it has to be wrapped for the handle's
+    // compartment, which is the one we were called in.
+    if (!ok) {
+        JS_ClearPendingException(cx);
+        if (JS_WrapValue(cx, &v))
+            JS_SetPendingException(cx, v);
+        return JS_FALSE;
+    }
+
+    if (!JS_WrapValue(cx, &v))
+        return JS_FALSE;
+    JS_SET_RVAL(cx, vp, v);
+    return JS_TRUE;
+}
+
+static JSFunctionSpec gEvalContextFun[] = {
+    {"eval",    EvalContextEval,    3,0},
+    {nsnull,nsnull,0,0}
+};
+
+NS_IMETHODIMP
+dactylUtils::BindEvalContext(const jsval &aTarget,
+                             JSContext *cx,
+                             jsval *rval)
+{
+    nsresult rv;
+
+    JSAutoRequest req(cx);
+
+    JSObject *scope;
+    JSPrincipals *jsPrincipals;
+    rv = GetEvalScope(cx, aTarget, &scope, &jsPrincipals);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    JSObject *obj = JS_NewObject(cx, &gEvalContextClass, nsnull, nsnull);
+    if (!obj) {
+        JSPRINCIPALS_DROP(cx, jsPrincipals);
+        return NS_ERROR_OUT_OF_MEMORY;
+    }
+
+    // From here on, the finalizer drops the principals.
+    EvalContext *ecx = new EvalContext();
+    ecx->scope = scope;
+    ecx->principals = jsPrincipals;
+    ecx->utils = this;
+    if (!JS_SetPrivate(cx, obj, ecx)) {
+        JSPRINCIPALS_DROP(cx, jsPrincipals);
+        delete ecx;
+        return NS_ERROR_FAILURE;
+    }
+
+    jsval scopeVal = OBJECT_TO_JSVAL(scope);
+    NS_ENSURE_TRUE(JS_WrapValue(cx, &scopeVal) &&
+                   JS_SetReservedSlot(cx, obj, EVAL_CONTEXT_SCOPE_SLOT,
+                                      scopeVal) &&
+                   JS_DefineFunctions(cx, obj, gEvalContextFun),
+                   NS_ERROR_FAILURE);
+
+    *rval = OBJECT_TO_JSVAL(obj);
+    return NS_OK;
+}
+
+/* The memory taken by *script*'s bytecode, atoms and notes. */
+static PRUint32
+ScriptSize(JSContext *cx, JSScriptType *script)
+{
+#if GECKO_MAJOR < 9
+    return JS_GetScriptTotalSize(cx, JS_GetScriptFromObject(script));
+#else
+    return JS_GetScriptTotalSize(cx, script);
+#endif
+}
+
+JSBool
+dactylUtils::EvaluateScript(JSContext *cx, JSObject *target,
+                            JSPrincipals *principals,
+                            const nsAString &aSource, const char *filename,
+                            PRInt32 lineNumber, jsval *rval)
+{
+    const nsString &source = PromiseFlatString(aSource);
+
+    // Cached scripts keep their compartments alive, so only chrome's,
+    // which live as long as we do anyway, are cached.
+    JSPrincipals *system;
+    bool cacheable = NS_SUCCEEDED(mSystemPrincipal->GetJSPrincipals(cx, &system));
+    if (cacheable) {
+        cacheable = principals == system;
+        JSPRINCIPALS_DROP(cx, system);
+    }
+
+    // The filename and line are baked into the script, so they're part
+    // of the key along with the source, as it is, surrogates and all.
+    nsCAutoString key;
+    if (cacheable) {
+        key.Assign(filename);
+        key.Append('#');
+        key.AppendInt(lineNumber);
+        key.Append('\n');
+        key.Append(reinterpret_cast<const char*>(source.get()),
+                   source.Length() * sizeof(PRUnichar));
+    }
+
+    ScriptStamp stamp;
+    JSScriptType *script = cacheable ? mEvalCache.Get(cx, key, stamp) : nsnull;
+    if (!script) {
+        // Cached scripts are shared between every target in the
+        // compartment, so mustn't be bound to this one.
+        uint32 options = JS_GetOptions(cx);
+        if (cacheable)
+            JS_SetOptions(cx, options & ~JSOPTION_COMPILE_N_GO);
+
+        script = JS_CompileUCScriptForPrincipals(cx, target, principals,
+                                                 reinterpret_cast<const jschar*>(source.get()),
+                                                 source.Length(),
+                                                 filename, lineNumber);
+        JS_SetOptions(cx, options);
+        if (!script)
+            return JS_FALSE;
+
+        if (cacheable)
+            mEvalCache.Put(cx, key, stamp, script,
+                           key.Length() + ScriptSize(cx, script));
+    }
+
+    return JS_ExecuteScript(cx, target, script, rval);
+}
+
+NS_IMETHODIMP
+dactylUtils::GetEvalCacheLimit(PRUint32 *aLimit)
+{
+    *aLimit = mEvalCache.Limit();
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::SetEvalCacheLimit(PRUint32 aLimit)
+{
+    mEvalCache.SetLimit(aLimit);
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::GetScriptCacheLimit(PRUint32 *aLimit)
+{
+    *aLimit = mScriptCache.Limit();
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::SetScriptCacheLimit(PRUint32 aLimit)
+{
+    mScriptCache.SetLimit(aLimit);
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::GetScriptStoreEnabled(bool *aEnabled)
+{
+    *aEnabled = mScriptStore.IsOpen();
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::SetScriptStoreEnabled(bool aEnabled)
+{
+    nsresult rv;
+
+    if (!aEnabled)
+        mScriptStore.Close();
+    else if (!mScriptStore.IsOpen()) {
+        nsCOMPtr<nsIXULAppInfo> appInfo =
+            do_GetService("@mozilla.org/xre/app-info;1", &rv);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCAutoString buildID;
+        rv = appInfo->GetPlatformBuildID(buildID);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIFile> dir;
+        rv = NS_GetSpecialDirectory(NS_APP_USER_PROFILE_LOCAL_50_DIR,
+                                    getter_AddRefs(dir));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        rv = dir->AppendNative(NS_LITERAL_CSTRING("dactyl-cache"));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        rv = mScriptStore.Open(dir, buildID);
+        NS_ENSURE_SUCCESS(rv, rv);
+    }
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::GetScriptCacheCompression(bool *aEnabled)
+{
+    *aEnabled = CacheCompressionEnabled();
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::SetScriptCacheCompression(bool aEnabled)
+{
+    SetCacheCompressionEnabled(aEnabled);
+    return NS_OK;
+}
+
 NS_IMETHODIMP
 dactylUtils::CreateContents(nsIDOMElement *aElement)
 {
@@ -350,6 +968,149 @@ dactylUtils::GetGlobalForObject(const jsval &aObject,
     return NS_OK;
 }
 
+/*
+ * Fills *list* with the names of *obj*'s own properties, hidden or not,
+ * as Object.getOwnPropertyNames gives them, flagging those with getters.
+ */
+static bool
+EnumerateOwnProperties(JSContext *cx, JSObject *obj, PropertyList &list)
+{
+    js::AutoIdVector ids(cx);
+    if (!js::GetPropertyNames(cx, obj, JSITER_OWNONLY | JSITER_HIDDEN, &ids))
+        return false;
+
+    for (size_t i = 0; i < ids.length(); i++) {
+        jsval v;
+        JSString *str;
+        if (!JS_IdToValue(cx, ids[i], &v) || !(str = JS_ValueToString(cx, v)))
+            return false;
+
+        size_t length;
+        const jschar *chars = JS_GetStringCharsAndLength(cx, str, &length);
+        if (!chars)
+            return false;
+        list.names.AppendElement(nsDependentString(reinterpret_cast<const PRUnichar*>(chars),
+                                                   length));
+
+        // Some wrapped natives throw for their own properties.
+        PRUint32 flags = 0;
+        JSPropertyDescriptor desc;
+        if (JS_GetPropertyDescriptorById(cx, obj, ids[i], JSRESOLVE_QUALIFIED, &desc)) {
+            if ((desc.attrs & JSPROP_GETTER) ||
+                (desc.getter && desc.getter != JS_PropertyStub))
+                flags |= dactylIUtils::PROPERTY_GETTER;
+        }
+        else
+            JS_ClearPendingException(cx);
+        list.flags.AppendElement(flags);
+    }
+    return true;
+}
+
+/* The ID of the inner window which is *obj*'s global, or 0. */
+static PRUint64
+GetWindowID(JSContext *cx, JSObject *obj)
+{
+    nsCOMPtr<nsIXPConnect> xpc = do_GetService(nsIXPConnect::GetCID());
+    if (!xpc)
+        return 0;
+
+    nsCOMPtr<nsPIDOMWindow> win =
+        do_QueryInterface(xpc->GetNativeOfWrapper(cx, JS_GetGlobalForObject(cx, obj)));
+    return win && win->IsInnerWindow() ? win->WindowID() : 0;
+}
+
+NS_IMETHODIMP
+dactylUtils::EnumerateProperties(const jsval &aObject,
+                                 PRInt32 aDepth,
+                                 JSContext *cx,
+                                 jsval *rval)
+{
+    JSAutoRequest ar(cx);
+
+    JSObject *obj;
+    NS_ENSURE_FALSE(JSVAL_IS_NULL(aObject) || JSVAL_IS_VOID(aObject),
+                    NS_ERROR_INVALID_ARG);
+    NS_ENSURE_TRUE(JS_ValueToObject(cx, aObject, &obj), NS_ERROR_FAILURE);
+
+    // Properties are looked for in the object itself, which, like the
+    // wrappedJSObject which javascript.jsm also looks in, has whatever a
+    // wrapper might hide.
+    obj = XPCWrapper::UnsafeUnwrapSecurityWrapper(obj);
+
+    nsTArray<nsString> names;
+    nsTArray<PRUint32> flags;
+    {
+        JSAutoEnterCompartment ac;
+        NS_ENSURE_TRUE(ac.enter(cx, obj), NS_ERROR_FAILURE);
+
+        // Names are reported for the nearest object which has them.
+        nsTHashtable<nsStringHashKey> seen;
+        NS_ENSURE_TRUE(seen.Init(256), NS_ERROR_OUT_OF_MEMORY);
+
+        // Prototypes live in the same global as the object.
+        PRUint64 windowID = GetWindowID(cx, obj);
+
+        PRInt32 level = 0;
+        for (JSObject *o = obj; o && (aDepth < 0 || level <= aDepth);
+             o = JS_GetPrototype(cx, o), level++) {
+            bool cacheable = level && PropertyCache::IsCacheable(cx, o);
+
+            PropertyList fresh;
+            const PropertyList *list = cacheable ? mPropertyCache.Get(cx, o) : nsnull;
+            if (!list) {
+                NS_ENSURE_TRUE(EnumerateOwnProperties(cx, o, fresh),
+                               NS_ERROR_FAILURE);
+                list = &fresh;
+                if (cacheable) {
+                    const PropertyList *cached = mPropertyCache.Put(cx, o, windowID, fresh);
+                    if (cached)
+                        list = cached;
+                }
+            }
+
+            PRUint32 where = level ? PROPERTY_INHERITED : PROPERTY_OWN;
+            for (PRUint32 i = 0; i < list->names.Length(); i++)
+                if (!seen.GetEntry(list->names[i])) {
+                    seen.PutEntry(list->names[i]);
+                    names.AppendElement(list->names[i]);
+                    flags.AppendElement(list->flags[i] | where);
+                }
+        }
+    }
+
+    JSObject *result = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    NS_ENSURE_TRUE(result, NS_ERROR_OUT_OF_MEMORY);
+    *rval = OBJECT_TO_JSVAL(result);
+
+    JSObject *nameArray = JS_NewArrayObject(cx, 0, nsnull);
+    NS_ENSURE_TRUE(nameArray &&
+                   JS_DefineProperty(cx, result, "names", OBJECT_TO_JSVAL(nameArray),
+                                     nsnull, nsnull, JSPROP_ENUMERATE),
+                   NS_ERROR_OUT_OF_MEMORY);
+
+    for (PRUint32 i = 0; i < names.Length(); i++) {
+        JSString *str = JS_NewUCStringCopyN(cx,
+                                            reinterpret_cast<const jschar*>(names[i].get()),
+                                            names[i].Length());
+        NS_ENSURE_TRUE(str, NS_ERROR_OUT_OF_MEMORY);
+
+        jsval v = STRING_TO_JSVAL(str);
+        NS_ENSURE_TRUE(JS_SetElement(cx, nameArray, i, &v), NS_ERROR_FAILURE);
+    }
+
+    JSObject *flagArray = js_CreateTypedArray(cx, js::TypedArray::TYPE_UINT32,
+                                              flags.Length());
+    NS_ENSURE_TRUE(flagArray, NS_ERROR_OUT_OF_MEMORY);
+    memcpy(js::TypedArray::getDataOffset(js::TypedArray::getTypedArray(flagArray)),
+           flags.Elements(), flags.Length() * sizeof(PRUint32));
+
+    NS_ENSURE_TRUE(JS_DefineProperty(cx, result, "flags", OBJECT_TO_JSVAL(flagArray),
+                                     nsnull, nsnull, JSPROP_ENUMERATE),
+                   NS_ERROR_FAILURE);
+    return NS_OK;
+}
+
 NS_IMETHODIMP
 dactylUtils::GetScrollable(nsIDOMElement *aElement, PRUint32 *rval)
 {
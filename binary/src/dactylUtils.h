@@ -3,8 +3,15 @@
 
 #include "config.h"
 #include "dactylIUtils.h"
+#include "foldCache.h"
+#include "globalPool.h"
+#include "propertyCache.h"
+#include "scriptBundle.h"
+#include "scriptCache.h"
+#include "scriptStore.h"
 
 #include "nsISupports.h"
+#include "nsIObserver.h"
 #include "nsIPrincipal.h"
 #include "nsIXPConnect.h"
 
@@ -12,25 +19,139 @@
 #include "jsfriendapi.h"
 #include "nsIJSRuntimeService.h"
 #include "nsIJSContextStack.h"
+#include "nsIThread.h"
 
+#include "nsClassHashtable.h"
+#include "nsAutoPtr.h"
 #include "nsCOMPtr.h"
+#include "nsHashKeys.h"
+#include "nsTHashtable.h"
 
-class dactylUtils : public dactylIUtils {
+#include <string.h>
+
+#if GECKO_MAJOR < 10
+    static inline JSObject*
+    JS_GetGlobalForScopeChain(JSContext *cx) {
+        JSObject *callingScope = JS_GetScopeChain(cx);
+        if (!callingScope)
+            return nsnull;
+        return JS_GetGlobalForObject(cx, callingScope);
+    }
+#endif
+
+/*
+ * What loading a script has cost, summed over each of its loads. Times
+ * are in microseconds, sizes in bytes. Cache hits count decodes of
+ * cached bytecode, and memory hits reuses of already compiled scripts.
+ */
+struct ScriptLoadStatistics {
+    ScriptLoadStatistics() {
+        memset(this, 0, sizeof *this);
+    }
+
+    void Add(const ScriptLoadStatistics &other) {
+        loads += other.loads;
+        failures += other.failures;
+        cacheHits += other.cacheHits;
+        cacheMisses += other.cacheMisses;
+        cacheStale += other.cacheStale;
+        memoryHits += other.memoryHits;
+        readTime += other.readTime;
+        decodeTime += other.decodeTime;
+        xdrTime += other.xdrTime;
+        compileTime += other.compileTime;
+        executeTime += other.executeTime;
+        sourceSize += other.sourceSize;
+        cacheSize += other.cacheSize;
+    }
+
+    PRUint32 loads;
+    PRUint32 failures;
+    PRUint32 cacheHits;
+    PRUint32 cacheMisses;
+    PRUint32 cacheStale;
+    PRUint32 memoryHits;
+
+    PRInt64  readTime;
+    PRInt64  decodeTime;
+    PRInt64  xdrTime;
+    PRInt64  compileTime;
+    PRInt64  executeTime;
+
+    PRInt64  sourceSize;
+    PRInt64  cacheSize;
+};
+
+class dactylUtils : public dactylIUtils,
+                    public nsIObserver {
 public:
     dactylUtils() NS_HIDDEN;
     ~dactylUtils() NS_HIDDEN;
 
     NS_DECL_ISUPPORTS
     NS_DECL_DACTYLIUTILS
+    NS_DECL_NSIOBSERVER
 
     NS_HIDDEN_(nsresult) Init();
 
+    // Makes a new global, as createGlobal returns, whether or not the
+    // pool has one ready. Replaces *cx*'s global.
+    NS_HIDDEN_(nsresult) NewGlobal(JSContext *cx,
+                                   nsIXPConnectJSObjectHolder **holder);
+
+    // The thread on which asynchronous loads decode their sources.
+    NS_HIDDEN_(nsresult) GetDecodeThread(nsIThread **aThread);
+
+    // The service's single instance, once it's been initialized.
+    static NS_HIDDEN_(dactylUtils*) GetService();
+
+    nsIPrincipal *SystemPrincipal() { return mSystemPrincipal; }
+    CompiledScriptCache *ScriptCache() { return &mScriptCache; }
+    ScriptStore *Store() { return &mScriptStore; }
+    ScriptBundle *Bundle() { return &mScriptBundle; }
+
+    // Adds the cost of a single load of *url* to its statistics.
+    NS_HIDDEN_(void) RecordLoad(const nsACString &url,
+                                const ScriptLoadStatistics &stats);
+
+    // Forgets *url* as a lazy subscript which hasn't yet been loaded.
+    NS_HIDDEN_(void) LazySubScriptLoaded(const nsACString &url);
+
+    // Evaluates *source* in *target*, which must be in the current
+    // compartment, reusing the script compiled for it by any earlier
+    // evaluation there.
+    NS_HIDDEN_(JSBool) EvaluateScript(JSContext *cx, JSObject *target,
+                                      JSPrincipals *principals,
+                                      const nsAString &source,
+                                      const char *filename,
+                                      PRInt32 lineNumber, jsval *rval);
+
 private:
 
     nsCOMPtr<nsIJSRuntimeService> mRuntimeService;
     JSRuntime *mRuntime;
 
     nsCOMPtr<nsIPrincipal> mSystemPrincipal;
+
+    nsCOMPtr<nsIThread> mDecodeThread;
+    bool mThreadsShutDown;
+
+    CompiledScriptCache mScriptCache;
+    // Scripts compiled by evalInContext, keyed by their sources.
+    CompiledScriptCache mEvalCache;
+    ScriptStore mScriptStore;
+    ScriptBundle mScriptBundle;
+    // The folded text of the strings filterStrings has matched lately.
+    FoldCache mFoldCache;
+    // What enumerateProperties found in DOM and XPConnect prototypes.
+    PropertyCache mPropertyCache;
+
+    nsRefPtr<GlobalPool> mGlobalPool;
+
+    nsClassHashtable<nsCStringHashKey, ScriptLoadStatistics> mLoadStatistics;
+
+    // The URLs of lazy subscripts which haven't been loaded.
+    nsTHashtable<nsCStringHashKey> mLazySubScripts;
 };
 
 /* vim:se sts=4 sw=4 et cin ft=cpp: */
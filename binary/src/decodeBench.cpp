@@ -0,0 +1,165 @@
+/*
+ * Measures the throughput of the utf8Decoder kernels against a plain
+ * byte-at-a-time decoder, over the files named on the command line or,
+ * failing that, a synthetic mostly-ASCII source.
+ *
+ *   make bench
+ *   make bench BENCH_ARGS="<script files>"
+ */
+
+#include "utf8Decoder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+static double
+Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The byte-at-a-time loop we're replacing, minus the XPCOM overhead. */
+static size_t
+DecodeBytewise(const char *aSrc, size_t length, uint16_t *dst)
+{
+    const unsigned char *src = reinterpret_cast<const unsigned char*>(aSrc);
+    size_t out = 0;
+
+    for (size_t i = 0; i < length; ) {
+        unsigned char c = src[i];
+        size_t need = c < 0x80 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+        unsigned ch = need ? c & (0x3F >> need) : c;
+
+        size_t j = 1;
+        for (; j <= need && i + j < length && (src[i + j] & 0xC0) == 0x80; j++)
+            ch = ch << 6 | (src[i + j] & 0x3F);
+
+        if (j <= need)
+            ch = 0xFFFD;
+        if (ch >= 0x10000) {
+            ch -= 0x10000;
+            dst[out++] = 0xD800 | ch >> 10;
+            ch = 0xDC00 | (ch & 0x3FF);
+        }
+        dst[out++] = ch;
+        i += j;
+    }
+    return out;
+}
+
+static std::string
+ReadFile(const char *path)
+{
+    std::string result;
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof buf, file)))
+        result.append(buf, n);
+
+    fclose(file);
+    return result;
+}
+
+static std::string
+SyntheticSource()
+{
+    static const char line[] =
+        "    let completions = context.filter(item => item.text.startsWith(filter)); // \xc3\xa9t\xc3\xa9\n";
+
+    std::string result;
+    while (result.size() < (4 << 20))
+        for (int i = 0; i < 50; i++)
+            result.append(line, i ? strlen(line) - 12 : strlen(line));
+    return result;
+}
+
+typedef size_t (*DecodeFn)(const char *src, size_t length, uint16_t *dst);
+
+static size_t
+DecodeLatin1(const char *src, size_t length, uint16_t *dst)
+{
+    WidenLatin1(src, length, dst);
+    return length;
+}
+
+static void
+Run(const char *name, DecodeFn decode, const std::string &source,
+    std::vector<uint16_t> &out, size_t *units)
+{
+    int iterations = 0;
+    double start = Now(), elapsed;
+
+    do {
+        *units = decode(source.data(), source.size(), &out[0]);
+        iterations++;
+    } while ((elapsed = Now() - start) < 0.5);
+
+    printf("%-22s %9.1f MB/s\n", name,
+           source.size() * double(iterations) / elapsed / (1 << 20));
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string source;
+    for (int i = 1; i < argc; i++)
+        source += ReadFile(argv[i]);
+    if (source.empty())
+        source = SyntheticSource();
+
+    printf("%lu bytes, %lu leading ASCII\n",
+           (unsigned long) source.size(),
+           (unsigned long) ASCIIPrefixLength(source.data(), source.size()));
+
+    std::vector<uint16_t> reference(source.size() + 1), out(source.size() + 1);
+    size_t referenceUnits, units;
+
+    Run("bytewise utf-8", DecodeBytewise, source, reference, &referenceUnits);
+
+    static const struct {
+        const char *name;
+        DecoderKernel kernel;
+    } kernels[] = {
+        { "scalar", DECODER_KERNEL_SCALAR },
+        { "sse2",   DECODER_KERNEL_SSE2 },
+        { "avx2",   DECODER_KERNEL_AVX2 }
+    };
+
+    int status = 0;
+    for (size_t i = 0; i < sizeof kernels / sizeof *kernels; i++) {
+        if (!SetDecoderKernel(kernels[i].kernel)) {
+            printf("%-22s unsupported\n", kernels[i].name);
+            continue;
+        }
+
+        std::string name(kernels[i].name);
+        Run((name + " utf-8").c_str(), DecodeUTF8, source, out, &units);
+
+        // Ignore any byte order mark, which only DecodeUTF8 skips.
+        size_t skip = referenceUnits - units;
+        if (skip > 1 || memcmp(&out[0], &reference[skip], units * sizeof out[0])) {
+            printf("%s: output differs from bytewise decoder\n", kernels[i].name);
+            status = 1;
+        }
+
+        Run((name + " iso-8859-1").c_str(), DecodeLatin1, source, out, &units);
+    }
+
+    return status;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,136 @@
+#include "foldCache.h"
+#include "stringSearch.h"
+
+#include "nsAutoPtr.h"
+
+#include <string.h>
+
+// Enough for a completion context, the one it was narrowed from, and
+// a few others between them.
+#define MAX_ENTRIES 8
+
+bool
+FoldCase(JSContext *cx, JSString *str, nsTArray<jschar> &out)
+{
+    size_t length;
+    const jschar *chars = JS_GetStringCharsAndLength(cx, str, &length);
+    if (!chars)
+        return false;
+
+    PRUint32 start = out.Length();
+    jschar *dest = out.AppendElements(length);
+    if (!dest)
+        return false;
+
+    if (FoldASCII(reinterpret_cast<const uint16_t*>(chars), length,
+                  reinterpret_cast<uint16_t*>(dest)))
+        return true;
+
+    out.SetLength(start);
+
+    jsval v = STRING_TO_JSVAL(str);
+    JSObject *obj;
+    if (!JS_ValueToObject(cx, v, &obj) ||
+        !JS_CallFunctionName(cx, obj, "toLowerCase", 0, nsnull, &v) ||
+        !JSVAL_IS_STRING(v))
+        return false;
+
+    chars = JS_GetStringCharsAndLength(cx, JSVAL_TO_STRING(v), &length);
+    return chars && out.AppendElements(chars, length);
+}
+
+bool
+FoldedStrings::Fold(JSContext *cx, const nsTArray<JSString*> &strings)
+{
+    chars.Clear();
+    offsets.Clear();
+    if (!offsets.SetCapacity(strings.Length() + 1))
+        return false;
+
+    for (PRUint32 i = 0; i < strings.Length(); i++) {
+        offsets.AppendElement(chars.Length());
+        if (!FoldCase(cx, strings[i], chars))
+            return false;
+    }
+    offsets.AppendElement(chars.Length());
+    return true;
+}
+
+FoldCache::FoldCache()
+    : mRuntime(nsnull), mCount(0), mHits(0), mMisses(0)
+{
+    PR_INIT_CLIST(&mList);
+}
+
+FoldCache::~FoldCache()
+{
+    NS_ASSERTION(PR_CLIST_IS_EMPTY(&mList),
+                 "Fold cache destroyed while still rooting strings");
+}
+
+void
+FoldCache::Init(JSRuntime *runtime)
+{
+    mRuntime = runtime;
+}
+
+void
+FoldCache::Clear()
+{
+    while (!PR_CLIST_IS_EMPTY(&mList))
+        Remove(static_cast<Entry*>(PR_LIST_HEAD(&mList)));
+}
+
+void
+FoldCache::Remove(Entry *entry)
+{
+    PR_REMOVE_LINK(entry);
+    JS_RemoveObjectRootRT(mRuntime, &entry->strings);
+    mCount--;
+    delete entry;
+}
+
+FoldCache::Entry*
+FoldCache::Get(JSContext *cx, const nsTArray<JSString*> &keys)
+{
+    for (PRCList *link = PR_LIST_TAIL(&mList); link != &mList;
+         link = PR_PREV_LINK(link)) {
+        Entry *entry = static_cast<Entry*>(link);
+        if (entry->keys.Length() == keys.Length() &&
+            !memcmp(entry->keys.Elements(), keys.Elements(),
+                    keys.Length() * sizeof(JSString*))) {
+            PR_REMOVE_LINK(entry);
+            PR_APPEND_LINK(entry, &mList);
+            mHits++;
+            return entry;
+        }
+    }
+    mMisses++;
+
+    nsTArray<jsval> vals(keys.Length());
+    for (PRUint32 i = 0; i < keys.Length(); i++)
+        vals.AppendElement(STRING_TO_JSVAL(keys[i]));
+
+    nsAutoPtr<Entry> entry(new Entry());
+    entry->strings = JS_NewArrayObject(cx, vals.Length(), vals.Elements());
+    if (!entry->strings ||
+        !JS_AddNamedObjectRoot(cx, &entry->strings, "FoldCache entry"))
+        return nsnull;
+
+    entry->keys = keys;
+    PR_APPEND_LINK(entry, &mList);
+    mCount++;
+
+    Entry *result = entry.forget();
+    if (!result->Fold(cx, keys)) {
+        Remove(result);
+        return nsnull;
+    }
+
+    while (mCount > MAX_ENTRIES)
+        Remove(static_cast<Entry*>(PR_LIST_HEAD(&mList)));
+
+    return result;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "config.h"
+
+#include "nsTArray.h"
+
+#include "jsapi.h"
+#include "prclist.h"
+
+/*
+ * Appends *str*, lowercased as String.prototype.toLowerCase would, to
+ * *out*. Strings of ASCII are folded here, anything else by calling
+ * toLowerCase itself.
+ */
+NS_HIDDEN_(bool) FoldCase(JSContext *cx, JSString *str, nsTArray<jschar> &out);
+
+/* The lowercased text of a list of strings. */
+struct FoldedStrings {
+    /* Folds each of *strings*, replacing anything folded before. */
+    NS_HIDDEN_(bool) Fold(JSContext *cx, const nsTArray<JSString*> &strings);
+
+    const jschar *Text(PRUint32 i, size_t *length) const {
+        *length = offsets[i + 1] - offsets[i];
+        return chars.Elements() + offsets[i];
+    }
+
+    // The folded strings, one after another, and the offsets of each,
+    // with a final offset for the end of the last.
+    nsTArray<jschar> chars;
+    nsTArray<PRUint32> offsets;
+};
+
+/*
+ * The lowercased text of the last few lists of strings filtered without
+ * regard to case, so that each keystroke of a completion needn't fold
+ * every candidate again. Lists are recognized by the identity of the
+ * strings in them, which each entry keeps alive for as long as it's
+ * cached.
+ */
+class FoldCache {
+public:
+    struct Entry : public PRCList, public FoldedStrings {
+        // An array of the strings, rooted for the entry's lifetime.
+        JSObject *strings;
+        nsTArray<JSString*> keys;
+    };
+
+    FoldCache() NS_HIDDEN;
+    ~FoldCache() NS_HIDDEN;
+
+    NS_HIDDEN_(void) Init(JSRuntime *runtime);
+
+    /* Drops every entry. Must be called before the runtime goes away. */
+    NS_HIDDEN_(void) Clear();
+
+    /*
+     * Returns the folded text of *keys*, folding them if they aren't
+     * cached. The entry is valid until the next call.
+     */
+    NS_HIDDEN_(Entry*) Get(JSContext *cx, const nsTArray<JSString*> &keys);
+
+    PRUint32 Hits() const { return mHits; }
+    PRUint32 Misses() const { return mMisses; }
+    PRUint32 Count() const { return mCount; }
+
+private:
+    void Remove(Entry *entry);
+
+    JSRuntime *mRuntime;
+
+    PRUint32   mCount;
+    PRUint32   mHits;
+    PRUint32   mMisses;
+
+    // Runs from least to most recently used.
+    PRCList    mList;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
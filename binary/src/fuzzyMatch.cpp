@@ -0,0 +1,229 @@
+#include "fuzzyMatch.h"
+
+#include <new>
+
+// Every matched unit is worth kMatch, plus the best of the bonuses for
+// where it falls. Units skipped between matches cost kGap each, those
+// before the first kGapLeading, and those after the last kGapTrailing,
+// so that of two otherwise equal matches the shorter text wins.
+enum {
+    kMatch            = 16,
+    kBonusStart       = 48,
+    kBonusBoundary    = 32,
+    kBonusCamel       = 24,
+    kBonusConsecutive = 40,
+    kGapLeading       = -2,
+    kGap              = -3,
+    kGapTrailing      = -1
+};
+
+static const int32_t kNoMatch = -(1 << 29);
+
+// Patterns and texts longer than these are scored greedily, rather
+// than by trying every alignment.
+static const size_t kMaxPattern = 64;
+static const size_t kMaxText = 1024;
+
+// Gaps longer than texts we score fully cost no more than they do.
+static inline int32_t
+Units(size_t n)
+{
+    return int32_t(n < kMaxText ? n : kMaxText);
+}
+
+static inline bool
+IsWordUnit(uint16_t c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static inline int32_t
+Bonus(const uint16_t *text, size_t i)
+{
+    if (i == 0)
+        return kBonusStart;
+
+    uint16_t prev = text[i - 1], c = text[i];
+    if (!IsWordUnit(prev) && IsWordUnit(c))
+        return kBonusBoundary;
+    if (prev >= 'a' && prev <= 'z' && c >= 'A' && c <= 'Z')
+        return kBonusCamel;
+    return 0;
+}
+
+static inline int32_t
+Max(int32_t a, int32_t b)
+{
+    return a > b ? a : b;
+}
+
+FuzzyScorer::FuzzyScorer()
+    : mScratch(0), mCapacity(0)
+{
+}
+
+FuzzyScorer::~FuzzyScorer()
+{
+    delete[] mScratch;
+}
+
+bool
+FuzzyScorer::Reserve(size_t length)
+{
+    if (length <= mCapacity)
+        return true;
+
+    int32_t *scratch = new (std::nothrow) int32_t[length * 4];
+    if (!scratch)
+        return false;
+
+    delete[] mScratch;
+    mScratch = scratch;
+    mCapacity = length;
+    return true;
+}
+
+bool
+FuzzyScorer::Score(const uint16_t *text, const uint16_t *folded,
+                   size_t length, const uint16_t *pattern,
+                   size_t patternLength, bool anchored, int32_t *score)
+{
+    if (!patternLength) {
+        *score = kGapTrailing * Units(length);
+        return true;
+    }
+
+    // Rejects most candidates before any scoring.
+    size_t first = length, last = 0;
+    for (size_t i = 0, j = 0; j < patternLength; i++) {
+        if (i == length)
+            return false;
+        if (folded[i] == pattern[j]) {
+            if (!j)
+                first = i;
+            last = i;
+            j++;
+        }
+    }
+    if (anchored && first)
+        return false;
+
+    if (patternLength > kMaxPattern || length > kMaxText || !Reserve(length)) {
+        // Scores the leftmost match.
+        int32_t total = kGapLeading * Units(first);
+        size_t prev = first;
+        for (size_t i = first, j = 0; j < patternLength; i++)
+            if (folded[i] == pattern[j]) {
+                total += kMatch + (j && i == prev + 1 ? kBonusConsecutive
+                                                      : Bonus(text, i));
+                if (j)
+                    total += kGap * Units(i - prev - 1);
+                prev = i;
+                j++;
+            }
+        *score = total + kGapTrailing * Units(length - last - 1);
+        return true;
+    }
+
+    // D[j] is the best score of the pattern so far with its current unit
+    // matched at j, and M[j] with it matched at or before j.
+    int32_t *prevD = mScratch, *prevM = mScratch + length;
+    int32_t *curD = mScratch + length * 2, *curM = mScratch + length * 3;
+
+    for (size_t i = 0; i < patternLength; i++) {
+        uint16_t c = pattern[i];
+        int32_t gap = i + 1 == patternLength ? kGapTrailing : kGap;
+        int32_t best = kNoMatch;
+
+        for (size_t j = 0; j < length; j++) {
+            int32_t d = kNoMatch;
+            if (folded[j] == c) {
+                if (!i && j && anchored)
+                    d = kNoMatch;
+                else if (!i)
+                    d = kMatch + Bonus(text, j) + kGapLeading * int32_t(j);
+                else if (j)
+                    d = Max(prevM[j - 1] + kMatch + Bonus(text, j),
+                            prevD[j - 1] + kMatch + kBonusConsecutive);
+            }
+            curD[j] = d;
+            curM[j] = best = Max(d, best + gap);
+        }
+
+        int32_t *t;
+        t = prevD, prevD = curD, curD = t;
+        t = prevM, prevM = curM, curM = t;
+    }
+
+    *score = prevM[length - 1];
+    return *score > kNoMatch / 2;
+}
+
+TopScores::TopScores()
+    : mItems(0), mCount(0), mLimit(0)
+{
+}
+
+TopScores::~TopScores()
+{
+    delete[] mItems;
+}
+
+bool
+TopScores::Init(size_t limit)
+{
+    delete[] mItems;
+    mItems = new (std::nothrow) Item[limit ? limit : 1];
+    mCount = 0;
+    mLimit = limit;
+    return mItems != 0;
+}
+
+void
+TopScores::SiftDown(size_t i, size_t count)
+{
+    Item item = mItems[i];
+    for (size_t child; (child = i * 2 + 1) < count; i = child) {
+        if (child + 1 < count && Worse(mItems[child + 1], mItems[child]))
+            child++;
+        if (!Worse(mItems[child], item))
+            break;
+        mItems[i] = mItems[child];
+    }
+    mItems[i] = item;
+}
+
+void
+TopScores::Add(int32_t score, uint32_t index)
+{
+    Item item = { score, index };
+
+    if (mCount < mLimit) {
+        size_t i = mCount++;
+        for (size_t parent; i && Worse(item, mItems[parent = (i - 1) / 2]); i = parent)
+            mItems[i] = mItems[parent];
+        mItems[i] = item;
+    }
+    else if (mLimit && Worse(mItems[0], item)) {
+        mItems[0] = item;
+        SiftDown(0, mCount);
+    }
+}
+
+const TopScores::Item*
+TopScores::Sort(size_t *count)
+{
+    // Heapsort, leaving the worst last.
+    for (size_t n = mCount; n > 1; n--) {
+        Item worst = mItems[0];
+        mItems[0] = mItems[n - 1];
+        mItems[n - 1] = worst;
+        SiftDown(0, n - 1);
+    }
+
+    *count = mCount;
+    return mItems;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,81 @@
+#pragma once
+
+/*
+ * Fuzzy scoring of completion candidates, and selection of the best of
+ * them. Like stringSearch, these have no XPCOM dependencies.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scores how well *pattern* matches *text* as a subsequence, preferring
+ * matches which start words, which run on from the previous match, and
+ * which come early. Higher scores are better.
+ *
+ * *folded* is the text as it's compared to the pattern, either *text*
+ * itself or it lowercased, while word boundaries are found in *text*.
+ * Both must be *length* units long. If *anchored*, the pattern's first
+ * unit must match the text's.
+ */
+class FuzzyScorer {
+public:
+    FuzzyScorer();
+    ~FuzzyScorer();
+
+    /* Returns false if *pattern* isn't a subsequence of *folded*. */
+    bool Score(const uint16_t *text, const uint16_t *folded, size_t length,
+               const uint16_t *pattern, size_t patternLength, bool anchored,
+               int32_t *score);
+
+private:
+    FuzzyScorer(const FuzzyScorer&);
+    FuzzyScorer &operator=(const FuzzyScorer&);
+
+    bool Reserve(size_t length);
+
+    // Two rows each of the best score with the pattern's current unit
+    // matched at each position, and with it matched anywhere up to it.
+    int32_t *mScratch;
+    size_t mCapacity;
+};
+
+/*
+ * Keeps the *limit* best scored indices seen, in a min-heap, so that
+ * picking them from n candidates takes O(n log limit). Of equal scores,
+ * the earliest indices are kept.
+ */
+class TopScores {
+public:
+    struct Item {
+        int32_t score;
+        uint32_t index;
+    };
+
+    TopScores();
+    ~TopScores();
+
+    /* Returns false if it can't allocate room for *limit* items. */
+    bool Init(size_t limit);
+
+    void Add(int32_t score, uint32_t index);
+
+    /* Sorts the items kept, best first, and returns them. */
+    const Item *Sort(size_t *count);
+
+private:
+    TopScores(const TopScores&);
+    TopScores &operator=(const TopScores&);
+
+    static bool Worse(const Item &a, const Item &b) {
+        return a.score < b.score || (a.score == b.score && a.index > b.index);
+    }
+
+    void SiftDown(size_t i, size_t count);
+
+    Item *mItems;
+    size_t mCount;
+    size_t mLimit;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,146 @@
+#include "globalPool.h"
+#include "dactylUtils.h"
+
+#include "nsIJSContextStack.h"
+#include "nsServiceManagerUtils.h"
+#include "nsThreadUtils.h"
+
+#include <string.h>
+
+// Enough for the windows and sandboxes of a burst of activity.
+#define DEFAULT_SIZE 2
+
+NS_IMPL_ISUPPORTS1(GlobalPool, nsIObserver)
+
+GlobalPool::GlobalPool()
+    : mIdle(false), mFilling(false), mShutdown(false),
+      mSize(DEFAULT_SIZE), mHits(0), mMisses(0)
+{}
+
+GlobalPool::~GlobalPool()
+{
+    NS_ASSERTION(!mGlobals.Length(),
+                 "Global pool destroyed while still holding globals");
+}
+
+void
+GlobalPool::Init()
+{
+    // Without an idle service, there's nothing to wait for.
+    mIdleService = do_GetService("@mozilla.org/widget/idleservice;1");
+    if (mIdleService &&
+        NS_FAILED(mIdleService->AddIdleObserver(this, kIdleSeconds)))
+        mIdleService = nsnull;
+
+    if (!mIdleService)
+        mIdle = true;
+    ScheduleFill();
+}
+
+void
+GlobalPool::Shutdown()
+{
+    if (mIdleService)
+        mIdleService->RemoveIdleObserver(this, kIdleSeconds);
+    mIdleService = nsnull;
+
+    mShutdown = true;
+    mGlobals.Clear();
+}
+
+void
+GlobalPool::SetSize(PRUint32 size)
+{
+    mSize = size;
+    if (mGlobals.Length() > size)
+        mGlobals.RemoveElementsAt(size, mGlobals.Length() - size);
+    ScheduleFill();
+}
+
+bool
+GlobalPool::Take(nsIXPConnectJSObjectHolder **holder)
+{
+    PRUint32 length = mGlobals.Length();
+    if (!length) {
+        mMisses++;
+        ScheduleFill();
+        return false;
+    }
+
+    mGlobals[length - 1].forget(holder);
+    mGlobals.RemoveElementAt(length - 1);
+    mHits++;
+
+    ScheduleFill();
+    return true;
+}
+
+NS_IMETHODIMP
+GlobalPool::Observe(nsISupports *aSubject, const char *aTopic,
+                    const PRUnichar *aData)
+{
+    if (!strcmp(aTopic, "idle")) {
+        mIdle = true;
+        ScheduleFill();
+    }
+    else if (!strcmp(aTopic, "back"))
+        mIdle = false;
+    return NS_OK;
+}
+
+void
+GlobalPool::ScheduleFill()
+{
+    if (mFilling || !mIdle || mShutdown || mGlobals.Length() >= mSize)
+        return;
+
+    if (NS_SUCCEEDED(NS_DispatchToCurrentThread(
+            NS_NewRunnableMethod(this, &GlobalPool::Fill))))
+        mFilling = true;
+}
+
+/* Makes a single global, and schedules the next. */
+void
+GlobalPool::Fill()
+{
+    mFilling = false;
+    if (!mIdle || mShutdown || mGlobals.Length() >= mSize)
+        return;
+
+    dactylUtils *utils = dactylUtils::GetService();
+
+    nsCOMPtr<nsIThreadJSContextStack> stack =
+        do_GetService("@mozilla.org/js/xpc/ContextStack;1");
+
+    JSContext *cx = nsnull;
+    if (stack)
+        stack->GetSafeJSContext(&cx);
+
+    if (!utils || !cx || NS_FAILED(stack->Push(cx)))
+        return;
+
+    nsCOMPtr<nsIXPConnectJSObjectHolder> holder;
+    nsresult rv;
+    {
+        JSAutoRequest ar(cx);
+
+        // Making a global replaces the context's, which for the safe
+        // context mustn't change.
+        JSObject *global = JS_GetGlobalObject(cx);
+        rv = utils->NewGlobal(cx, getter_AddRefs(holder));
+        JS_SetGlobalObject(cx, global);
+
+        JS_ClearPendingException(cx);
+    }
+
+    stack->Pop(nsnull);
+
+    // Don't keep trying something which can't work.
+    if (NS_FAILED(rv))
+        return;
+
+    mGlobals.AppendElement(holder);
+    ScheduleFill();
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "config.h"
+
+#include "nsCOMPtr.h"
+#include "nsIIdleService.h"
+#include "nsIObserver.h"
+#include "nsIXPConnect.h"
+#include "nsTArray.h"
+
+/*
+ * A few globals made ahead of time, so that createGlobal, which new
+ * windows and sandboxes wait on, needn't make them itself. The pool is
+ * filled a global at a time, on separate turns of the event loop, once
+ * the user has been idle for a moment, and stops as soon as they're back.
+ * Each global is handed out only once.
+ */
+class GlobalPool : public nsIObserver {
+public:
+    NS_DECL_ISUPPORTS
+    NS_DECL_NSIOBSERVER
+
+    GlobalPool() NS_HIDDEN;
+    ~GlobalPool() NS_HIDDEN;
+
+    NS_HIDDEN_(void) Init();
+
+    /* Drops every global, and stops filling. */
+    NS_HIDDEN_(void) Shutdown();
+
+    NS_HIDDEN_(void) SetSize(PRUint32 size);
+    PRUint32 Size() const { return mSize; }
+
+    /* Hands out a global from the pool, or fails if it's empty. */
+    NS_HIDDEN_(bool) Take(nsIXPConnectJSObjectHolder **holder);
+
+    PRUint32 Hits() const { return mHits; }
+    PRUint32 Misses() const { return mMisses; }
+    PRUint32 Available() const { return mGlobals.Length(); }
+
+    NS_HIDDEN_(void) Fill();
+
+private:
+    // How long, in seconds, the user must be idle before we fill.
+    static const PRUint32 kIdleSeconds = 1;
+
+    void ScheduleFill();
+
+    nsCOMPtr<nsIIdleService> mIdleService;
+    bool                     mIdle;
+    bool                     mFilling;
+    bool                     mShutdown;
+
+    PRUint32                 mSize;
+    PRUint32                 mHits;
+    PRUint32                 mMisses;
+
+    nsTArray<nsCOMPtr<nsIXPConnectJSObjectHolder> > mGlobals;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
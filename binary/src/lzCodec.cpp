@@ -0,0 +1,205 @@
+#include "lzCodec.h"
+
+#include <string.h>
+
+/*
+ * Each sequence is a token, whose high nibble is a literal count and low
+ * nibble a match length less kMinMatch, either of which continues into
+ * following bytes when it's 15; then the literals; then a two-byte,
+ * little-endian match offset; then the rest of the match length. The
+ * last sequence is literals alone. As in LZ4, the last kLastLiterals
+ * bytes are always literals, and no match starts within kMatchLimit bytes
+ * of the end.
+ */
+static const size_t kMinMatch     = 4;
+static const size_t kLastLiterals = 5;
+static const size_t kMatchLimit   = 12;
+static const size_t kMaxOffset    = 65535;
+static const int    kHashBits     = 12;
+
+static inline uint32_t
+Read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint32_t
+Hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - kHashBits);
+}
+
+static inline uint8_t*
+WriteLength(uint8_t *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = uint8_t(length);
+    return op;
+}
+
+/* The bytes needed by a sequence, beyond the ones for its literals. */
+static inline size_t
+SequenceOverhead(size_t literals, size_t matchLength)
+{
+    return 1 + literals / 255 + 1 + 2 + matchLength / 255 + 1;
+}
+
+size_t
+LZCompressBound(size_t length)
+{
+    return length + length / 255 + 16;
+}
+
+size_t
+LZDecompressBound(size_t length)
+{
+    return length * 255;
+}
+
+size_t
+LZCompress(const char *aSrc, size_t length, char *aDst, size_t capacity)
+{
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(aSrc);
+    const uint8_t *end = src + length;
+    const uint8_t *ip = src, *anchor = src;
+    uint8_t *dst = reinterpret_cast<uint8_t*>(aDst);
+    uint8_t *op = dst, *opEnd = dst + capacity;
+
+    // Positions of the last occurrences of each hashed four bytes.
+    uint32_t table[1 << kHashBits];
+    memset(table, 0, sizeof table);
+
+    if (length > kMatchLimit) {
+        const uint8_t *matchLimit = end - kMatchLimit;
+        const uint8_t *matchEnd = end - kLastLiterals;
+
+        while (ip < matchLimit) {
+            uint32_t seq = Read32(ip);
+            uint32_t h = Hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = uint32_t(ip - src);
+
+            if (ref >= ip || size_t(ip - ref) > kMaxOffset || Read32(ref) != seq) {
+                // Skip faster through data which doesn't compress.
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *p = ip + kMinMatch, *r = ref + kMinMatch;
+            while (p < matchEnd && *p == *r) {
+                p++;
+                r++;
+            }
+
+            size_t literals = ip - anchor;
+            size_t matchLength = p - ip - kMinMatch;
+            if (SequenceOverhead(literals, matchLength) + literals > size_t(opEnd - op))
+                return 0;
+
+            uint8_t *token = op++;
+            *token = uint8_t((literals < 15 ? literals : 15) << 4);
+            if (literals >= 15)
+                op = WriteLength(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            size_t offset = ip - ref;
+            *op++ = uint8_t(offset);
+            *op++ = uint8_t(offset >> 8);
+
+            *token |= uint8_t(matchLength < 15 ? matchLength : 15);
+            if (matchLength >= 15)
+                op = WriteLength(op, matchLength - 15);
+
+            ip = anchor = p;
+        }
+    }
+
+    size_t literals = end - anchor;
+    if (1 + literals / 255 + 1 + literals > size_t(opEnd - op))
+        return 0;
+
+    *op++ = uint8_t((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+        op = WriteLength(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - dst;
+}
+
+/* Reads the continuation of a length whose nibble was 15. */
+static inline bool
+ReadLength(const uint8_t **ip, const uint8_t *ipEnd, size_t *length)
+{
+    unsigned b;
+    do {
+        if (*ip >= ipEnd)
+            return false;
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+bool
+LZDecompress(const char *aSrc, size_t length, char *aDst, size_t rawLength)
+{
+    const uint8_t *ip = reinterpret_cast<const uint8_t*>(aSrc);
+    const uint8_t *ipEnd = ip + length;
+    uint8_t *dst = reinterpret_cast<uint8_t*>(aDst);
+    uint8_t *op = dst, *opEnd = dst + rawLength;
+
+    for (;;) {
+        if (ip >= ipEnd)
+            return false;
+        unsigned token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !ReadLength(&ip, ipEnd, &literals))
+            return false;
+        if (literals > size_t(ipEnd - ip) || literals > size_t(opEnd - op))
+            return false;
+
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        if (ip == ipEnd)
+            return op == opEnd;
+
+        if (ipEnd - ip < 2)
+            return false;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!offset || offset > size_t(op - dst))
+            return false;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !ReadLength(&ip, ipEnd, &matchLength))
+            return false;
+        matchLength += kMinMatch;
+        if (matchLength > size_t(opEnd - op))
+            return false;
+
+        // Matches may overlap their own output, in which case they have
+        // to be copied a byte at a time.
+        const uint8_t *ref = op - offset;
+        if (offset >= matchLength)
+            memcpy(op, ref, matchLength);
+        else
+            for (size_t i = 0; i < matchLength; i++)
+                op[i] = ref[i];
+        op += matchLength;
+    }
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,37 @@
+#pragma once
+
+/*
+ * A fast LZ77 block codec, producing LZ4's block format, for cached
+ * bytecode. Like utf8Decoder, it has no XPCOM dependencies.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The largest compressed size of *length* bytes. */
+size_t
+LZCompressBound(size_t length);
+
+/*
+ * The largest size *length* compressed bytes can decompress to. Each
+ * byte of a match length's continuation adds at most 255 bytes.
+ */
+size_t
+LZDecompressBound(size_t length);
+
+/*
+ * Compresses *src* into *dst*, which holds *capacity* bytes. Returns the
+ * compressed size, or 0 if it wouldn't fit.
+ */
+size_t
+LZCompress(const char *src, size_t length, char *dst, size_t capacity);
+
+/*
+ * Decompresses *src* into *dst*, which must be exactly *rawLength* bytes
+ * long. Returns false if *src* is malformed or doesn't decompress to
+ * exactly that length. Never reads or writes out of bounds.
+ */
+bool
+LZDecompress(const char *src, size_t length, char *dst, size_t rawLength);
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
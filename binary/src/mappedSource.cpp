@@ -0,0 +1,303 @@
+#include "mappedSource.h"
+#include "mozJSLoaderUtils.h"
+
+#include "nsCOMPtr.h"
+#include "nsDataHashtable.h"
+#include "nsHashKeys.h"
+#include "nsIFile.h"
+#include "nsIFileURL.h"
+#include "nsIJARURI.h"
+#include "nsILocalFile.h"
+#include "nsIURI.h"
+#include "nsStringAPI.h"
+#include "nsTArray.h"
+
+#include "prio.h"
+
+MappedFile::MappedFile()
+    : mModified(0), mFD(nsnull), mMap(nsnull), mData(nsnull), mLength(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    if (mData)
+        PR_MemUnmap(const_cast<char*>(mData), mLength);
+    if (mMap)
+        PR_CloseFileMap(mMap);
+    if (mFD)
+        PR_Close(mFD);
+}
+
+nsresult
+MappedFile::Init(nsIFile *file)
+{
+    nsresult rv;
+
+    nsCOMPtr<nsILocalFile> localFile = do_QueryInterface(file, &rv);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    rv = file->GetLastModifiedTime(&mModified);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    PRInt64 size;
+    rv = file->GetFileSize(&size);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    // Empty files can't be mapped, and huge ones aren't scripts.
+    if (size <= 0 || size > PR_INT32_MAX)
+        return NS_ERROR_NOT_AVAILABLE;
+    mLength = PRUint32(size);
+
+    rv = localFile->OpenNSPRFileDesc(PR_RDONLY, 0, &mFD);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    mMap = PR_CreateFileMap(mFD, size, PR_PROT_READONLY);
+    NS_ENSURE_TRUE(mMap, NS_ERROR_FAILURE);
+
+    mData = static_cast<const char*>(PR_MemMap(mMap, 0, mLength));
+    NS_ENSURE_TRUE(mData, NS_ERROR_FAILURE);
+
+    return NS_OK;
+}
+
+static inline PRUint16
+ReadLE16(const char *p)
+{
+    const PRUint8 *b = reinterpret_cast<const PRUint8*>(p);
+    return PRUint16(b[0] | b[1] << 8);
+}
+
+static inline PRUint32
+ReadLE32(const char *p)
+{
+    const PRUint8 *b = reinterpret_cast<const PRUint8*>(p);
+    return PRUint32(b[0] | b[1] << 8 | b[2] << 16) | PRUint32(b[3]) << 24;
+}
+
+#define ZIP_EOCD_SIG        0x06054b50
+#define ZIP_EOCD_SIZE       22
+#define ZIP_CENTRAL_SIG     0x02014b50
+#define ZIP_CENTRAL_SIZE    46
+#define ZIP_LOCAL_SIG       0x04034b50
+#define ZIP_LOCAL_SIZE      30
+#define ZIP_STORED          0
+
+/*
+ * Jars stay mapped until they're flushed from the jar cache, or XPCOM
+ * shuts down, since we load many scripts out of the same few of them.
+ * They're remapped if they change.
+ * Each one's central directory is read once, when it's mapped, into an
+ * index of the offsets of its entries' records by name.
+ */
+struct JarMapping {
+    nsCString            path;
+    nsRefPtr<MappedFile> file;
+    nsDataHashtable<nsCStringHashKey, PRUint32> entries;
+};
+static nsTArray<nsAutoPtr<JarMapping> > gJarMappings;
+
+/*
+ * Indexes the central directory of the zip archive mapped at *data* into
+ * *entries*.
+ */
+static nsresult
+ReadCentralDirectory(const char *data, PRUint32 length,
+                     nsDataHashtable<nsCStringHashKey, PRUint32> &entries)
+{
+    if (length < ZIP_EOCD_SIZE)
+        return NS_ERROR_FILE_CORRUPTED;
+
+    // The end of central directory record is followed only by an
+    // archive comment of at most 64K.
+    const char *eocd = nsnull;
+    PRUint32 limit = length - ZIP_EOCD_SIZE;
+    for (PRUint32 i = 0; i <= limit && i <= 0xffff; i++)
+        if (ReadLE32(data + limit - i) == ZIP_EOCD_SIG) {
+            eocd = data + limit - i;
+            break;
+        }
+    NS_ENSURE_TRUE(eocd, NS_ERROR_FILE_CORRUPTED);
+
+    PRUint16 count = ReadLE16(eocd + 10);
+    PRUint32 offset = ReadLE32(eocd + 16);
+    const char *end = eocd;
+
+    NS_ENSURE_TRUE(entries.Init(count ? count : 1), NS_ERROR_OUT_OF_MEMORY);
+
+    for (const char *p = data + offset; count--; ) {
+        NS_ENSURE_TRUE(p >= data && p + ZIP_CENTRAL_SIZE <= end &&
+                       ReadLE32(p) == ZIP_CENTRAL_SIG,
+                       NS_ERROR_FILE_CORRUPTED);
+
+        PRUint16 nameLength    = ReadLE16(p + 28);
+        PRUint16 extraLength   = ReadLE16(p + 30);
+        PRUint16 commentLength = ReadLE16(p + 32);
+        const char *entryName  = p + ZIP_CENTRAL_SIZE;
+        NS_ENSURE_TRUE(entryName + nameLength <= end, NS_ERROR_FILE_CORRUPTED);
+
+        // As in a linear search, the first of any duplicates wins.
+        const nsDependentCSubstring key = Substring(entryName, nameLength);
+        if (!entries.Get(key, nsnull))
+            NS_ENSURE_TRUE(entries.Put(key, PRUint32(p - data)),
+                           NS_ERROR_OUT_OF_MEMORY);
+
+        p = entryName + nameLength + extraLength + commentLength;
+    }
+
+    return NS_OK;
+}
+
+static nsresult
+GetJarMapping(nsIFile *file, JarMapping **result)
+{
+    nsresult rv;
+
+    nsCAutoString path;
+    rv = file->GetNativePath(path);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    PRInt64 modified;
+    rv = file->GetLastModifiedTime(&modified);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    PRUint32 i;
+    for (i = 0; i < gJarMappings.Length(); i++)
+        if (gJarMappings[i]->path.Equals(path))
+            break;
+
+    if (i == gJarMappings.Length() ||
+        gJarMappings[i]->file->Modified() != modified) {
+        nsAutoPtr<JarMapping> mapping(new JarMapping());
+        mapping->path = path;
+
+        mapping->file = new MappedFile();
+        rv = mapping->file->Init(file);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        rv = ReadCentralDirectory(mapping->file->Data(),
+                                  mapping->file->Length(), mapping->entries);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        if (i == gJarMappings.Length())
+            NS_ENSURE_TRUE(gJarMappings.AppendElement(mapping.forget()),
+                           NS_ERROR_OUT_OF_MEMORY);
+        else
+            gJarMappings[i] = mapping.forget();
+    }
+
+    *result = gJarMappings[i];
+    return NS_OK;
+}
+
+void
+MappedSource::ReleaseJar(nsIFile *file)
+{
+    nsCAutoString path;
+    if (NS_FAILED(file->GetNativePath(path)))
+        return;
+
+    for (PRUint32 i = 0; i < gJarMappings.Length(); i++)
+        if (gJarMappings[i]->path.Equals(path)) {
+            gJarMappings.RemoveElementAt(i);
+            break;
+        }
+}
+
+void
+MappedSource::ReleaseJars()
+{
+    gJarMappings.Clear();
+}
+
+/*
+ * Finds *name* in the indexed jar *mapping* and, if it's stored
+ * uncompressed, returns its bytes in place.
+ */
+static nsresult
+FindStoredEntry(JarMapping *mapping, const nsACString &name,
+                const char **entry, PRUint32 *entryLength)
+{
+    const char *data = mapping->file->Data();
+    PRUint32 length = mapping->file->Length();
+
+    PRUint32 central;
+    if (!mapping->entries.Get(name, &central))
+        return NS_ERROR_FILE_NOT_FOUND;
+
+    // The record was checked to be in bounds when it was indexed.
+    const char *p = data + central;
+    if (ReadLE16(p + 10) != ZIP_STORED)
+        return NS_ERROR_NOT_AVAILABLE;
+
+    PRUint32 size = ReadLE32(p + 20);
+    PRUint32 local = ReadLE32(p + 42);
+    NS_ENSURE_TRUE(length >= ZIP_LOCAL_SIZE &&
+                   local <= length - ZIP_LOCAL_SIZE &&
+                   ReadLE32(data + local) == ZIP_LOCAL_SIG,
+                   NS_ERROR_FILE_CORRUPTED);
+
+    PRUint32 start = local + ZIP_LOCAL_SIZE +
+                     ReadLE16(data + local + 26) +
+                     ReadLE16(data + local + 28);
+    NS_ENSURE_TRUE(start <= length && size <= length - start,
+                   NS_ERROR_FILE_CORRUPTED);
+
+    *entry = data + start;
+    *entryLength = size;
+    return NS_OK;
+}
+
+nsresult
+MappedSource::Init(nsIURI *aURI)
+{
+    nsresult rv;
+
+    nsCOMPtr<nsIURI> uri;
+    rv = ResolveURI(aURI, getter_AddRefs(uri));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    nsCOMPtr<nsIFileURL> fileURL = do_QueryInterface(uri);
+    if (fileURL) {
+        nsCOMPtr<nsIFile> file;
+        rv = fileURL->GetFile(getter_AddRefs(file));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        mFile = new MappedFile();
+        rv = mFile->Init(file);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        mData = mFile->Data();
+        mLength = mFile->Length();
+        return NS_OK;
+    }
+
+    nsCOMPtr<nsIJARURI> jarURI = do_QueryInterface(uri);
+    if (jarURI) {
+        nsCOMPtr<nsIURI> jarFileURI;
+        rv = jarURI->GetJARFile(getter_AddRefs(jarFileURI));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIFileURL> jarFileURL = do_QueryInterface(jarFileURI, &rv);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIFile> jarFile;
+        rv = jarFileURL->GetFile(getter_AddRefs(jarFile));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCAutoString entryName;
+        rv = jarURI->GetJAREntry(entryName);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        JarMapping *mapping;
+        rv = GetJarMapping(jarFile, &mapping);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        mFile = mapping->file;
+        return FindStoredEntry(mapping, entryName, &mData, &mLength);
+    }
+
+    return NS_ERROR_NOT_AVAILABLE;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
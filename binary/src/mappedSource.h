@@ -0,0 +1,65 @@
+#pragma once
+
+#include "config.h"
+
+#include "nsISupports.h"
+#include "nsAutoPtr.h"
+#include "prio.h"
+
+class nsIFile;
+class nsIURI;
+
+/*
+ * A read-only memory mapping of an entire file.
+ */
+class MappedFile {
+public:
+    MappedFile() NS_HIDDEN;
+    ~MappedFile() NS_HIDDEN;
+
+    NS_INLINE_DECL_REFCOUNTING(MappedFile)
+
+    NS_HIDDEN_(nsresult) Init(nsIFile *file);
+
+    const char *Data() const { return mData; }
+    PRUint32 Length() const { return mLength; }
+    PRInt64 Modified() const { return mModified; }
+
+private:
+    PRInt64     mModified;
+    PRFileDesc *mFD;
+    PRFileMap  *mMap;
+    const char *mData;
+    PRUint32    mLength;
+};
+
+/*
+ * The source of a script, mapped straight from disk rather than read
+ * through a channel. Only file: URIs and jar: entries which are stored
+ * uncompressed in a local jar can be mapped.
+ */
+class MappedSource {
+public:
+    MappedSource() : mData(nsnull), mLength(0) {}
+
+    NS_HIDDEN_(nsresult) Init(nsIURI *uri);
+
+    const char *Data() const { return mData; }
+    PRUint32 Length() const { return mLength; }
+
+    /*
+     * Unmaps the jar *file*, if it's mapped, once the sources still
+     * pointing into it are gone.
+     */
+    static NS_HIDDEN_(void) ReleaseJar(nsIFile *file);
+
+    /* Unmaps every jar. Must be called before XPCOM shuts down. */
+    static NS_HIDDEN_(void) ReleaseJars();
+
+private:
+    nsRefPtr<MappedFile> mFile;
+    const char *mData;
+    PRUint32    mLength;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
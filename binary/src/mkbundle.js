@@ -0,0 +1,47 @@
+// Writes the prebuilt bytecode bundle for the scripts in a staged chrome
+// directory. Run by `make bundle` under the SDK's xpcshell:
+//
+//   xpcshell mkbundle.js <bundle> <stage directory> <components.manifest>
+"use strict";
+
+var { classes: Cc, interfaces: Ci, utils: Cu } = Components;
+
+function File(path) {
+    let file = Cc["@mozilla.org/file/local;1"].createInstance(Ci.nsILocalFile);
+    file.initWithPath(path);
+    return file;
+}
+
+let [bundle, stage, manifest] = arguments;
+
+Components.manager.QueryInterface(Ci.nsIComponentRegistrar)
+          .autoRegister(File(manifest));
+
+let utils = Cc["@dactyl.googlecode.com/extra/utils"]
+                .getService(Ci.dactylIUtils);
+
+// The resources these directories are mapped to, as in config.json.
+let dirs = {
+    "content": ["resource://dactyl-content/", /\.js$/],
+    "modules": ["resource://dactyl/",         /\.jsm$/]
+};
+
+let urls = [], paths = [];
+for (let [dir, [base, pattern]] in Iterator(dirs)) {
+    let entries = File(stage).clone();
+    entries.append(dir);
+
+    entries = entries.directoryEntries;
+    while (entries.hasMoreElements()) {
+        let file = entries.getNext().QueryInterface(Ci.nsIFile);
+        if (pattern.test(file.leafName)) {
+            urls.push(base + file.leafName);
+            paths.push(file.path);
+        }
+    }
+}
+
+utils.writeScriptBundle(File(bundle), urls, paths);
+dump("Wrote " + urls.length + " scripts to " + bundle + "\n");
+
+// vim: set fdm=marker sw=4 sts=4 ts=8 et ft=javascript:
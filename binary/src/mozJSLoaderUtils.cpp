@@ -36,6 +36,7 @@
  * ***** END LICENSE BLOCK ***** */
 
 #include "mozJSLoaderUtils.h"
+#include "lzCodec.h"
 #include "nsAutoPtr.h"
 
 #include "jsapi.h"
@@ -45,12 +46,247 @@
 #include "mozilla/scache/StartupCacheUtils.h"
 
 #include "nsIChromeRegistry.h"
+#include "nsIFile.h"
+#include "nsIFileURL.h"
 #include "nsIIOService.h"
+#include "nsIJARProtocolHandler.h"
+#include "nsIJARURI.h"
+#include "nsIPrincipal.h"
 #include "nsIResProtocolHandler.h"
+#include "nsISeekableStream.h"
+#include "nsIStringStream.h"
+#include "nsIZipReader.h"
 #include "nsNetUtil.h"
 
+#include "prtime.h"
+
+#include <new>
+
 using namespace mozilla::scache;
 
+// Precedes the stamp at the head of each of our cache entries.
+static const PRUint32 kScriptCacheMagic = 0x64534301; // "dSC\1"
+
+// Precedes the codec and uncompressed size of compressed entries, which
+// decompress to an entry starting with kScriptCacheMagic.
+static const PRUint32 kCompressedMagic = 0x64535a01; // "dSZ\1"
+static const PRUint32 kCompressedHeaderSize = 4 + 4 + 4;
+
+// No script's bytecode comes anywhere near this. A larger uncompressed
+// size in a header means the entry is corrupt.
+static const PRUint32 kMaxUncompressedSize = 64 << 20;
+
+enum {
+    CODEC_LZ = 1
+};
+
+// Smaller entries, and entries which shrink by less than an eighth, are
+// left as they are.
+static const PRUint32 kMinCompressedSize = 512;
+
+static ScriptCompressionStats gCompressionStats;
+static bool gCompressionEnabled = true;
+
+const ScriptCompressionStats &
+CompressionStats()
+{
+    return gCompressionStats;
+}
+
+bool
+CacheCompressionEnabled()
+{
+    return gCompressionEnabled;
+}
+
+void
+SetCacheCompressionEnabled(bool enabled)
+{
+    gCompressionEnabled = enabled;
+}
+
+nsresult
+ResolveURI(nsIURI *aURI, nsIURI **aResult)
+{
+    nsresult rv;
+
+    nsCOMPtr<nsIIOService> ioService = do_GetIOService(&rv);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    nsCOMPtr<nsIURI> uri = aURI;
+
+    // Mappings may chain, e.g. chrome: to resource: to jar:
+    for (int i = 0; i < 4; i++) {
+        nsCAutoString scheme;
+        rv = uri->GetScheme(scheme);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIURI> resolved;
+        if (scheme.Equals("chrome")) {
+            nsCOMPtr<nsIChromeRegistry> chromeReg =
+                do_GetService("@mozilla.org/chrome/chrome-registry;1", &rv);
+            NS_ENSURE_SUCCESS(rv, rv);
+
+            rv = chromeReg->ConvertChromeURL(uri, getter_AddRefs(resolved));
+            NS_ENSURE_SUCCESS(rv, rv);
+        }
+        else if (scheme.Equals("resource")) {
+            nsCOMPtr<nsIProtocolHandler> ph;
+            rv = ioService->GetProtocolHandler("resource", getter_AddRefs(ph));
+            NS_ENSURE_SUCCESS(rv, rv);
+
+            nsCOMPtr<nsIResProtocolHandler> irph = do_QueryInterface(ph, &rv);
+            NS_ENSURE_SUCCESS(rv, rv);
+
+            nsCAutoString spec;
+            rv = irph->ResolveURI(uri, spec);
+            NS_ENSURE_SUCCESS(rv, rv);
+
+            rv = ioService->NewURI(spec, nsnull, nsnull,
+                                   getter_AddRefs(resolved));
+            NS_ENSURE_SUCCESS(rv, rv);
+        }
+        else
+            break;
+
+        uri = resolved;
+    }
+
+    NS_ADDREF(*aResult = uri);
+    return NS_OK;
+}
+
+static PRUint32 gCRCTable[256];
+
+PRUint32
+UpdateCRC32(PRUint32 crc, const char *data, PRUint32 len)
+{
+    if (!gCRCTable[1])
+        for (PRUint32 i = 0; i < 256; i++) {
+            PRUint32 c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            gCRCTable[i] = c;
+        }
+
+    crc = ~crc;
+    for (const char *end = data + len; data < end; data++)
+        crc = gCRCTable[(crc ^ PRUint8(*data)) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+nsresult
+GetScriptStamp(nsIURI *aURI, ScriptStamp *stamp)
+{
+    nsresult rv;
+
+    *stamp = ScriptStamp();
+
+    nsCOMPtr<nsIURI> uri;
+    rv = ResolveURI(aURI, getter_AddRefs(uri));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    nsCOMPtr<nsIFileURL> fileURL = do_QueryInterface(uri);
+    if (fileURL) {
+        nsCOMPtr<nsIFile> file;
+        rv = fileURL->GetFile(getter_AddRefs(file));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        rv = file->GetLastModifiedTime(&stamp->mtime);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        return file->GetFileSize(&stamp->size);
+    }
+
+    nsCOMPtr<nsIJARURI> jarURI = do_QueryInterface(uri);
+    if (jarURI) {
+        nsCOMPtr<nsIURI> jarFileURI;
+        rv = jarURI->GetJARFile(getter_AddRefs(jarFileURI));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        // Nested jars aren't worth the trouble.
+        nsCOMPtr<nsIFileURL> jarFileURL = do_QueryInterface(jarFileURI, &rv);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIFile> jarFile;
+        rv = jarFileURL->GetFile(getter_AddRefs(jarFile));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCAutoString entryName;
+        rv = jarURI->GetJAREntry(entryName);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIIOService> ioService = do_GetIOService(&rv);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIProtocolHandler> ph;
+        rv = ioService->GetProtocolHandler("jar", getter_AddRefs(ph));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIJARProtocolHandler> jarHandler = do_QueryInterface(ph, &rv);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIZipReaderCache> zipCache;
+        rv = jarHandler->GetJARCache(getter_AddRefs(zipCache));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIZipReader> reader;
+        rv = zipCache->GetZip(jarFile, getter_AddRefs(reader));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        nsCOMPtr<nsIZipEntry> entry;
+        rv = reader->GetEntry(entryName, getter_AddRefs(entry));
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        PRUint32 size;
+        rv = entry->GetRealSize(&size);
+        NS_ENSURE_SUCCESS(rv, rv);
+        stamp->size = size;
+
+        return entry->GetCRC32(&stamp->crc);
+    }
+
+    return NS_ERROR_NOT_AVAILABLE;
+}
+
+static nsresult
+ReadStamp(nsIObjectInputStream *stream, ScriptStamp *stamp)
+{
+    nsresult rv;
+
+    PRUint32 magic;
+    rv = stream->Read32(&magic);
+    NS_ENSURE_SUCCESS(rv, rv);
+    if (magic != kScriptCacheMagic)
+        return NS_ERROR_SCRIPT_CACHE_STALE;
+
+    PRUint64 mtime, size;
+    rv = stream->Read64(&mtime);
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = stream->Read64(&size);
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = stream->Read32(&stamp->crc);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    stamp->mtime = mtime;
+    stamp->size = size;
+    return NS_OK;
+}
+
+static nsresult
+WriteStamp(nsIObjectOutputStream *stream, const ScriptStamp &stamp)
+{
+    nsresult rv;
+
+    rv = stream->Write32(kScriptCacheMagic);
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = stream->Write64(stamp.mtime);
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = stream->Write64(stamp.size);
+    NS_ENSURE_SUCCESS(rv, rv);
+    return stream->Write32(stamp.crc);
+}
+
 static nsresult
 ReadScriptFromStream(JSContext *cx, nsIObjectInputStream *stream,
                      JSScriptType **script)
@@ -150,28 +386,348 @@ WriteScriptToStream(JSContext *cx, JSScriptType *script,
 }
 
 nsresult
-ReadCachedScript(nsIStartupCache* cache, nsACString &uri, JSContext *cx, JSScriptType **script)
+ReadCachedBuffer(nsIStartupCache* cache, nsACString &uri, char **buf,
+                 PRUint32 *len)
 {
-    nsresult rv;
+    return cache->GetBuffer(PromiseFlatCString(uri).get(), buf, len);
+}
+
+static PRUint32
+ReadBE32(const char *aData)
+{
+    const PRUint8 *data = reinterpret_cast<const PRUint8*>(aData);
+    return PRUint32(data[0]) << 24 | PRUint32(data[1]) << 16 |
+           PRUint32(data[2]) << 8  | PRUint32(data[3]);
+}
+
+static PRUint64
+ReadBE64(const char *data)
+{
+    return PRUint64(ReadBE32(data)) << 32 | ReadBE32(data + 4);
+}
+
+static void
+WriteBE32(char *aData, PRUint32 n)
+{
+    PRUint8 *data = reinterpret_cast<PRUint8*>(aData);
+    data[0] = PRUint8(n >> 24);
+    data[1] = PRUint8(n >> 16);
+    data[2] = PRUint8(n >> 8);
+    data[3] = PRUint8(n);
+}
+
+/*
+ * If *buf* is a compressed entry, decompresses it into a new[] allocated
+ * *raw*. Otherwise, leaves *raw* null.
+ */
+static nsresult
+InflateEntry(const char *buf, PRUint32 len, char **raw, PRUint32 *rawLen)
+{
+    *raw = nsnull;
+
+    if (len < kCompressedHeaderSize || ReadBE32(buf) != kCompressedMagic)
+        return NS_OK;
+
+    PRUint32 codec = ReadBE32(buf + 4);
+    PRUint32 size = ReadBE32(buf + 8);
+
+    // Entries from some later version. They'll be overwritten.
+    if (codec != CODEC_LZ)
+        return NS_ERROR_SCRIPT_CACHE_STALE;
+
+    // The header's size is untrusted, and is allocated up front.
+    PRUint32 bodyLen = len - kCompressedHeaderSize;
+    if (size > kMaxUncompressedSize || size > LZDecompressBound(bodyLen)) {
+        gCompressionStats.corrupt++;
+        return NS_ERROR_SCRIPT_CACHE_STALE;
+    }
+
+    nsAutoArrayPtr<char> out(new (std::nothrow) char[size]);
+    if (!out)
+        return NS_ERROR_SCRIPT_CACHE_STALE;
+
+    PRTime start = PR_Now();
+    bool ok = LZDecompress(buf + kCompressedHeaderSize, bodyLen, out, size);
+    gCompressionStats.decompressTime += PR_Now() - start;
+
+    if (!ok) {
+        gCompressionStats.corrupt++;
+        return NS_ERROR_FAILURE;
+    }
+
+    gCompressionStats.decompressed++;
+    *raw = out.forget();
+    *rawLen = size;
+    return NS_OK;
+}
+
+/*
+ * Replaces the entry in *buf* with a compressed one, if it's worth it.
+ */
+static void
+DeflateEntry(char **buf, PRUint32 *len)
+{
+    if (!gCompressionEnabled || *len < kMinCompressedSize) {
+        gCompressionStats.uncompressed++;
+        return;
+    }
+
+    PRUint32 limit = *len - *len / 8;
+    nsAutoArrayPtr<char> out(new char[limit]);
+    size_t size = LZCompress(*buf, *len, out + kCompressedHeaderSize,
+                             limit - kCompressedHeaderSize);
+    if (!size) {
+        gCompressionStats.uncompressed++;
+        return;
+    }
+
+    WriteBE32(out, kCompressedMagic);
+    WriteBE32(out + 4, CODEC_LZ);
+    WriteBE32(out + 8, *len);
+
+    gCompressionStats.compressed++;
+    gCompressionStats.savedSize += *len - (kCompressedHeaderSize + size);
+
+    delete[] *buf;
+    *buf = out.forget();
+    *len = kCompressedHeaderSize + size;
+}
+
+/*
+ * The state of an in-place decode whose XDR data is interleaved with
+ * XPCOM objects. The objects are read through a stream which depends on,
+ * rather than copies, the buffer, and the runs of XDR data between them
+ * are lent to the XDR state where they lie.
+ */
+struct InPlaceDecoder {
+    const char                     *base;
+    nsCOMPtr<nsIObjectInputStream>  stream;
+    nsCOMPtr<nsISeekableStream>     seekable;
+};
+
+/*
+ * Stands in for the security manager's principals transcoder while we
+ * decode in place. It reads the stream written by nsTranscodeJSPrincipals
+ * when the entry was encoded.
+ */
+static JSBool
+TranscodePrincipalsInPlace(JSXDRState *xdr, JSPrincipals **jsprinp)
+{
+    NS_ASSERTION(xdr->mode == JSXDR_DECODE, "in-place XDR is decode-only");
+    InPlaceDecoder *decoder = static_cast<InPlaceDecoder*>(xdr->userdata);
+
+    nsCOMPtr<nsIPrincipal> prin;
+    nsresult rv = decoder->stream->ReadObject(PR_TRUE, getter_AddRefs(prin));
+
+    PRUint32 size;
+    if (NS_SUCCEEDED(rv))
+        rv = decoder->stream->Read32(&size);
+
+    PRInt64 offset;
+    if (NS_SUCCEEDED(rv))
+        rv = decoder->seekable->Tell(&offset);
+    if (NS_SUCCEEDED(rv))
+        rv = decoder->seekable->Seek(nsISeekableStream::NS_SEEK_CUR, size);
 
-    nsAutoArrayPtr<char> buf;
-    PRUint32 len;
-    rv = cache->GetBuffer(PromiseFlatCString(uri).get(), getter_Transfers(buf),
-                          &len);
     if (NS_FAILED(rv)) {
-        return rv; // don't warn since NOT_AVAILABLE is an ok error
+        JS_ReportError(xdr->cx, "can't decode principals");
+        return JS_FALSE;
+    }
+
+    // The last run is ours, not nsMemory's, so there's nothing to free.
+    JS_XDRMemSetData(xdr, size ? const_cast<char*>(decoder->base + offset)
+                               : nsnull,
+                     size);
+    prin->GetJSPrincipals(xdr->cx, jsprinp);
+    return JS_TRUE;
+}
+
+/*
+ * Checks the magic and stamp at the head of the uncompressed entry in
+ * *buf*.
+ */
+static nsresult
+CheckStamp(const char *buf, PRUint32 len, const ScriptStamp &stamp)
+{
+    static const PRUint32 kStampSize = 4 + 8 + 8 + 4;
+    if (len < kStampSize)
+        return NS_ERROR_FAILURE;
+
+    if (ReadBE32(buf) != kScriptCacheMagic)
+        return NS_ERROR_SCRIPT_CACHE_STALE;
+
+    ScriptStamp cached;
+    cached.mtime = ReadBE64(buf + 4);
+    cached.size = ReadBE64(buf + 12);
+    cached.crc = ReadBE32(buf + 20);
+    if (cached != stamp)
+        return NS_ERROR_SCRIPT_CACHE_STALE;
+
+    return NS_OK;
+}
+
+nsresult
+CheckCachedScript(const char *buf, PRUint32 len, const ScriptStamp &stamp)
+{
+    nsAutoArrayPtr<char> raw;
+    PRUint32 rawLen;
+    nsresult rv = InflateEntry(buf, len, getter_Transfers(raw), &rawLen);
+    NS_ENSURE_SUCCESS(rv, rv);
+    if (raw)
+        return CheckStamp(raw, rawLen, stamp);
+    return CheckStamp(buf, len, stamp);
+}
+
+nsresult
+DecodeCachedScriptInPlace(const char *buf, PRUint32 len,
+                          const ScriptStamp &stamp, JSContext *cx,
+                          JSScriptType **script)
+{
+    nsresult rv;
+
+    *script = nsnull;
+
+    nsAutoArrayPtr<char> raw;
+    PRUint32 rawLen;
+    rv = InflateEntry(buf, len, getter_Transfers(raw), &rawLen);
+    NS_ENSURE_SUCCESS(rv, rv);
+    if (raw) {
+        buf = raw;
+        len = rawLen;
+    }
+
+    // The magic, the stamp, and the length of the first run of XDR data,
+    // as written by the object output stream.
+    static const PRUint32 kHeaderSize = 4 + 8 + 8 + 4 + 4;
+    if (len < kHeaderSize)
+        return NS_ERROR_FAILURE;
+
+    rv = CheckStamp(buf, len, stamp);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    PRUint32 size = ReadBE32(buf + 24);
+    NS_ENSURE_TRUE(size <= len - kHeaderSize, NS_ERROR_FAILURE);
+
+    // Anything after the first run is an XPCOM object, followed by the
+    // next run, and so on.
+    InPlaceDecoder decoder;
+    JSSecurityCallbacks callbacks, *oldCallbacks = nsnull;
+    PRUint32 rest = len - kHeaderSize - size;
+    if (rest) {
+        JSSecurityCallbacks *current = JS_GetSecurityCallbacks(cx);
+        NS_ENSURE_TRUE(current && current->principalsTranscoder,
+                       NS_ERROR_NOT_AVAILABLE);
+
+        nsCOMPtr<nsIInputStream> in;
+        rv = NS_NewByteInputStream(getter_AddRefs(in),
+                                   buf + kHeaderSize + size, rest,
+                                   NS_ASSIGNMENT_DEPEND);
+        NS_ENSURE_SUCCESS(rv, NS_ERROR_NOT_AVAILABLE);
+
+        nsCOMPtr<nsIObjectInputStream> stream =
+            do_CreateInstance("@mozilla.org/binaryinputstream;1");
+        NS_ENSURE_TRUE(stream, NS_ERROR_NOT_AVAILABLE);
+        rv = stream->SetInputStream(in);
+        NS_ENSURE_SUCCESS(rv, NS_ERROR_NOT_AVAILABLE);
+
+        decoder.base = buf + kHeaderSize + size;
+        decoder.stream = stream;
+        decoder.seekable = do_QueryInterface(in);
+        NS_ENSURE_TRUE(decoder.seekable, NS_ERROR_NOT_AVAILABLE);
+
+        // Only for the length of the decode, which runs no script.
+        callbacks = *current;
+        callbacks.principalsTranscoder = TranscodePrincipalsInPlace;
+        oldCallbacks = JS_SetContextSecurityCallbacks(cx, &callbacks);
+    }
+
+    JSXDRState *xdr = JS_XDRNewMem(cx, JSXDR_DECODE);
+    if (!xdr) {
+        if (rest)
+            JS_SetContextSecurityCallbacks(cx, oldCallbacks);
+        return NS_ERROR_OUT_OF_MEMORY;
     }
 
+    // Decoding never writes to or reallocates the buffer, so it can be
+    // lent to the XDR state as long as we take it back before it's
+    // destroyed.
+    xdr->userdata = &decoder;
+    JS_XDRMemSetData(xdr, const_cast<char*>(buf + kHeaderSize), size);
+
+    rv = NS_OK;
+    if (!JS_XDRScript(xdr, script))
+        rv = NS_ERROR_FAILURE;
+
+    JS_XDRMemSetData(xdr, nsnull, 0);
+    JS_XDRDestroy(xdr);
+
+    if (rest)
+        JS_SetContextSecurityCallbacks(cx, oldCallbacks);
+    return rv;
+}
+
+nsresult
+DecodeCachedScriptStream(char *aBuf, PRUint32 len, const ScriptStamp &stamp,
+                         JSContext *cx, JSScriptType **script)
+{
+    nsresult rv;
+
+    nsAutoArrayPtr<char> buf(aBuf);
+
+    char *raw;
+    rv = InflateEntry(buf, len, &raw, &len);
+    NS_ENSURE_SUCCESS(rv, rv);
+    if (raw)
+        buf = raw;
+
     nsCOMPtr<nsIObjectInputStream> ois;
     rv = NewObjectInputStreamFromBuffer(buf, len, getter_AddRefs(ois));
     NS_ENSURE_SUCCESS(rv, rv);
     buf.forget();
 
+    ScriptStamp cached;
+    rv = ReadStamp(ois, &cached);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    if (cached != stamp)
+        return NS_ERROR_SCRIPT_CACHE_STALE;
+
     return ReadScriptFromStream(cx, ois, script);
 }
 
 nsresult
-WriteCachedScript(nsIStartupCache* cache, nsACString &uri, JSContext *cx, JSScriptType *script)
+DecodeCachedScript(char *aBuf, PRUint32 len, const ScriptStamp &stamp,
+                   JSContext *cx, JSScriptType **script)
+{
+    nsAutoArrayPtr<char> buf(aBuf);
+
+    nsresult rv = DecodeCachedScriptInPlace(buf, len, stamp, cx, script);
+    if (rv != NS_ERROR_NOT_AVAILABLE)
+        return rv;
+
+    return DecodeCachedScriptStream(buf.forget(), len, stamp, cx, script);
+}
+
+nsresult
+ReadCachedScript(nsIStartupCache* cache, nsACString &uri,
+                 const ScriptStamp &stamp, JSContext *cx,
+                 JSScriptType **script)
+{
+    nsresult rv;
+
+    char *buf;
+    PRUint32 len;
+    rv = ReadCachedBuffer(cache, uri, &buf, &len);
+    if (NS_FAILED(rv)) {
+        return rv; // don't warn since NOT_AVAILABLE is an ok error
+    }
+
+    return DecodeCachedScript(buf, len, stamp, cx, script);
+}
+
+nsresult
+EncodeCachedScript(const ScriptStamp &stamp, JSContext *cx,
+                   JSScriptType *script, char **buf, PRUint32 *len)
 {
     nsresult rv;
 
@@ -182,13 +738,29 @@ WriteCachedScript(nsIStartupCache* cache, nsACString &uri, JSContext *cx, JSScri
                                              true);
     NS_ENSURE_SUCCESS(rv, rv);
 
-    rv = WriteScriptToStream(cx, script, oos);
+    rv = WriteStamp(oos, stamp);
+    if (NS_SUCCEEDED(rv))
+        rv = WriteScriptToStream(cx, script, oos);
     oos->Close();
     NS_ENSURE_SUCCESS(rv, rv);
 
+    rv = NewBufferFromStorageStream(storageStream, buf, len);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    DeflateEntry(buf, len);
+    return NS_OK;
+}
+
+nsresult
+WriteCachedScript(nsIStartupCache* cache, nsACString &uri,
+                  const ScriptStamp &stamp, JSContext *cx,
+                  JSScriptType *script)
+{
+    nsresult rv;
+
     nsAutoArrayPtr<char> buf;
     PRUint32 len;
-    rv = NewBufferFromStorageStream(storageStream, getter_Transfers(buf), &len);
+    rv = EncodeCachedScript(stamp, cx, script, getter_Transfers(buf), &len);
     NS_ENSURE_SUCCESS(rv, rv);
 
     rv = cache->PutBuffer(PromiseFlatCString(uri).get(), buf, len);
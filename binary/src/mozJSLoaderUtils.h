@@ -78,11 +78,129 @@ class StartupCache;
 }
 }
 
+/* Returned when a cache entry was compiled from a different source. */
+#define NS_ERROR_SCRIPT_CACHE_STALE \
+    NS_ERROR_GENERATE_FAILURE(NS_ERROR_MODULE_GENERAL, 0x4c01)
+
+/*
+ * Identifies the version of a script's source which a cache entry was
+ * compiled from: the modification time and size of file: sources, or the
+ * CRC32 and size of jar: entries. Stamps of sources we can't examine
+ * cheaply are left empty, and match any entry.
+ */
+struct ScriptStamp {
+    ScriptStamp() : mtime(0), size(0), crc(0) {}
+
+    bool operator==(const ScriptStamp &other) const {
+        return mtime == other.mtime && size == other.size &&
+               crc == other.crc;
+    }
+    bool operator!=(const ScriptStamp &other) const {
+        return !(*this == other);
+    }
+
+    PRInt64  mtime;
+    PRInt64  size;
+    PRUint32 crc;
+};
+
+/*
+ * How compression of cache entries has fared. Entries are compressed
+ * only when it saves enough to pay for decompressing them.
+ */
+struct ScriptCompressionStats {
+    PRUint32 compressed;    // entries written compressed
+    PRUint32 uncompressed;  // entries written as they were
+    PRInt64  savedSize;     // bytes saved by compression, in total
+    PRUint32 decompressed;  // entries read compressed
+    PRUint32 corrupt;       // compressed entries which failed to decompress
+    PRInt64  decompressTime; // total microseconds spent decompressing
+};
+
+const ScriptCompressionStats &
+CompressionStats();
+
+/* Whether newly encoded entries may be compressed. On by default. */
+bool
+CacheCompressionEnabled();
+
+void
+SetCacheCompressionEnabled(bool enabled);
+
+/*
+ * Resolves chrome: and resource: URIs down to the file: or jar: URI that
+ * they ultimately refer to.
+ */
+nsresult
+ResolveURI(nsIURI *uri, nsIURI **result);
+
+/* Continues the zip-style CRC32 *crc* over *data*. Start with 0. */
+PRUint32
+UpdateCRC32(PRUint32 crc, const char *data, PRUint32 len);
+
+nsresult
+GetScriptStamp(nsIURI *uri, ScriptStamp *stamp);
+
+/*
+ * Fetches the raw cache entry for *uri* without decoding it. The caller
+ * owns the returned buffer, and should pass it to DecodeCachedScript.
+ */
+nsresult
+ReadCachedBuffer(nsIStartupCache* cache, nsACString &uri, char **buf,
+                 PRUint32 *len);
+
+/*
+ * Decodes a buffer from ReadCachedBuffer, taking ownership of it. Fails
+ * with NS_ERROR_SCRIPT_CACHE_STALE if the entry doesn't match *stamp*.
+ */
+nsresult
+DecodeCachedScript(char *buf, PRUint32 len, const ScriptStamp &stamp,
+                   JSContext *cx, JSScriptType **scriptObj);
+
+/*
+ * Checks the stamp of the cache entry in *buf* against *stamp*, without
+ * decoding its script, though a compressed entry is decompressed. Fails
+ * with NS_ERROR_SCRIPT_CACHE_STALE if it doesn't match.
+ */
+nsresult
+CheckCachedScript(const char *buf, PRUint32 len, const ScriptStamp &stamp);
+
+/*
+ * Decodes a cache entry straight out of *buf*, which needn't be writable
+ * or owned by us, e.g. a mapped file, without copying its XDR data. Fails
+ * with NS_ERROR_NOT_AVAILABLE if the entry has XPCOM objects interleaved
+ * in it which can't be read in place, in which case the caller should
+ * fall back to DecodeCachedScriptStream.
+ */
+nsresult
+DecodeCachedScriptInPlace(const char *buf, PRUint32 len,
+                          const ScriptStamp &stamp, JSContext *cx,
+                          JSScriptType **scriptObj);
+
+/*
+ * As DecodeCachedScript, but always through an object input stream, which
+ * copies the XDR data out of *buf*.
+ */
+nsresult
+DecodeCachedScriptStream(char *buf, PRUint32 len, const ScriptStamp &stamp,
+                         JSContext *cx, JSScriptType **scriptObj);
+
 nsresult
 ReadCachedScript(nsIStartupCache* cache, nsACString &uri,
-                 JSContext *cx, JSScriptType **scriptObj);
+                 const ScriptStamp &stamp, JSContext *cx,
+                 JSScriptType **scriptObj);
+
+/*
+ * Serializes *scriptObj* into a new[] allocated buffer in the format
+ * which DecodeCachedScript expects, compressed if that's enabled and
+ * worthwhile.
+ */
+nsresult
+EncodeCachedScript(const ScriptStamp &stamp, JSContext *cx,
+                   JSScriptType *scriptObj, char **buf, PRUint32 *len);
 
 nsresult
 WriteCachedScript(nsIStartupCache* cache, nsACString &uri,
-                  JSContext *cx, JSScriptType *scriptObj);
+                  const ScriptStamp &stamp, JSContext *cx,
+                  JSScriptType *scriptObj);
 #endif /* mozJSLoaderUtils_h */
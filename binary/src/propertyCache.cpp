@@ -0,0 +1,146 @@
+#include "propertyCache.h"
+
+// About as many prototypes as the DOM's deepest chains, times a few.
+#define MAX_ENTRIES 64
+
+PropertyCache::PropertyCache()
+    : mRuntime(nsnull), mCount(0), mHits(0), mMisses(0)
+{
+    PR_INIT_CLIST(&mList);
+}
+
+PropertyCache::~PropertyCache()
+{
+    NS_ASSERTION(PR_CLIST_IS_EMPTY(&mList),
+                 "Property cache destroyed while still rooting objects");
+}
+
+void
+PropertyCache::Init(JSRuntime *runtime)
+{
+    mRuntime = runtime;
+}
+
+void
+PropertyCache::Clear()
+{
+    while (!PR_CLIST_IS_EMPTY(&mList))
+        Remove(static_cast<Entry*>(PR_LIST_HEAD(&mList)));
+}
+
+void
+PropertyCache::RemoveWindow(PRUint64 windowID)
+{
+    PRCList *link = PR_LIST_HEAD(&mList);
+    while (link != &mList) {
+        Entry *entry = static_cast<Entry*>(link);
+        link = PR_NEXT_LINK(link);
+        if (entry->windowID == windowID)
+            Remove(entry);
+    }
+}
+
+void
+PropertyCache::Remove(Entry *entry)
+{
+    PR_REMOVE_LINK(entry);
+    JS_RemoveObjectRootRT(mRuntime, &entry->object);
+    mCount--;
+    delete entry;
+}
+
+bool
+PropertyCache::IsCacheable(JSContext *cx, JSObject *obj)
+{
+    // The engine's own classes, Function.prototype's among them, resolve
+    // lazily too, but have no private data, and are cached prototypes of
+    // some standard class.
+    JSClass *clasp = JS_GET_CLASS(cx, obj);
+    return clasp && clasp->resolve != JS_ResolveStub &&
+           (clasp->flags & JSCLASS_HAS_PRIVATE) &&
+           !JSCLASS_CACHED_PROTO_KEY(clasp) &&
+           !JS_ObjectIsFunction(cx, obj);
+}
+
+/*
+ * Finds the name of the last enumerable property added to *obj*, which
+ * the property iterator, walking back from the most recent, returns
+ * first, without resolving or enumerating anything. It's empty if there
+ * are none.
+ */
+bool
+PropertyCache::GetLastProperty(JSContext *cx, JSObject *obj, nsString &last)
+{
+    last.Truncate();
+
+    JSObject *iter = JS_NewPropertyIterator(cx, obj);
+    jsid id;
+    if (!iter || !JS_NextProperty(cx, iter, &id))
+        return false;
+    if (JSID_IS_VOID(id))
+        return true;
+
+    jsval v;
+    JSString *str;
+    size_t length;
+    const jschar *chars;
+    if (!JS_IdToValue(cx, id, &v) || !(str = JS_ValueToString(cx, v)) ||
+        !(chars = JS_GetStringCharsAndLength(cx, str, &length)))
+        return false;
+    last.Assign(reinterpret_cast<const PRUnichar*>(chars), length);
+    return true;
+}
+
+const PropertyList*
+PropertyCache::Get(JSContext *cx, JSObject *obj)
+{
+    for (PRCList *link = PR_LIST_TAIL(&mList); link != &mList;
+         link = PR_PREV_LINK(link)) {
+        Entry *entry = static_cast<Entry*>(link);
+        if (entry->object == obj) {
+            nsString last;
+            if (!GetLastProperty(cx, obj, last) || !last.Equals(entry->last)) {
+                JS_ClearPendingException(cx);
+                Remove(entry);
+                break;
+            }
+
+            PR_REMOVE_LINK(entry);
+            PR_APPEND_LINK(entry, &mList);
+            mHits++;
+            return &entry->list;
+        }
+    }
+    mMisses++;
+    return nsnull;
+}
+
+const PropertyList*
+PropertyCache::Put(JSContext *cx, JSObject *obj, PRUint64 windowID,
+                   PropertyList &list)
+{
+    Entry *entry = new Entry();
+    entry->object = obj;
+    entry->windowID = windowID;
+    if (!GetLastProperty(cx, obj, entry->last)) {
+        JS_ClearPendingException(cx);
+        delete entry;
+        return nsnull;
+    }
+    if (!JS_AddNamedObjectRoot(cx, &entry->object, "PropertyCache entry")) {
+        delete entry;
+        return nsnull;
+    }
+
+    entry->list.names.SwapElements(list.names);
+    entry->list.flags.SwapElements(list.flags);
+    PR_APPEND_LINK(entry, &mList);
+    mCount++;
+
+    while (mCount > MAX_ENTRIES)
+        Remove(static_cast<Entry*>(PR_LIST_HEAD(&mList)));
+
+    return &entry->list;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
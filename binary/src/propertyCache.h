@@ -0,0 +1,93 @@
+#pragma once
+
+#include "config.h"
+
+#include "nsStringAPI.h"
+#include "nsTArray.h"
+
+#include "jsapi.h"
+#include "prclist.h"
+
+/* The names of an object's own properties, and flags for each. */
+struct PropertyList {
+    nsTArray<nsString> names;
+    nsTArray<PRUint32> flags;
+};
+
+/*
+ * The property lists of the last few prototypes enumerated by
+ * enumerateProperties, so that completing a member of yet another DOM
+ * node, say, needn't enumerate the same half dozen prototypes again.
+ *
+ * Only prototypes of XPConnect's and the DOM's classes, which resolve
+ * their properties lazily, are cached. Those define what they have by
+ * their interfaces, while the engine's own objects are cheap to
+ * enumerate anyway. Scripts can still add properties to them, though, so
+ * each entry also records the name of the last enumerable property added
+ * to its prototype, which is the first the engine's property iterator
+ * returns, and is dropped if that's changed. Properties deleted from the
+ * middle of the list go unnoticed, and are completed regardless.
+ *
+ * Each entry keeps its prototype, and so its compartment, alive until
+ * it's evicted. Entries are tagged with the ID of the inner window whose
+ * prototype they hold, if any, so that the owner can drop them when the
+ * window goes away.
+ */
+class PropertyCache {
+public:
+    PropertyCache() NS_HIDDEN;
+    ~PropertyCache() NS_HIDDEN;
+
+    NS_HIDDEN_(void) Init(JSRuntime *runtime);
+
+    /* Drops every entry. Must be called before the runtime goes away. */
+    NS_HIDDEN_(void) Clear();
+
+    /* Drops the entries for the prototypes of the window *windowID*. */
+    NS_HIDDEN_(void) RemoveWindow(PRUint64 windowID);
+
+    /* Whether *obj*'s properties would be cached. */
+    static NS_HIDDEN_(bool) IsCacheable(JSContext *cx, JSObject *obj);
+
+    /*
+     * Returns the cached list for *obj*, or null if there's none or
+     * *obj* has changed since it was cached.
+     */
+    NS_HIDDEN_(const PropertyList*) Get(JSContext *cx, JSObject *obj);
+
+    /*
+     * Caches *list* for *obj*, a prototype belonging to the window
+     * *windowID*, or 0 if none, taking its contents. Returns the cached
+     * list, valid until the next call, or null, leaving *list* alone, if
+     * it couldn't be cached.
+     */
+    NS_HIDDEN_(const PropertyList*) Put(JSContext *cx, JSObject *obj,
+                                        PRUint64 windowID, PropertyList &list);
+
+    PRUint32 Hits() const { return mHits; }
+    PRUint32 Misses() const { return mMisses; }
+    PRUint32 Count() const { return mCount; }
+
+private:
+    struct Entry : public PRCList {
+        JSObject *object;
+        PRUint64 windowID;
+        nsString last;
+        PropertyList list;
+    };
+
+    static bool GetLastProperty(JSContext *cx, JSObject *obj, nsString &last);
+
+    void Remove(Entry *entry);
+
+    JSRuntime *mRuntime;
+
+    PRUint32   mCount;
+    PRUint32   mHits;
+    PRUint32   mMisses;
+
+    // Runs from least to most recently used.
+    PRCList    mList;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
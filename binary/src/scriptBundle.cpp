@@ -0,0 +1,194 @@
+#include "scriptBundle.h"
+
+#include "nsIFile.h"
+#include "nsILocalFile.h"
+
+#include "jsapi.h"
+#include "prio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUNDLE_MAGIC    0x64534231 // "dSB1"
+#define BUNDLE_VERSION  2
+
+void
+ScriptBundle::GetPlatform(nsACString &platform)
+{
+    char buf[sizeof(Header().platform)];
+    snprintf(buf, sizeof buf, "Gecko %d.%d; %s",
+             GECKO_MAJOR, GECKO_MINOR, JS_GetImplementationVersion());
+
+    platform.Assign(buf);
+}
+
+nsresult
+ScriptBundle::Open(nsIFile *file)
+{
+    nsresult rv;
+
+    Close();
+
+    nsRefPtr<MappedFile> map = new MappedFile();
+    rv = map->Init(file);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    const Header *header = reinterpret_cast<const Header*>(map->Data());
+    NS_ENSURE_TRUE(map->Length() >= sizeof *header &&
+                   header->magic == BUNDLE_MAGIC &&
+                   header->version == BUNDLE_VERSION,
+                   NS_ERROR_FILE_CORRUPTED);
+
+    nsCAutoString platform;
+    GetPlatform(platform);
+    if (strncmp(header->platform, platform.get(), sizeof header->platform))
+        return NS_ERROR_NOT_AVAILABLE;
+
+    PRUint64 indexEnd = sizeof *header + PRUint64(header->count) * sizeof(IndexEntry);
+    NS_ENSURE_TRUE(indexEnd <= map->Length(), NS_ERROR_FILE_CORRUPTED);
+
+    mIndex = reinterpret_cast<const IndexEntry*>(header + 1);
+    mCount = header->count;
+    mVersion = JSVersion(header->jsVersion);
+
+    for (PRUint32 i = 0; i < mCount; i++) {
+        const IndexEntry &entry = mIndex[i];
+        NS_ENSURE_TRUE(PRUint64(entry.urlOffset) + entry.urlLength <= map->Length() &&
+                       PRUint64(entry.dataOffset) + entry.dataLength <= map->Length(),
+                       NS_ERROR_FILE_CORRUPTED);
+    }
+
+    mFile = map;
+    return NS_OK;
+}
+
+void
+ScriptBundle::Close()
+{
+    mFile = nsnull;
+    mIndex = nsnull;
+    mCount = 0;
+    mVersion = JSVERSION_UNKNOWN;
+}
+
+bool
+ScriptBundle::Get(const nsACString &url, const char **data, PRUint32 *len,
+                  bool *ascii)
+{
+    if (!mFile)
+        return false;
+
+    const char *base = mFile->Data();
+    const char *key = url.BeginReading();
+    PRUint32 keyLength = url.Length();
+
+    PRUint32 lo = 0, hi = mCount;
+    while (lo < hi) {
+        PRUint32 mid = lo + (hi - lo) / 2;
+        const IndexEntry &entry = mIndex[mid];
+
+        int cmp = memcmp(base + entry.urlOffset, key,
+                         PR_MIN(entry.urlLength, keyLength));
+        if (!cmp)
+            cmp = entry.urlLength < keyLength ? -1 : entry.urlLength > keyLength;
+
+        if (cmp < 0)
+            lo = mid + 1;
+        else if (cmp > 0)
+            hi = mid;
+        else {
+            *data = base + entry.dataOffset;
+            *len = entry.dataLength;
+            *ascii = entry.flags & FLAG_ASCII;
+            mHits++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int
+CompareScripts(const void *a, const void *b)
+{
+    const nsCString &urlA = (*static_cast<const nsAutoPtr<ScriptBundle::Script>*>(a))->url;
+    const nsCString &urlB = (*static_cast<const nsAutoPtr<ScriptBundle::Script>*>(b))->url;
+
+    int cmp = memcmp(urlA.get(), urlB.get(), PR_MIN(urlA.Length(), urlB.Length()));
+    if (!cmp)
+        cmp = urlA.Length() < urlB.Length() ? -1 : urlA.Length() > urlB.Length();
+    return cmp;
+}
+
+static bool
+WriteFully(PRFileDesc *fd, const void *buf, PRInt32 len)
+{
+    return PR_Write(fd, buf, len) == len;
+}
+
+nsresult
+ScriptBundle::Write(nsIFile *file, JSVersion version,
+                    nsTArray<nsAutoPtr<Script> > &scripts)
+{
+    nsresult rv;
+
+    qsort(scripts.Elements(), scripts.Length(), sizeof scripts[0],
+          CompareScripts);
+
+    Header header;
+    memset(&header, 0, sizeof header);
+    header.magic = BUNDLE_MAGIC;
+    header.version = BUNDLE_VERSION;
+    header.count = scripts.Length();
+    header.jsVersion = version;
+
+    nsCAutoString platform;
+    GetPlatform(platform);
+    strncpy(header.platform, platform.get(), sizeof header.platform - 1);
+
+    nsTArray<IndexEntry> index;
+    PRUint32 offset = sizeof header + scripts.Length() * sizeof(IndexEntry);
+
+    for (PRUint32 i = 0; i < scripts.Length(); i++) {
+        IndexEntry *entry = index.AppendElement();
+        entry->urlOffset = offset;
+        entry->urlLength = scripts[i]->url.Length();
+        entry->flags = scripts[i]->ascii ? FLAG_ASCII : 0;
+        offset += entry->urlLength;
+    }
+
+    // Keep the entries aligned, so that they can be decoded in place.
+    static const char padding[8] = { 0 };
+    PRUint32 pad = -offset & 7;
+    offset += pad;
+
+    for (PRUint32 i = 0; i < scripts.Length(); i++) {
+        index[i].dataOffset = offset;
+        index[i].dataLength = scripts[i]->length;
+        offset += (scripts[i]->length + 7) & ~7;
+    }
+
+    nsCOMPtr<nsILocalFile> localFile = do_QueryInterface(file, &rv);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    PRFileDesc *fd;
+    rv = localFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE,
+                                     0644, &fd);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    bool ok = WriteFully(fd, &header, sizeof header) &&
+              WriteFully(fd, index.Elements(), index.Length() * sizeof(IndexEntry));
+
+    for (PRUint32 i = 0; ok && i < scripts.Length(); i++)
+        ok = WriteFully(fd, scripts[i]->url.get(), scripts[i]->url.Length());
+    ok = ok && WriteFully(fd, padding, pad);
+
+    for (PRUint32 i = 0; ok && i < scripts.Length(); i++)
+        ok = WriteFully(fd, scripts[i]->data, scripts[i]->length) &&
+             WriteFully(fd, padding, -scripts[i]->length & 7);
+
+    PR_Close(fd);
+    return ok ? NS_OK : NS_ERROR_FAILURE;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
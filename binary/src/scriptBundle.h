@@ -0,0 +1,100 @@
+#pragma once
+
+#include "config.h"
+#include "mappedSource.h"
+
+#include "nsAutoPtr.h"
+#include "nsStringAPI.h"
+#include "nsTArray.h"
+
+#include "jsapi.h"
+
+class nsIFile;
+
+/*
+ * A bundle of bytecode for the scripts we ship, compiled when the
+ * component is built rather than by every install at its first run. The
+ * whole bundle is mapped at once, and its entries are in the same format
+ * as the startup cache's, so they're decoded the same way and checked
+ * against the same stamps. Entries are stamped with the size and CRC32 of
+ * their sources, which is exactly what the stamps of entries in a jar
+ * hold, so they're only of use when running from a packed XPI.
+ *
+ * The file starts with a header naming the platform and engine which
+ * wrote it and the JavaScript version its scripts were compiled for,
+ * followed by an index of entries sorted by URL, then the URLs
+ * themselves, then the entries. A bundle written by any other platform
+ * is ignored.
+ */
+class ScriptBundle {
+public:
+    /* A script to be written to a bundle. */
+    struct Script {
+        nsCString            url;
+        nsAutoArrayPtr<char> data;
+        PRUint32             length;
+        bool                 ascii;
+    };
+
+    ScriptBundle()
+        : mIndex(nsnull), mCount(0), mHits(0), mVersion(JSVERSION_UNKNOWN) {}
+
+    NS_HIDDEN_(nsresult) Open(nsIFile *file);
+    NS_HIDDEN_(void) Close();
+
+    bool IsOpen() const { return mFile != nsnull; }
+
+    /*
+     * The mapping which Get's pointers point into. Holding a reference
+     * to it keeps them valid after the bundle is closed.
+     */
+    MappedFile *File() const { return mFile; }
+
+    /*
+     * Finds the entry for *url*, which points into the mapping. *ascii*
+     * is set if the script's source was pure ASCII; otherwise it was
+     * compiled as UTF-8.
+     */
+    NS_HIDDEN_(bool) Get(const nsACString &url, const char **data,
+                         PRUint32 *len, bool *ascii);
+
+    PRUint32 Hits() const { return mHits; }
+
+    /* The JavaScript version which every entry was compiled for. */
+    JSVersion Version() const { return mVersion; }
+
+    static NS_HIDDEN_(nsresult) Write(nsIFile *file, JSVersion version,
+                                      nsTArray<nsAutoPtr<Script> > &scripts);
+
+    /* The platform and engine which the bundle must have been built by. */
+    static NS_HIDDEN_(void) GetPlatform(nsACString &platform);
+
+private:
+    struct Header {
+        PRUint32 magic;
+        PRUint32 version;
+        char     platform[96];
+        PRUint32 count;
+        PRInt32  jsVersion;
+    };
+
+    struct IndexEntry {
+        PRUint32 urlOffset;
+        PRUint32 urlLength;
+        PRUint32 dataOffset;
+        PRUint32 dataLength;
+        PRUint32 flags;
+    };
+
+    enum {
+        FLAG_ASCII = 1
+    };
+
+    nsRefPtr<MappedFile> mFile;
+    const IndexEntry    *mIndex;
+    PRUint32             mCount;
+    PRUint32             mHits;
+    JSVersion            mVersion;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
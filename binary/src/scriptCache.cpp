@@ -0,0 +1,153 @@
+#include "scriptCache.h"
+
+#include "jsfriendapi.h"
+#include "prprf.h"
+
+#if GECKO_MAJOR < 9
+#   define JS_AddNamedScriptRoot JS_AddNamedObjectRoot
+#   define JS_RemoveScriptRootRT JS_RemoveObjectRootRT
+#endif
+
+// Enough for every shipped module and content script, several times over.
+#define DEFAULT_LIMIT (16 << 20)
+
+CompiledScriptCache::CompiledScriptCache()
+    : mRuntime(nsnull), mLimit(DEFAULT_LIMIT), mSize(0),
+      mHits(0), mMisses(0), mEvictions(0)
+{
+    PR_INIT_CLIST(&mList);
+}
+
+CompiledScriptCache::~CompiledScriptCache()
+{
+    NS_ASSERTION(PR_CLIST_IS_EMPTY(&mList),
+                 "Compiled script cache destroyed while still rooting scripts");
+}
+
+nsresult
+CompiledScriptCache::Init(JSRuntime *runtime)
+{
+    mRuntime = runtime;
+    NS_ENSURE_TRUE(mEntries.Init(64), NS_ERROR_OUT_OF_MEMORY);
+    return NS_OK;
+}
+
+void
+CompiledScriptCache::Clear()
+{
+    while (!PR_CLIST_IS_EMPTY(&mList))
+        Remove(static_cast<Entry*>(PR_LIST_HEAD(&mList)));
+}
+
+void
+CompiledScriptCache::SetLimit(PRUint32 limit)
+{
+    mLimit = limit;
+    Evict();
+}
+
+void
+CompiledScriptCache::GetKey(JSContext *cx, const nsACString &path,
+                            nsACString &key)
+{
+    char compartment[32];
+    PR_snprintf(compartment, sizeof compartment, "%p/",
+                js::GetContextCompartment(cx));
+
+    key.Assign(compartment);
+    key.Append(path);
+}
+
+void
+CompiledScriptCache::Remove(Entry *entry)
+{
+    PR_REMOVE_LINK(entry);
+    JS_RemoveScriptRootRT(mRuntime, &entry->script);
+    mSize -= entry->cost;
+
+    // Frees the entry.
+    nsCString key(entry->key);
+    mEntries.Remove(key);
+}
+
+void
+CompiledScriptCache::Evict()
+{
+    while (mSize > mLimit && !PR_CLIST_IS_EMPTY(&mList)) {
+        Remove(static_cast<Entry*>(PR_LIST_HEAD(&mList)));
+        mEvictions++;
+    }
+}
+
+bool
+CompiledScriptCache::Has(JSContext *cx, const nsACString &path,
+                         const ScriptStamp &stamp)
+{
+    nsCAutoString key;
+    GetKey(cx, path, key);
+
+    Entry *entry;
+    return mEntries.Get(key, &entry) && entry->stamp == stamp;
+}
+
+JSScriptType*
+CompiledScriptCache::Get(JSContext *cx, const nsACString &path,
+                         const ScriptStamp &stamp)
+{
+    nsCAutoString key;
+    GetKey(cx, path, key);
+
+    Entry *entry;
+    if (!mEntries.Get(key, &entry)) {
+        mMisses++;
+        return nsnull;
+    }
+
+    if (entry->stamp != stamp) {
+        Remove(entry);
+        mMisses++;
+        return nsnull;
+    }
+
+    PR_REMOVE_LINK(entry);
+    PR_APPEND_LINK(entry, &mList);
+
+    mHits++;
+    return entry->script;
+}
+
+void
+CompiledScriptCache::Put(JSContext *cx, const nsACString &path,
+                         const ScriptStamp &stamp, JSScriptType *script,
+                         PRUint32 cost)
+{
+    // Never worth evicting everything else for.
+    if (cost > mLimit / 2)
+        return;
+
+    nsCAutoString key;
+    GetKey(cx, path, key);
+
+    Entry *entry;
+    if (mEntries.Get(key, &entry))
+        Remove(entry);
+
+    entry = new Entry();
+    entry->key = key;
+    entry->stamp = stamp;
+    entry->script = script;
+    entry->cost = cost;
+
+    if (!JS_AddNamedScriptRoot(cx, &entry->script, "CompiledScriptCache entry")) {
+        delete entry;
+        return;
+    }
+
+    mEntries.Put(key, entry);
+    PR_APPEND_LINK(entry, &mList);
+    mSize += cost;
+
+    Evict();
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
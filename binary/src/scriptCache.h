@@ -0,0 +1,84 @@
+#pragma once
+
+#include "config.h"
+#include "mozJSLoaderUtils.h"
+
+#include "nsClassHashtable.h"
+#include "nsHashKeys.h"
+#include "nsStringAPI.h"
+
+#include "jsapi.h"
+#include "prclist.h"
+
+/*
+ * A process-wide, least-recently-used cache of compiled subscripts, so
+ * that loading a script which some other window has already loaded needs
+ * neither the startup cache nor an XDR decode. Scripts can only be run in
+ * the compartment they were compiled for, so entries are keyed by
+ * compartment as well as by startup cache path. Each entry's stamp is
+ * checked on lookup, as for the startup cache.
+ *
+ * Entries keep their scripts, and so their compartments, alive until
+ * they're evicted, which happens when the sum of their costs (their
+ * source or XDR sizes) exceeds the limit.
+ */
+class CompiledScriptCache {
+public:
+    CompiledScriptCache() NS_HIDDEN;
+    ~CompiledScriptCache() NS_HIDDEN;
+
+    NS_HIDDEN_(nsresult) Init(JSRuntime *runtime);
+
+    /* Drops every entry. Must be called before the runtime goes away. */
+    NS_HIDDEN_(void) Clear();
+
+    NS_HIDDEN_(void) SetLimit(PRUint32 limit);
+    PRUint32 Limit() const { return mLimit; }
+
+    /* Whether Get would succeed, without counting a hit or a miss. */
+    NS_HIDDEN_(bool) Has(JSContext *cx, const nsACString &path,
+                         const ScriptStamp &stamp);
+
+    /*
+     * Returns the script for *path* in *cx*'s current compartment, or
+     * null.
+     */
+    NS_HIDDEN_(JSScriptType*) Get(JSContext *cx, const nsACString &path,
+                                  const ScriptStamp &stamp);
+
+    NS_HIDDEN_(void) Put(JSContext *cx, const nsACString &path,
+                         const ScriptStamp &stamp, JSScriptType *script,
+                         PRUint32 cost);
+
+    PRUint32 Hits() const { return mHits; }
+    PRUint32 Misses() const { return mMisses; }
+    PRUint32 Evictions() const { return mEvictions; }
+    PRUint32 Size() const { return mSize; }
+    PRUint32 Count() const { return mEntries.Count(); }
+
+private:
+    struct Entry : public PRCList {
+        nsCString     key;
+        ScriptStamp   stamp;
+        JSScriptType *script;
+        PRUint32      cost;
+    };
+
+    void GetKey(JSContext *cx, const nsACString &path, nsACString &key);
+    void Remove(Entry *entry);
+    void Evict();
+
+    JSRuntime *mRuntime;
+    PRUint32   mLimit;
+    PRUint32   mSize;
+
+    PRUint32   mHits;
+    PRUint32   mMisses;
+    PRUint32   mEvictions;
+
+    // Owns the entries. The list runs from least to most recently used.
+    nsClassHashtable<nsCStringHashKey, Entry> mEntries;
+    PRCList mList;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
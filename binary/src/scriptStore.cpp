@@ -0,0 +1,479 @@
+#include "scriptStore.h"
+#include "mozJSLoaderUtils.h"
+
+#include "nsIFile.h"
+#include "nsILocalFile.h"
+#include "nsAutoPtr.h"
+#include "nsTArray.h"
+
+#include "prtime.h"
+
+#include <string.h>
+
+#define STORE_VERSION   1
+#define INDEX_MAGIC     0x64534931 // "dSI1"
+#define DATA_MAGIC      0x64534431 // "dSD1"
+#define RECORD_MAGIC    0x64535231 // "dSR1"
+
+#define DATA_FILE       "scripts.dat"
+#define INDEX_FILE      "scripts.idx"
+#define TEMP_SUFFIX     ".tmp"
+
+// Compact once at least this much of the data file is dead, and it's more
+// than what's alive.
+#define COMPACT_THRESHOLD (256 << 10)
+
+static PRUint32
+HashKey(const nsACString &key)
+{
+    // FNV-1a
+    PRUint32 hash = 2166136261U;
+    const char *p, *end;
+    for (p = key.BeginReading(), end = key.EndReading(); p < end; p++)
+        hash = (hash ^ PRUint8(*p)) * 16777619U;
+    return hash;
+}
+
+static bool
+ReadFully(PRFileDesc *fd, void *buf, PRInt32 len)
+{
+    return PR_Read(fd, buf, len) == len;
+}
+
+static bool
+WriteFully(PRFileDesc *fd, const void *buf, PRInt32 len)
+{
+    return PR_Write(fd, buf, len) == len;
+}
+
+static nsresult
+OpenFile(nsIFile *dir, const char *name, PRIntn flags, PRFileDesc **fd)
+{
+    nsresult rv;
+
+    nsCOMPtr<nsIFile> file;
+    rv = dir->Clone(getter_AddRefs(file));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    rv = file->AppendNative(nsDependentCString(name));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    nsCOMPtr<nsILocalFile> localFile = do_QueryInterface(file, &rv);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    return localFile->OpenNSPRFileDesc(flags, 0600, fd);
+}
+
+static nsresult
+RenameFile(nsIFile *dir, const char *from, const char *to)
+{
+    nsresult rv;
+
+    nsCOMPtr<nsIFile> file;
+    rv = dir->Clone(getter_AddRefs(file));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    rv = file->AppendNative(nsDependentCString(from));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    return file->MoveToNative(nsnull, nsDependentCString(to));
+}
+
+ScriptStore::ScriptStore()
+    : mGeneration(0), mDataFD(nsnull), mIndexFD(nsnull), mDataSize(0),
+      mLiveSize(0), mHits(0), mMisses(0), mCorrupt(0), mCompactions(0)
+{
+}
+
+ScriptStore::~ScriptStore()
+{
+    Close();
+}
+
+void
+ScriptStore::Close()
+{
+    if (mDataFD)
+        PR_Close(mDataFD);
+    if (mIndexFD)
+        PR_Close(mIndexFD);
+    mDataFD = mIndexFD = nsnull;
+
+    if (mEntries.IsInitialized())
+        mEntries.Clear();
+}
+
+nsresult
+ScriptStore::Open(nsIFile *dir, const nsACString &buildID)
+{
+    nsresult rv;
+
+    Close();
+
+    rv = dir->Clone(getter_AddRefs(mDir));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    bool exists;
+    rv = mDir->Exists(&exists);
+    NS_ENSURE_SUCCESS(rv, rv);
+    if (!exists) {
+        rv = mDir->Create(nsIFile::DIRECTORY_TYPE, 0700);
+        NS_ENSURE_SUCCESS(rv, rv);
+    }
+
+    mBuildID.Assign(Substring(buildID, 0, sizeof(IndexHeader().buildID) - 1));
+
+    if (!mEntries.IsInitialized())
+        NS_ENSURE_TRUE(mEntries.Init(128), NS_ERROR_OUT_OF_MEMORY);
+
+    rv = OpenFiles(false);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    bool valid;
+    rv = LoadIndex(&valid);
+    if (NS_FAILED(rv) || !valid)
+        rv = Reset();
+    else if (mDataSize - mLiveSize > COMPACT_THRESHOLD &&
+             mDataSize - mLiveSize > mLiveSize)
+        rv = Compact();
+
+    if (NS_FAILED(rv))
+        Close();
+    return rv;
+}
+
+nsresult
+ScriptStore::OpenFiles(bool reset)
+{
+    nsresult rv;
+
+    if (mDataFD)
+        PR_Close(mDataFD);
+    if (mIndexFD)
+        PR_Close(mIndexFD);
+    mDataFD = mIndexFD = nsnull;
+
+    PRIntn flags = PR_RDWR | PR_CREATE_FILE | PR_APPEND;
+    if (reset)
+        flags |= PR_TRUNCATE;
+
+    rv = OpenFile(mDir, DATA_FILE, flags, &mDataFD);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    rv = OpenFile(mDir, INDEX_FILE, flags, &mIndexFD);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    mDataSize = PR_Seek64(mDataFD, 0, PR_SEEK_END);
+    NS_ENSURE_TRUE(mDataSize >= 0, NS_ERROR_FAILURE);
+    return NS_OK;
+}
+
+nsresult
+ScriptStore::Reset()
+{
+    nsresult rv;
+
+    rv = OpenFiles(true);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    mEntries.Clear();
+    mGeneration = PR_Now();
+    mLiveSize = 0;
+
+    DataHeader data = { DATA_MAGIC, STORE_VERSION, mGeneration };
+    NS_ENSURE_TRUE(WriteFully(mDataFD, &data, sizeof data), NS_ERROR_FAILURE);
+    mDataSize = sizeof data;
+
+    IndexHeader index;
+    memset(&index, 0, sizeof index);
+    index.magic = INDEX_MAGIC;
+    index.version = STORE_VERSION;
+    index.generation = mGeneration;
+    memcpy(index.buildID, mBuildID.get(), mBuildID.Length());
+    NS_ENSURE_TRUE(WriteFully(mIndexFD, &index, sizeof index), NS_ERROR_FAILURE);
+
+    return NS_OK;
+}
+
+nsresult
+ScriptStore::LoadIndex(bool *valid)
+{
+    nsresult rv;
+
+    *valid = false;
+    mEntries.Clear();
+    mLiveSize = 0;
+
+    DataHeader data;
+    if (PR_Seek64(mDataFD, 0, PR_SEEK_SET) != 0 ||
+        !ReadFully(mDataFD, &data, sizeof data) ||
+        data.magic != DATA_MAGIC || data.version != STORE_VERSION)
+        return NS_OK;
+
+    nsCOMPtr<nsIFile> indexFile;
+    rv = mDir->Clone(getter_AddRefs(indexFile));
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = indexFile->AppendNative(NS_LITERAL_CSTRING(INDEX_FILE));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    nsRefPtr<MappedFile> map = new MappedFile();
+    if (NS_FAILED(map->Init(indexFile)) || map->Length() < sizeof(IndexHeader))
+        return NS_OK;
+
+    const IndexHeader *header = reinterpret_cast<const IndexHeader*>(map->Data());
+    if (header->magic != INDEX_MAGIC || header->version != STORE_VERSION ||
+        header->generation != data.generation ||
+        strncmp(header->buildID, mBuildID.get(), sizeof header->buildID))
+        return NS_OK;
+
+    mGeneration = data.generation;
+
+    // A torn final entry is simply ignored.
+    PRUint32 count = (map->Length() - sizeof *header) / sizeof(IndexEntry);
+    const IndexEntry *entries = reinterpret_cast<const IndexEntry*>(header + 1);
+
+    for (PRUint32 i = 0; i < count; i++) {
+        const IndexEntry &entry = entries[i];
+
+        IndexEntry old;
+        if (mEntries.Get(entry.hash, &old)) {
+            mLiveSize -= old.length;
+            mEntries.Remove(entry.hash);
+        }
+
+        // Zero-length entries mark removals, and entries past the end
+        // of the data file were never completely written.
+        if (entry.length && entry.offset + entry.length <= PRUint64(mDataSize)) {
+            mEntries.Put(entry.hash, entry);
+            mLiveSize += entry.length;
+        }
+    }
+
+    *valid = true;
+    return NS_OK;
+}
+
+nsresult
+ScriptStore::ReadRecord(const IndexEntry &entry, nsACString &key,
+                        char **buf, PRUint32 *len)
+{
+    RecordHeader header;
+    if (PR_Seek64(mDataFD, entry.offset, PR_SEEK_SET) != PRInt64(entry.offset) ||
+        !ReadFully(mDataFD, &header, sizeof header) ||
+        header.magic != RECORD_MAGIC ||
+        PRUint64(sizeof header) + header.keyLength + header.dataLength != entry.length)
+        return NS_ERROR_FILE_CORRUPTED;
+
+    nsAutoArrayPtr<char> keyBuf(new char[header.keyLength]);
+    nsAutoArrayPtr<char> dataBuf(new char[header.dataLength]);
+    NS_ENSURE_TRUE(keyBuf && dataBuf, NS_ERROR_OUT_OF_MEMORY);
+
+    if (!ReadFully(mDataFD, keyBuf, header.keyLength) ||
+        !ReadFully(mDataFD, dataBuf, header.dataLength))
+        return NS_ERROR_FILE_CORRUPTED;
+
+    PRUint32 crc = UpdateCRC32(0, keyBuf, header.keyLength);
+    crc = UpdateCRC32(crc, dataBuf, header.dataLength);
+    if (crc != header.crc)
+        return NS_ERROR_FILE_CORRUPTED;
+
+    key.Assign(keyBuf, header.keyLength);
+    *buf = dataBuf.forget();
+    *len = header.dataLength;
+    return NS_OK;
+}
+
+nsresult
+ScriptStore::AppendRecord(PRFileDesc *dataFD, PRFileDesc *indexFD,
+                          PRInt64 *dataSize, PRUint32 hash,
+                          const nsACString &key, const char *buf,
+                          PRUint32 len, IndexEntry *entry)
+{
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.keyLength = key.Length();
+    header.dataLength = len;
+    header.crc = UpdateCRC32(UpdateCRC32(0, key.BeginReading(), key.Length()),
+                             buf, len);
+
+    entry->hash = hash;
+    entry->offset = *dataSize;
+    entry->length = sizeof header + key.Length() + len;
+
+    // The index entry goes last, so that it never points past the data.
+    if (!WriteFully(dataFD, &header, sizeof header) ||
+        !WriteFully(dataFD, key.BeginReading(), key.Length()) ||
+        !WriteFully(dataFD, buf, len))
+        return NS_ERROR_FAILURE;
+    *dataSize += entry->length;
+
+    if (!WriteFully(indexFD, entry, sizeof *entry))
+        return NS_ERROR_FAILURE;
+
+    return NS_OK;
+}
+
+nsresult
+ScriptStore::Get(const nsACString &key, char **buf, PRUint32 *len)
+{
+    if (!IsOpen())
+        return NS_ERROR_NOT_AVAILABLE;
+
+    PRUint32 hash = HashKey(key);
+
+    IndexEntry entry;
+    if (!mEntries.Get(hash, &entry)) {
+        mMisses++;
+        return NS_ERROR_NOT_AVAILABLE;
+    }
+
+    nsCAutoString storedKey;
+    nsresult rv = ReadRecord(entry, storedKey, buf, len);
+    if (NS_FAILED(rv)) {
+        mCorrupt++;
+        mMisses++;
+        Remove(key);
+        return NS_ERROR_NOT_AVAILABLE;
+    }
+
+    // A hash collision.
+    if (!storedKey.Equals(key)) {
+        delete[] *buf;
+        *buf = nsnull;
+        mMisses++;
+        return NS_ERROR_NOT_AVAILABLE;
+    }
+
+    mHits++;
+    return NS_OK;
+}
+
+nsresult
+ScriptStore::Put(const nsACString &key, const char *buf, PRUint32 len)
+{
+    if (!IsOpen())
+        return NS_ERROR_NOT_AVAILABLE;
+
+    PRUint32 hash = HashKey(key);
+
+    IndexEntry entry;
+    if (mEntries.Get(hash, &entry))
+        mLiveSize -= entry.length;
+
+    nsresult rv = AppendRecord(mDataFD, mIndexFD, &mDataSize, hash, key,
+                               buf, len, &entry);
+    if (NS_FAILED(rv)) {
+        // Whatever got written will fail its checks later.
+        mEntries.Remove(hash);
+        return rv;
+    }
+
+    mEntries.Put(hash, entry);
+    mLiveSize += entry.length;
+    return NS_OK;
+}
+
+void
+ScriptStore::Remove(const nsACString &key)
+{
+    if (!IsOpen())
+        return;
+
+    PRUint32 hash = HashKey(key);
+
+    IndexEntry entry;
+    if (mEntries.Get(hash, &entry)) {
+        mLiveSize -= entry.length;
+        mEntries.Remove(hash);
+
+        IndexEntry tombstone = { hash, 0, 0 };
+        WriteFully(mIndexFD, &tombstone, sizeof tombstone);
+    }
+}
+
+PLDHashOperator
+ScriptStore::CollectEntry(const PRUint32 &hash, IndexEntry entry, void *closure)
+{
+    static_cast<nsTArray<IndexEntry>*>(closure)->AppendElement(entry);
+    return PL_DHASH_NEXT;
+}
+
+nsresult
+ScriptStore::Compact()
+{
+    nsresult rv;
+
+    nsTArray<IndexEntry> live;
+    mEntries.EnumerateRead(CollectEntry, &live);
+
+    PRFileDesc *dataFD, *indexFD;
+    PRIntn flags = PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE;
+
+    rv = OpenFile(mDir, DATA_FILE TEMP_SUFFIX, flags, &dataFD);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    rv = OpenFile(mDir, INDEX_FILE TEMP_SUFFIX, flags, &indexFD);
+    if (NS_FAILED(rv)) {
+        PR_Close(dataFD);
+        return rv;
+    }
+
+    PRUint64 generation = PR_Now();
+
+    DataHeader data = { DATA_MAGIC, STORE_VERSION, generation };
+    IndexHeader index;
+    memset(&index, 0, sizeof index);
+    index.magic = INDEX_MAGIC;
+    index.version = STORE_VERSION;
+    index.generation = generation;
+    memcpy(index.buildID, mBuildID.get(), mBuildID.Length());
+
+    bool ok = WriteFully(dataFD, &data, sizeof data) &&
+              WriteFully(indexFD, &index, sizeof index);
+
+    PRInt64 dataSize = sizeof data;
+    for (PRUint32 i = 0; ok && i < live.Length(); i++) {
+        nsCAutoString key;
+        char *buf;
+        PRUint32 len;
+
+        // Corrupt records are dropped along with the dead ones.
+        if (NS_FAILED(ReadRecord(live[i], key, &buf, &len))) {
+            mCorrupt++;
+            continue;
+        }
+
+        IndexEntry entry;
+        ok = NS_SUCCEEDED(AppendRecord(dataFD, indexFD, &dataSize, live[i].hash,
+                                       key, buf, len, &entry));
+        delete[] buf;
+    }
+
+    ok = PR_Sync(dataFD) == PR_SUCCESS && PR_Sync(indexFD) == PR_SUCCESS && ok;
+    PR_Close(dataFD);
+    PR_Close(indexFD);
+    NS_ENSURE_TRUE(ok, NS_ERROR_FAILURE);
+
+    PR_Close(mDataFD);
+    PR_Close(mIndexFD);
+    mDataFD = mIndexFD = nsnull;
+
+    // If we die between these, the generations won't match, and the
+    // store will be discarded when next opened.
+    rv = RenameFile(mDir, DATA_FILE TEMP_SUFFIX, DATA_FILE);
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = RenameFile(mDir, INDEX_FILE TEMP_SUFFIX, INDEX_FILE);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    mCompactions++;
+
+    rv = OpenFiles(false);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    bool valid;
+    rv = LoadIndex(&valid);
+    NS_ENSURE_SUCCESS(rv, rv);
+    return valid ? NS_OK : Reset();
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
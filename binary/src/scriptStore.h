@@ -0,0 +1,121 @@
+#pragma once
+
+#include "config.h"
+#include "mappedSource.h"
+
+#include "nsCOMPtr.h"
+#include "nsDataHashtable.h"
+#include "nsHashKeys.h"
+#include "nsStringAPI.h"
+
+#include "prio.h"
+
+class nsIFile;
+
+/*
+ * A persistent store of cached script bytecode, kept in the profile and
+ * owned by us rather than by the browser's StartupCache, so that it
+ * survives browser updates, -purgecaches, and crashes.
+ *
+ * It's made up of two files. The data file is append-only, with each
+ * record holding a key, a buffer, and a CRC32 of both. The index file
+ * is a header followed by fixed-size entries pointing into the data
+ * file; it's mapped when the store is opened, and appended to as
+ * records are added. Later entries for a key supersede earlier ones.
+ *
+ * Both files carry the same generation number, and the index records
+ * the platform build, since bytecode is specific to the engine which
+ * wrote it. A mismatch of either discards the store. Records which fail
+ * their checks are treated as misses. When most of the data file is
+ * dead, it's compacted into new files, which are then renamed over the
+ * old ones, data file first.
+ */
+class ScriptStore {
+public:
+    ScriptStore() NS_HIDDEN;
+    ~ScriptStore() NS_HIDDEN;
+
+    /* Opens, validates and if need be compacts the store in *dir*. */
+    NS_HIDDEN_(nsresult) Open(nsIFile *dir, const nsACString &buildID);
+    NS_HIDDEN_(void) Close();
+
+    bool IsOpen() const { return mDataFD != nsnull; }
+
+    /*
+     * Returns a new[] allocated copy of the buffer stored for *key*, or
+     * fails with NS_ERROR_NOT_AVAILABLE.
+     */
+    NS_HIDDEN_(nsresult) Get(const nsACString &key, char **buf,
+                             PRUint32 *len);
+
+    NS_HIDDEN_(nsresult) Put(const nsACString &key, const char *buf,
+                             PRUint32 len);
+
+    NS_HIDDEN_(void) Remove(const nsACString &key);
+
+    PRUint32 Hits() const { return mHits; }
+    PRUint32 Misses() const { return mMisses; }
+    PRUint32 Corrupt() const { return mCorrupt; }
+    PRUint32 Compactions() const { return mCompactions; }
+    PRInt64 DataSize() const { return mDataSize; }
+
+private:
+    struct IndexHeader {
+        PRUint32 magic;
+        PRUint32 version;
+        PRUint64 generation;
+        char     buildID[64];
+    };
+
+    struct DataHeader {
+        PRUint32 magic;
+        PRUint32 version;
+        PRUint64 generation;
+    };
+
+    struct IndexEntry {
+        PRUint32 hash;
+        PRUint32 length;
+        PRUint64 offset;
+    };
+
+    struct RecordHeader {
+        PRUint32 magic;
+        PRUint32 keyLength;
+        PRUint32 dataLength;
+        PRUint32 crc;
+    };
+
+    nsresult OpenFiles(bool reset);
+    nsresult Reset();
+    nsresult LoadIndex(bool *valid);
+    nsresult Compact();
+    nsresult ReadRecord(const IndexEntry &entry, nsACString &key,
+                        char **buf, PRUint32 *len);
+    nsresult AppendRecord(PRFileDesc *dataFD, PRFileDesc *indexFD,
+                          PRInt64 *dataSize, PRUint32 hash,
+                          const nsACString &key, const char *buf,
+                          PRUint32 len, IndexEntry *entry);
+
+    static PLDHashOperator CollectEntry(const PRUint32 &hash,
+                                        IndexEntry entry, void *closure);
+
+    nsCOMPtr<nsIFile> mDir;
+    nsCString         mBuildID;
+    PRUint64          mGeneration;
+
+    PRFileDesc       *mDataFD;
+    PRFileDesc       *mIndexFD;
+    PRInt64           mDataSize;
+    PRInt64           mLiveSize;
+
+    // Maps key hashes to the latest index entry for them.
+    nsDataHashtable<nsUint32HashKey, IndexEntry> mEntries;
+
+    PRUint32 mHits;
+    PRUint32 mMisses;
+    PRUint32 mCorrupt;
+    PRUint32 mCompactions;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,135 @@
+#include "stringSearch.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define SEARCH_SSE2 1
+#  include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#  define CountTrailingZeros(n) __builtin_ctz(n)
+#elif defined(_MSC_VER)
+#  include <intrin.h>
+   static inline unsigned
+   CountTrailingZeros(unsigned long n) {
+       unsigned long index;
+       _BitScanForward(&index, n);
+       return index;
+   }
+#endif
+
+static inline bool
+MatchesAt(const uint16_t *haystack, const uint16_t *needle, size_t needleLength)
+{
+    return !memcmp(haystack, needle, needleLength * sizeof *needle);
+}
+
+static size_t
+FindSubstringScalar(const uint16_t *haystack, size_t length,
+                    const uint16_t *needle, size_t needleLength)
+{
+    if (needleLength > length)
+        return kNotFound;
+
+    uint16_t first = needle[0];
+    for (size_t i = 0; i + needleLength <= length; i++)
+        if (haystack[i] == first && MatchesAt(haystack + i, needle, needleLength))
+            return i;
+    return kNotFound;
+}
+
+#ifdef SEARCH_SSE2
+/*
+ * Compares the first and last units of the needle against eight
+ * positions at once, and only checks the rest at positions where both
+ * match.
+ */
+static size_t
+FindSubstringSSE2(const uint16_t *haystack, size_t length,
+                  const uint16_t *needle, size_t needleLength)
+{
+    if (needleLength > length)
+        return kNotFound;
+
+    const __m128i first = _mm_set1_epi16(short(needle[0]));
+    const __m128i last = _mm_set1_epi16(short(needle[needleLength - 1]));
+    size_t i = 0;
+
+    for (; i + 8 + needleLength - 1 <= length; i += 8) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack + i));
+        __m128i b = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(haystack + i + needleLength - 1));
+        unsigned mask = unsigned(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi16(a, first), _mm_cmpeq_epi16(b, last))));
+
+        // Two bits to each unit.
+        while (mask) {
+            unsigned bit = CountTrailingZeros(mask);
+            if (MatchesAt(haystack + i + bit / 2, needle, needleLength))
+                return i + bit / 2;
+            mask &= ~(3U << bit);
+        }
+    }
+
+    size_t rest = FindSubstringScalar(haystack + i, length - i,
+                                      needle, needleLength);
+    return rest == kNotFound ? kNotFound : i + rest;
+}
+#endif
+
+size_t
+FindSubstring(const uint16_t *haystack, size_t length,
+              const uint16_t *needle, size_t needleLength)
+{
+    if (!needleLength)
+        return 0;
+#ifdef SEARCH_SSE2
+    return FindSubstringSSE2(haystack, length, needle, needleLength);
+#else
+    return FindSubstringScalar(haystack, length, needle, needleLength);
+#endif
+}
+
+bool
+FoldASCII(const uint16_t *src, size_t length, uint16_t *dst)
+{
+    size_t i = 0;
+    bool ascii = true;
+
+#ifdef SEARCH_SSE2
+    // Adds 0x20 to each unit in 'A'..'Z', found with signed compares,
+    // which treat everything from 0x8000 up as negative.
+    const __m128i upperA = _mm_set1_epi16('A' - 1);
+    const __m128i upperZ = _mm_set1_epi16('Z' + 1);
+    const __m128i caseBit = _mm_set1_epi16(0x20);
+    const __m128i asciiMax = _mm_set1_epi16(0x7F);
+    __m128i nonASCII = _mm_setzero_si128();
+
+    for (; i + 8 <= length; i += 8) {
+        __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi16(units, upperA),
+                                      _mm_cmplt_epi16(units, upperZ));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_add_epi16(units, _mm_and_si128(upper, caseBit)));
+
+        // Anything over 0x7F, including what compares as negative.
+        nonASCII = _mm_or_si128(nonASCII,
+                                _mm_or_si128(_mm_cmpgt_epi16(units, asciiMax),
+                                             _mm_srai_epi16(units, 15)));
+    }
+    ascii = !_mm_movemask_epi8(nonASCII);
+#endif
+
+    for (; i < length; i++) {
+        uint16_t c = src[i];
+        if (c >= 'A' && c <= 'Z')
+            c += 0x20;
+        else if (c >= 0x80)
+            ascii = false;
+        dst[i] = c;
+    }
+    return ascii;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
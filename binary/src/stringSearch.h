@@ -0,0 +1,28 @@
+#pragma once
+
+/*
+ * Searches and case folding over UTF-16 text, for completion. Like
+ * utf8Decoder, these have no XPCOM dependencies.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+static const size_t kNotFound = size_t(-1);
+
+/*
+ * Returns the index of the first occurrence of *needle* in *haystack*, or
+ * kNotFound. An empty needle is found at 0.
+ */
+size_t
+FindSubstring(const uint16_t *haystack, size_t length,
+              const uint16_t *needle, size_t needleLength);
+
+/*
+ * Copies *src* to *dst*, lowercasing ASCII letters. Returns false if
+ * anything else in it was left alone which might still need folding.
+ */
+bool
+FoldASCII(const uint16_t *src, size_t length, uint16_t *dst);
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
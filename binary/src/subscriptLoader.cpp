@@ -46,7 +46,12 @@
  */
 
 #include "dactylUtils.h"
+#include "mappedSource.h"
 #include "mozJSLoaderUtils.h"
+#include "scriptBundle.h"
+#include "scriptCache.h"
+#include "scriptStore.h"
+#include "utf8Decoder.h"
 
 #include "nsIServiceManager.h"
 #include "nsIXPConnect.h"
@@ -59,10 +64,19 @@
 #include "nsIInputStream.h"
 #include "nsNetCID.h"
 #include "nsAutoPtr.h"
+#include "nsTArray.h"
 #include "nsNetUtil.h"
 #include "nsIProtocolHandler.h"
 #include "nsIScriptSecurityManager.h"
 #include "nsIFileURL.h"
+#include "nsILocalFile.h"
+#include "nsXPCOM.h"
+#include "nsIStreamLoader.h"
+#include "nsThreadUtils.h"
+#include "nsIIdleService.h"
+#include "nsIObserver.h"
+
+#include "prtime.h"
 
 // ConvertToUTF16
 #include "nsICharsetConverterManager.h"
@@ -140,6 +154,27 @@ ConvertToUTF16(nsIChannel* aChannel, const PRUint8* aData,
     characterSet.AssignLiteral("ISO-8859-1");
   }
 
+  // Nearly all of our sources are UTF-8 or Latin-1, which we decode
+  // ourselves, much faster than the generic decoders can.
+  if (characterSet.Equals("UTF-8", CaseInsensitiveCompare)) {
+    if (!EnsureStringLength(aString, aLength))
+      return NS_ERROR_OUT_OF_MEMORY;
+
+    aString.SetLength(
+        DecodeUTF8(reinterpret_cast<const char*>(aData), aLength,
+                   reinterpret_cast<uint16_t*>(aString.BeginWriting())));
+    return NS_OK;
+  }
+
+  if (characterSet.Equals("ISO-8859-1", CaseInsensitiveCompare)) {
+    if (!EnsureStringLength(aString, aLength))
+      return NS_ERROR_OUT_OF_MEMORY;
+
+    WidenLatin1(reinterpret_cast<const char*>(aData), aLength,
+                reinterpret_cast<uint16_t*>(aString.BeginWriting()));
+    return NS_OK;
+  }
+
   nsCOMPtr<nsICharsetConverterManager> charsetConv =
     do_GetService(NS_CHARSETCONVERTERMANAGER_CONTRACTID, &rv);
 
@@ -274,21 +309,291 @@ ReportError(JSContext *cx, const char *msg)
     return NS_OK;
 }
 
+/*
+ * Everything a load needs which doesn't depend on the particular script
+ * being loaded. Resolving it is most of the fixed cost of a load, so
+ * batched loads do it once and share it between all of their scripts.
+ */
+struct LoadEnvironment {
+    LoadEnvironment(JSContext *aCx)
+        : cx(aCx), targetObj(nsnull), resultObj(nsnull),
+          version(JSVERSION_DEFAULT), utils(nsnull), scripts(nsnull),
+          store(nsnull), bundle(nsnull)
+    {}
+
+    JSContext                   *cx;
+    JSObject                    *targetObj;
+    JSObject                    *resultObj;
+    JSVersion                    version;
+    nsCOMPtr<nsIPrincipal>       principal;
+    nsCOMPtr<nsIIOService>       serv;
+    nsCOMPtr<nsIStartupCache>    cache;
+    dactylUtils                 *utils;
+    CompiledScriptCache         *scripts;
+    ScriptStore                 *store;
+    ScriptBundle                *bundle;
+};
+
+/*
+ * A single script of a load, from its URL through to either its source
+ * text or its cached bytecode.
+ */
+struct SubScript {
+    SubScript()
+        : cacheBuffer(nsnull), cacheLength(0), bundleData(nsnull),
+          haveSource(false), haveDecoded(false)
+    {}
+    ~SubScript() {
+        delete[] cacheBuffer;
+    }
+
+    bool HaveCacheEntry() const { return cacheBuffer || bundleData; }
+
+    nsCOMPtr<nsIURI>    uri;
+    nsCString           uriStr;
+    nsCString           cachePath;
+    ScriptStamp         stamp;
+    char               *cacheBuffer;
+    PRUint32            cacheLength;
+    // Bundled entries are decoded straight from the bundle's mapping,
+    // which bundleFile keeps alive, rather than from cacheBuffer.
+    const char         *bundleData;
+    nsRefPtr<MappedFile> bundleFile;
+    nsCString           source;
+    nsAutoPtr<MappedSource> mapped;
+    bool                haveSource;
+
+    // Source already converted from the load's charset, off of the main
+    // thread, by asynchronous loads.
+    nsString            decoded;
+    bool                haveDecoded;
+
+    ScriptLoadStatistics stats;
+};
+
+/*
+ * How our startup cache entries have fared. Stale entries are those
+ * whose scripts have changed since they were compiled. In-place decodes
+ * are those which XDR read straight from the cached buffer or the
+ * bundle's mapping, without copying them into a stream first.
+ */
+static struct {
+    PRUint32 hits;
+    PRUint32 misses;
+    PRUint32 stale;
+    PRUint32 inPlace;
+} gCacheStats;
+
+static nsresult
+InitLoadEnvironment(LoadEnvironment &env, JSObject *target_obj,
+                    nsIPrincipal *systemPrincipal, dactylUtils *utils)
+{
+    JSContext *cx = env.cx;
+    nsresult rv;
+
+    // Remember an object out of the calling compartment so that we
+    // can properly wrap the result later.
+    env.principal = systemPrincipal;
+    env.resultObj = target_obj;
+    env.targetObj = JS_FindCompilationScope(cx, target_obj);
+    if (!env.targetObj)
+        return NS_ERROR_FAILURE;
+
+    if (env.targetObj != env.resultObj)
+    {
+        nsCOMPtr<nsIScriptSecurityManager> secman =
+            do_GetService(NS_SCRIPTSECURITYMANAGER_CONTRACTID);
+        if (!secman)
+            return NS_ERROR_FAILURE;
+
+        rv = secman->GetObjectPrincipal(cx, env.targetObj,
+                                        getter_AddRefs(env.principal));
+        NS_ENSURE_SUCCESS(rv, rv);
+    }
+
+    env.version = JS_GetVersion(cx);
+    env.serv = do_GetService(NS_IOSERVICE_CONTRACTID);
+    env.utils = utils;
+
+    // Suppress caching if we're compiling as content.
+    if (systemPrincipal) {
+        env.cache = do_GetService("@mozilla.org/startupcache/cache;1", &rv);
+        NS_ENSURE_SUCCESS(rv, rv);
+        // Compiled scripts keep their compartments alive, so only chrome's,
+        // which live as long as we do anyway, are kept in memory.
+        if (env.principal == systemPrincipal)
+            env.scripts = utils->ScriptCache();
+        if (utils->Store()->IsOpen())
+            env.store = utils->Store();
+        if (utils->Bundle()->IsOpen())
+            env.bundle = utils->Bundle();
+    }
+
+    return NS_OK;
+}
+
+/* Adds the cost of loading *s* to its URL's statistics. */
+static void
+RecordSubScript(LoadEnvironment &env, SubScript &s, bool ok)
+{
+    s.stats.loads = 1;
+    s.stats.failures = !ok;
+    env.utils->RecordLoad(s.uriStr, s.stats);
+}
+
+static bool
+HaveCallingScript(JSContext *cx)
+{
+    JSStackFrame* frame = nsnull;
+    JSScript* script = nsnull;
+
+    // Figure out who's calling us
+    do
+    {
+        frame = JS_FrameIterator(cx, &frame);
+
+        if (frame)
+            script = JS_GetFrameScript(cx, frame);
+    } while (frame && !script);
+
+    // No script means we don't know who's calling.
+    return script != nsnull;
+}
+
+static void
+GetCachePath(nsIURI *uri, const nsACString &uriStr, JSVersion version,
+             const jschar *charset, nsACString &cachePath)
+{
+    cachePath.Truncate();
+    cachePath.Append("jssubloader/");
+    cachePath.AppendInt(version);
+    if (charset) {
+        cachePath.Append("/");
+        cachePath.Append(NS_ConvertUTF16toUTF8(
+                    nsDependentString(reinterpret_cast<const PRUnichar*>(charset))));
+    }
+
+    if (false)
+        // This is evil. Very evil. Unfortunately, the PathifyURI symbol is
+        // exported, but with an argument type that we don't have access to.
+        PathifyURI(uri, *(nsACString_internal*)&cachePath);
+    else {
+        cachePath.Append("/");
+        cachePath.Append(uriStr);
+    }
+}
+
+/*
+ * Looks *s* up in the prebuilt bundle. Bundled scripts are stamped as
+ * scripts in a jar are, and were compiled as UTF-8 for the bundle's
+ * JavaScript version, so they're no use for anything else.
+ */
+static bool
+ReadBundledScript(LoadEnvironment &env, SubScript &s, const jschar *charset)
+{
+    const char *data;
+    PRUint32 len;
+    bool ascii;
+
+    if (!env.bundle || !s.stamp.crc || env.bundle->Version() != env.version ||
+        !env.bundle->Get(s.uriStr, &data, &len, &ascii))
+        return false;
+
+    if (!ascii) {
+        if (!charset)
+            return false;
+
+        nsCAutoString name;
+        LossyCopyUTF16toASCII(
+                nsDependentString(reinterpret_cast<const PRUnichar*>(charset)),
+                name);
+        if (!name.Equals("UTF-8", CaseInsensitiveCompare))
+            return false;
+    }
+
+    s.bundleData = data;
+    s.bundleFile = env.bundle->File();
+    s.cacheLength = len;
+    return true;
+}
+
+/*
+ * Resolves *url* and looks it up in the startup cache. Failures are
+ * reported as pending exceptions.
+ */
+static nsresult
+PrepareSubScript(LoadEnvironment &env, const char *url,
+                 const jschar *charset, SubScript &s)
+{
+    JSContext *cx = env.cx;
+    nsCAutoString scheme;
+    nsresult rv;
+
+    // Make sure to explicitly create the URI, since we'll need the
+    // canonicalized spec.
+    rv = NS_NewURI(getter_AddRefs(s.uri), url, nsnull, env.serv);
+    if (NS_FAILED(rv)) {
+        return ReportError(cx, LOAD_ERROR_NOURI);
+    }
+
+    rv = s.uri->GetSpec(s.uriStr);
+    if (NS_FAILED(rv)) {
+        return ReportError(cx, LOAD_ERROR_NOSPEC);
+    }
+
+    rv = s.uri->GetScheme(scheme);
+    if (NS_FAILED(rv)) {
+        return ReportError(cx, LOAD_ERROR_NOSCHEME);
+    }
+
+    GetCachePath(s.uri, s.uriStr, env.version, charset, s.cachePath);
+
+    // A miss here leaves us without a cache entry, as expected. A script
+    // whose stamp we can't get is cached unvalidated, as it always was.
+    // Scripts we already have compiled don't need the startup cache.
+    // The prebuilt bundle comes first. Our own store is next, and is
+    // filled from the startup cache when it misses, so that it's
+    // complete before the next purge.
+    if (env.cache) {
+        GetScriptStamp(s.uri, &s.stamp);
+        if (!env.scripts || !env.scripts->Has(cx, s.cachePath, s.stamp)) {
+            PRTime start = PR_Now();
+            if (!ReadBundledScript(env, s, charset) &&
+                (!env.store || NS_FAILED(env.store->Get(s.cachePath,
+                                                        &s.cacheBuffer,
+                                                        &s.cacheLength)))) {
+                rv = ReadCachedBuffer(env.cache, s.cachePath, &s.cacheBuffer,
+                                      &s.cacheLength);
+                if (NS_SUCCEEDED(rv) && env.store)
+                    env.store->Put(s.cachePath, s.cacheBuffer, s.cacheLength);
+            }
+            s.stats.readTime += PR_Now() - start;
+        }
+    }
+
+    return NS_OK;
+}
+
 static nsresult
-ReadScript(nsIURI *uri, JSContext *cx, JSObject *target_obj,
-           jschar *charset, const char *uriStr,
-           nsIIOService *serv, nsIPrincipal *principal,
-           JSScriptType **scriptObjp)
+ReadSource(LoadEnvironment &env, SubScript &s)
 {
     nsCOMPtr<nsIChannel>     chan;
     nsCOMPtr<nsIInputStream> instream;
-    JSPrincipals    *jsPrincipals;
-    JSErrorReporter  er;
+    JSContext *cx = env.cx;
+
+    // Local files and stored jar entries are mapped rather than read,
+    // which saves copying them through a channel and into a string.
+    nsAutoPtr<MappedSource> mapped(new MappedSource());
+    if (NS_SUCCEEDED(mapped->Init(s.uri))) {
+        s.mapped = mapped.forget();
+        s.haveSource = true;
+        return NS_OK;
+    }
 
     nsresult rv;
     // Instead of calling NS_OpenURI, we create the channel ourselves and call
     // SetContentType, to avoid expensive MIME type lookups (bug 632490).
-    rv = NS_NewChannel(getter_AddRefs(chan), uri, serv,
+    rv = NS_NewChannel(getter_AddRefs(chan), s.uri, env.serv,
                        nsnull, nsnull, nsIRequest::LOAD_NORMAL);
     if (NS_SUCCEEDED(rv)) {
         chan->SetContentType(NS_LITERAL_CSTRING("application/javascript"));
@@ -306,15 +611,54 @@ ReadScript(nsIURI *uri, JSContext *cx, JSObject *target_obj,
         return ReportError(cx, LOAD_ERROR_NOCONTENT);
     }
 
-    nsCString buf;
-    rv = NS_ReadInputStreamToString(instream, buf, len);
+    rv = NS_ReadInputStreamToString(instream, s.source, len);
     if (NS_FAILED(rv))
         return rv;
 
+    s.haveSource = true;
+    return NS_OK;
+}
+
+static nsresult
+ReadScriptSource(LoadEnvironment &env, SubScript &s)
+{
+    PRTime start = PR_Now();
+    nsresult rv = ReadSource(env, s);
+    s.stats.readTime += PR_Now() - start;
+
+    if (s.haveSource)
+        s.stats.sourceSize += s.mapped ? s.mapped->Length() : s.source.Length();
+    return rv;
+}
+
+/* Whether ASCII text in *charset* reads the same as plain ASCII. */
+static bool
+IsASCIICompatible(const jschar *charset)
+{
+    nsCAutoString name;
+    LossyCopyUTF16toASCII(
+            nsDependentString(reinterpret_cast<const PRUnichar*>(charset)),
+            name);
+
+    return name.Equals("UTF-8", CaseInsensitiveCompare) ||
+           name.Equals("US-ASCII", CaseInsensitiveCompare) ||
+           name.Equals("ISO-8859-1", CaseInsensitiveCompare) ||
+           name.Equals("windows-1252", CaseInsensitiveCompare);
+}
+
+static nsresult
+CompileScriptSource(LoadEnvironment &env, SubScript &s,
+                    const jschar *charset, JSScriptType **scriptObjp)
+{
+    JSContext       *cx = env.cx;
+    JSPrincipals    *jsPrincipals;
+    JSErrorReporter  er;
+    nsresult         rv;
+
     /* we can't hold onto jsPrincipals as a module var because the
      * JSPRINCIPALS_DROP macro takes a JSContext, which we won't have in the
      * destructor */
-    rv = principal->GetJSPrincipals(cx, &jsPrincipals);
+    rv = env.principal->GetJSPrincipals(cx, &jsPrincipals);
     if (NS_FAILED(rv) || !jsPrincipals) {
         return ReportError(cx, LOAD_ERROR_NOPRINCIPALS);
     }
@@ -323,28 +667,58 @@ ReadScript(nsIURI *uri, JSContext *cx, JSObject *target_obj,
      * exceptions, including the source/line number */
     er = JS_SetErrorReporter(cx, mozJSLoaderErrorReporter);
 
-    if (charset) {
+    // Scripts kept in memory are shared between the globals of a
+    // compartment, so mustn't be bound to the one they're first compiled
+    // for.
+    uint32 options = JS_GetOptions(cx);
+    if (env.scripts)
+        JS_SetOptions(cx, options & ~JSOPTION_COMPILE_N_GO);
+
+    const char *source = s.mapped ? s.mapped->Data() : s.source.get();
+    PRUint32 length = s.mapped ? s.mapped->Length() : s.source.Length();
+
+    // Pure ASCII needs no conversion, and can go straight to the compiler.
+    if (charset && !s.haveDecoded && IsASCIICompatible(charset) &&
+        ASCIIPrefixLength(source, length) == length)
+        charset = nsnull;
+
+    PRTime start = PR_Now();
+    if (s.haveDecoded) {
+        *scriptObjp =
+            JS_CompileUCScriptForPrincipals(cx, env.targetObj, jsPrincipals,
+                                            reinterpret_cast<const jschar*>(s.decoded.get()),
+                                            s.decoded.Length(), s.uriStr.get(), 1);
+    } else if (charset) {
         nsString script;
         rv = ConvertToUTF16(
-                nsnull, reinterpret_cast<const PRUint8*>(buf.get()), len,
-                nsDependentString(reinterpret_cast<PRUnichar*>(charset)), script);
+                nsnull, reinterpret_cast<const PRUint8*>(source), length,
+                nsDependentString(reinterpret_cast<const PRUnichar*>(charset)),
+                script);
+
+        PRTime decoded = PR_Now();
+        s.stats.decodeTime += decoded - start;
+        start = decoded;
 
         if (NS_FAILED(rv)) {
             JSPRINCIPALS_DROP(cx, jsPrincipals);
+            JS_SetOptions(cx, options);
+            JS_SetErrorReporter(cx, er);
             return ReportError(cx, LOAD_ERROR_BADCHARSET);
         }
 
         *scriptObjp =
-            JS_CompileUCScriptForPrincipals(cx, target_obj, jsPrincipals,
+            JS_CompileUCScriptForPrincipals(cx, env.targetObj, jsPrincipals,
                                             reinterpret_cast<const jschar*>(script.get()),
-                                            script.Length(), uriStr, 1);
+                                            script.Length(), s.uriStr.get(), 1);
     } else {
         *scriptObjp =
-            JS_CompileScriptForPrincipals(cx, target_obj, jsPrincipals, buf.get(),
-                                          len, uriStr, 1);
+            JS_CompileScriptForPrincipals(cx, env.targetObj, jsPrincipals,
+                                          source, length, s.uriStr.get(), 1);
     }
+    s.stats.compileTime += PR_Now() - start;
 
     JSPRINCIPALS_DROP(cx, jsPrincipals);
+    JS_SetOptions(cx, options);
 
     /* repent for our evil deeds */
     JS_SetErrorReporter(cx, er);
@@ -352,6 +726,170 @@ ReadScript(nsIURI *uri, JSContext *cx, JSObject *target_obj,
     return NS_OK;
 }
 
+/*
+ * Produces a script object for *s*, from its cached bytecode if we have
+ * any, and otherwise from source, reading it first if necessary.
+ * *writeScript* is set when the result should be written back to the
+ * cache once it has run successfully.
+ */
+static nsresult
+CompileSubScript(LoadEnvironment &env, SubScript &s, const jschar *charset,
+                 JSScriptType **scriptObjp, bool *writeScript)
+{
+    JSContext *cx = env.cx;
+    nsresult rv = NS_OK;
+
+    *scriptObjp = nsnull;
+    *writeScript = false;
+
+    if (env.scripts) {
+        *scriptObjp = env.scripts->Get(cx, s.cachePath, s.stamp);
+        if (*scriptObjp) {
+            s.stats.memoryHits++;
+            return NS_OK;
+        }
+    }
+
+    PRUint32 cost = s.cacheLength;
+    if (s.HaveCacheEntry()) {
+        nsAutoArrayPtr<char> buf(s.cacheBuffer);
+        s.cacheBuffer = nsnull;
+        s.stats.cacheSize += s.cacheLength;
+
+        // Only entries with principals or the like interleaved in them
+        // need to be copied into an object stream to be decoded.
+        PRTime start = PR_Now();
+        const char *data = s.bundleData ? s.bundleData : buf.get();
+        rv = DecodeCachedScriptInPlace(data, s.cacheLength, s.stamp, cx,
+                                       scriptObjp);
+        if (NS_SUCCEEDED(rv))
+            gCacheStats.inPlace++;
+        else if (rv == NS_ERROR_NOT_AVAILABLE) {
+            if (!buf) {
+                buf = new char[s.cacheLength];
+                memcpy(buf, data, s.cacheLength);
+            }
+            rv = DecodeCachedScriptStream(buf.forget(), s.cacheLength,
+                                          s.stamp, cx, scriptObjp);
+        }
+        s.stats.xdrTime += PR_Now() - start;
+
+        if (rv == NS_ERROR_SCRIPT_CACHE_STALE) {
+            gCacheStats.stale++;
+            s.stats.cacheStale++;
+        }
+        // A bundle which can't be decoded at all was built by some other
+        // engine, and is no use to anyone.
+        if (s.bundleData) {
+            if (NS_FAILED(rv) && rv != NS_ERROR_SCRIPT_CACHE_STALE)
+                env.bundle->Close();
+        }
+        else if (NS_FAILED(rv) && env.store)
+            env.store->Remove(s.cachePath);
+        rv = NS_OK;
+    }
+
+    if (*scriptObjp) {
+        gCacheStats.hits++;
+        s.stats.cacheHits++;
+    }
+    else {
+        if (env.cache) {
+            gCacheStats.misses++;
+            s.stats.cacheMisses++;
+        }
+
+        if (!s.haveSource) {
+            rv = ReadScriptSource(env, s);
+            if (NS_FAILED(rv) || !s.haveSource) {
+                RecordSubScript(env, s, false);
+                return rv;
+            }
+        }
+
+        rv = CompileScriptSource(env, s, charset, scriptObjp);
+        *writeScript = true;
+
+        if (!*scriptObjp)
+            RecordSubScript(env, s, false);
+
+        cost = s.mapped ? s.mapped->Length() : s.source.Length();
+    }
+
+    if (env.scripts && *scriptObjp)
+        env.scripts->Put(cx, s.cachePath, s.stamp, *scriptObjp, cost);
+
+    return rv;
+}
+
+/* Writes *scriptObj* to the startup cache, and to our store if it's open. */
+static nsresult
+WriteSubScript(LoadEnvironment &env, SubScript &s, JSScriptType *scriptObj)
+{
+    nsAutoArrayPtr<char> buf;
+    PRUint32 len;
+    nsresult rv = EncodeCachedScript(s.stamp, env.cx, scriptObj,
+                                     getter_Transfers(buf), &len);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    rv = env.cache->PutBuffer(s.cachePath.get(), buf, len);
+    if (env.store)
+        env.store->Put(s.cachePath, buf, len);
+    return rv;
+}
+
+static nsresult
+ExecuteSubScript(LoadEnvironment &env, SubScript &s, JSScriptType *scriptObj,
+                 bool writeScript, jsval *rval, JSBool *ok)
+{
+    JSContext *cx = env.cx;
+
+    PRTime start = PR_Now();
+    *ok = JS_ExecuteScriptVersion(cx, env.targetObj, scriptObj, rval,
+                                  env.version);
+    s.stats.executeTime += PR_Now() - start;
+    RecordSubScript(env, s, *ok);
+
+    if (*ok) {
+        JSAutoEnterCompartment rac;
+        if (!rac.enter(cx, env.resultObj) || !JS_WrapValue(cx, rval))
+            return NS_ERROR_UNEXPECTED;
+    }
+
+    if (env.cache && *ok && writeScript) {
+        WriteSubScript(env, s, scriptObj);
+    }
+
+    return NS_OK;
+}
+
+/*
+ * Loads and runs a single script, in the target's compartment, which the
+ * caller must already have entered. *ok* is set only if the script ran.
+ */
+static nsresult
+LoadOneSubScript(LoadEnvironment &env, const char *url, const jschar *charset,
+                 jsval *rval, JSBool *ok)
+{
+    JSContext *cx = env.cx;
+    nsresult rv;
+
+    *ok = JS_FALSE;
+
+    SubScript s;
+    rv = PrepareSubScript(env, url, charset, s);
+    if (NS_FAILED(rv) || JS_IsExceptionPending(cx))
+        return rv;
+
+    bool writeScript;
+    JSScriptType *scriptObj = nsnull;
+    rv = CompileSubScript(env, s, charset, &scriptObj, &writeScript);
+    if (NS_FAILED(rv) || !scriptObj)
+        return rv;
+
+    return ExecuteSubScript(env, s, scriptObj, writeScript, rval, ok);
+}
+
 NS_IMETHODIMP /* args and return value are delt with using XPConnect and JSAPI */
 dactylUtils::LoadSubScript (const PRUnichar * aURL
                             /* [, JSObject *target_obj] */)
@@ -454,130 +992,1288 @@ dactylUtils::LoadSubScript (const PRUnichar * aURL
         }
     }
 
-    // Remember an object out of the calling compartment so that we
-    // can properly wrap the result later.
-    nsCOMPtr<nsIPrincipal> principal = mSystemPrincipal;
-    JSObject *result_obj = target_obj;
-    target_obj = JS_FindCompilationScope(cx, target_obj);
-    if (!target_obj)
-        return NS_ERROR_FAILURE;
-
-    if (target_obj != result_obj)
-    {
-        nsCOMPtr<nsIScriptSecurityManager> secman =
-            do_GetService(NS_SCRIPTSECURITYMANAGER_CONTRACTID);
-        if (!secman)
-            return NS_ERROR_FAILURE;
-
-        rv = secman->GetObjectPrincipal(cx, target_obj, getter_AddRefs(principal));
-        NS_ENSURE_SUCCESS(rv, rv);
-    }
+    LoadEnvironment env(cx);
+    rv = InitLoadEnvironment(env, target_obj, mSystemPrincipal, this);
+    NS_ENSURE_SUCCESS(rv, rv);
 
     JSAutoEnterCompartment ac;
-    if (!ac.enter(cx, target_obj))
+    if (!ac.enter(cx, env.targetObj))
         return NS_ERROR_UNEXPECTED;
 
     /* load up the url.  From here on, failures are reflected as ``custom''
      * js exceptions */
-    nsCOMPtr<nsIURI> uri;
-    nsCAutoString uriStr;
-    nsCAutoString scheme;
+    if (!HaveCallingScript(cx))
+        return NS_ERROR_FAILURE;
 
-    JSStackFrame* frame = nsnull;
-    JSScript* script = nsnull;
+    if (!env.serv) {
+        return ReportError(cx, LOAD_ERROR_NOSERVICE);
+    }
 
-    // Figure out who's calling us
-    do
-    {
-        frame = JS_FrameIterator(cx, &frame);
+    rv = LoadOneSubScript(env, urlbytes.ptr(), charset, rval, &ok);
+    NS_ENSURE_SUCCESS(rv, rv);
 
-        if (frame)
-            script = JS_GetFrameScript(cx, frame);
-    } while (frame && !script);
+    cc->SetReturnValueWasSet (ok);
+    return NS_OK;
+}
 
-    if (!script)
-    {
-        // No script means we don't know who's calling, bail.
+/* Converts the JS array *aURLs* into a list of URL strings. */
+static nsresult
+GetURLList(JSContext *cx, const jsval &aURLs, nsTArray<nsCString> &urlStrs)
+{
+    NS_ENSURE_FALSE(JSVAL_IS_PRIMITIVE(aURLs), NS_ERROR_XPC_BAD_CONVERT_JS);
+    JSObject *urls = JSVAL_TO_OBJECT(aURLs);
+    NS_ENSURE_TRUE(JS_IsArrayObject(cx, urls), NS_ERROR_XPC_BAD_CONVERT_JS);
 
-        return NS_ERROR_FAILURE;
-    }
+    jsuint count;
+    NS_ENSURE_TRUE(JS_GetArrayLength(cx, urls, &count), NS_ERROR_FAILURE);
 
-    nsCOMPtr<nsIIOService> serv = do_GetService(NS_IOSERVICE_CONTRACTID);
-    if (!serv) {
-        return ReportError(cx, LOAD_ERROR_NOSERVICE);
-    }
+    for (jsuint i = 0; i < count; i++) {
+        jsval v;
+        NS_ENSURE_TRUE(JS_GetElement(cx, urls, i, &v), NS_ERROR_FAILURE);
 
-    // Make sure to explicitly create the URI, since we'll need the
-    // canonicalized spec.
-    rv = NS_NewURI(getter_AddRefs(uri), urlbytes.ptr(), nsnull, serv);
-    if (NS_FAILED(rv)) {
-        return ReportError(cx, LOAD_ERROR_NOURI);
-    }
+        JSString *str = JS_ValueToString(cx, v);
+        NS_ENSURE_TRUE(str, NS_ERROR_FAILURE);
 
-    rv = uri->GetSpec(uriStr);
-    if (NS_FAILED(rv)) {
-        return ReportError(cx, LOAD_ERROR_NOSPEC);
-    }
+        JSAutoByteString bytes(cx, str);
+        NS_ENSURE_TRUE(bytes, NS_ERROR_FAILURE);
 
-    rv = uri->GetScheme(scheme);
-    if (NS_FAILED(rv)) {
-        return ReportError(cx, LOAD_ERROR_NOSCHEME);
+        urlStrs.AppendElement(nsDependentCString(bytes.ptr()));
     }
+    return NS_OK;
+}
 
-    bool writeScript = false;
-    JSScriptType *scriptObj = nsnull;
-    JSVersion version = JS_GetVersion(cx);
-
-    nsCAutoString cachePath;
-    cachePath.Append("jssubloader/");
-    cachePath.AppendInt(version);
-    if (charset) {
-        cachePath.Append("/");
-        cachePath.Append(NS_ConvertUTF16toUTF8(
-                    nsDependentString(reinterpret_cast<PRUnichar*>(charset))));
+NS_IMETHODIMP
+dactylUtils::LoadSubScripts(const jsval &aURLs,
+                            const jsval &aTarget,
+                            const nsAString &aCharset,
+                            JSContext *cx,
+                            jsval *retval)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsTArray<nsCString> urlStrs;
+    rv = GetURLList(cx, aURLs, urlStrs);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    JSObject *target_obj;
+    if (JSVAL_IS_PRIMITIVE(aTarget)) {
+        target_obj = JS_GetGlobalForScopeChain(cx);
+        NS_ENSURE_TRUE(target_obj, NS_ERROR_FAILURE);
     }
+    else
+        target_obj = JSVAL_TO_OBJECT(aTarget);
 
-    if (false)
-        // This is evil. Very evil. Unfortunately, the PathifyURI symbol is
-        // exported, but with an argument type that we don't have access to.
-        PathifyURI(uri, *(nsACString_internal*)&cachePath);
-    else {
-        cachePath.Append("/");
-        cachePath.Append(uriStr);
+    nsString charsetStr(aCharset);
+    const jschar *charset = nsnull;
+    if (!charsetStr.IsEmpty())
+        charset = reinterpret_cast<const jschar*>(charsetStr.get());
+
+    // Created in the caller's compartment, and rooted by our return value.
+    JSObject *results = JS_NewArrayObject(cx, 0, nsnull);
+    NS_ENSURE_TRUE(results, NS_ERROR_OUT_OF_MEMORY);
+    *retval = OBJECT_TO_JSVAL(results);
+
+    LoadEnvironment env(cx);
+    rv = InitLoadEnvironment(env, target_obj, mSystemPrincipal, this);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    JSAutoEnterCompartment ac;
+    if (!ac.enter(cx, env.targetObj))
+        return NS_ERROR_UNEXPECTED;
+
+    if (!HaveCallingScript(cx))
+        return NS_ERROR_FAILURE;
+
+    if (!env.serv) {
+        return ReportError(cx, LOAD_ERROR_NOSERVICE);
     }
 
-    // Suppress caching if we're compiling as content.
-    nsCOMPtr<nsIStartupCache> cache;
-    if (mSystemPrincipal) {
-        cache = do_GetService("@mozilla.org/startupcache/cache;1", &rv);
+    // Resolve and read the whole batch before running any of it, so the
+    // I/O happens together rather than interleaved with execution.
+    nsTArray<nsAutoPtr<SubScript> > scripts;
+    for (PRUint32 i = 0; i < urlStrs.Length(); i++) {
+        SubScript *s = new SubScript();
+        scripts.AppendElement(s);
+
+        rv = PrepareSubScript(env, urlStrs[i].get(), charset, *s);
+        if (NS_FAILED(rv) || JS_IsExceptionPending(cx))
+            return rv;
+
+        if (!s->HaveCacheEntry()) {
+            rv = ReadScriptSource(env, *s);
+            if (NS_FAILED(rv) || JS_IsExceptionPending(cx)) {
+                RecordSubScript(env, *s, false);
+                return rv;
+            }
+        }
+    }
+
+    for (PRUint32 i = 0; i < scripts.Length(); i++) {
+        SubScript &s = *scripts[i];
+
+        bool writeScript;
+        JSScriptType *scriptObj = nsnull;
+        rv = CompileSubScript(env, s, charset, &scriptObj, &writeScript);
+        if (NS_FAILED(rv) || !scriptObj)
+            return rv;
+
+        JSBool ok;
+        jsval result;
+        rv = ExecuteSubScript(env, s, scriptObj, writeScript, &result, &ok);
         NS_ENSURE_SUCCESS(rv, rv);
-        rv = ReadCachedScript(cache, cachePath, cx, &scriptObj);
+
+        // Leave the script's exception pending for our caller.
+        if (!ok)
+            return JS_IsExceptionPending(cx) ? NS_OK : NS_ERROR_FAILURE;
+
+        JSAutoEnterCompartment rac;
+        if (!rac.enter(cx, results) || !JS_WrapValue(cx, &result) ||
+            !JS_SetElement(cx, results, i, &result))
+            return NS_ERROR_FAILURE;
+    }
+
+    return NS_OK;
+}
+
+/*
+ * A load started by loadSubScriptAsync. The channel is read by necko off
+ * of the main thread, its source decoded on our decoder thread, and the
+ * script compiled and run back on the main thread, after which the
+ * callback is called with its result, or with undefined and the error.
+ */
+class AsyncSubScriptLoad : public nsIStreamLoaderObserver
+{
+public:
+    NS_DECL_ISUPPORTS
+    NS_DECL_NSISTREAMLOADEROBSERVER
+
+    AsyncSubScriptLoad(dactylUtils *owner, JSRuntime *runtime,
+                       nsIPrincipal *systemPrincipal, nsIThread *decodeThread)
+        : mOwner(owner), mRuntime(runtime),
+          mSystemPrincipal(systemPrincipal),
+          mDecodeThread(decodeThread), mReadStart(0), mTarget(nsnull),
+          mCallback(JSVAL_VOID), mRooted(false),
+          mVersion(JSVERSION_DEFAULT), mError(nsnull)
+    {}
+
+    ~AsyncSubScriptLoad() {
+        NS_ASSERTION(!mRooted, "Async load destroyed while still rooted");
     }
 
-    if (!scriptObj) {
-        rv = ReadScript(uri, cx, target_obj, charset, (char *)uriStr.get(), serv,
-                        principal, &scriptObj);
-        writeScript = true;
+    nsresult Start(JSContext *cx, const char *url, JSObject *target,
+                   const nsAString &charset, const jsval &callback);
+
+    void Decode();
+    void Finish();
+
+private:
+    void AddRoots(JSContext *cx);
+    void RemoveRoots();
+
+    nsRefPtr<dactylUtils>    mOwner;
+
+    JSRuntime               *mRuntime;
+    nsCOMPtr<nsIPrincipal>   mSystemPrincipal;
+    nsCOMPtr<nsIThread>      mDecodeThread;
+    PRTime                   mReadStart;
+
+    JSObject                *mTarget;
+    jsval                    mCallback;
+    bool                     mRooted;
+    JSVersion                mVersion;
+
+    nsString                 mCharset;
+    SubScript                mScript;
+    const char              *mError;
+};
+
+NS_IMPL_THREADSAFE_ISUPPORTS1(AsyncSubScriptLoad, nsIStreamLoaderObserver)
+
+void
+AsyncSubScriptLoad::AddRoots(JSContext *cx)
+{
+    JS_AddNamedObjectRoot(cx, &mTarget, "AsyncSubScriptLoad::mTarget");
+    JS_AddNamedValueRoot(cx, &mCallback, "AsyncSubScriptLoad::mCallback");
+    mRooted = true;
+}
+
+void
+AsyncSubScriptLoad::RemoveRoots()
+{
+    if (mRooted) {
+        JS_RemoveObjectRootRT(mRuntime, &mTarget);
+        JS_RemoveValueRootRT(mRuntime, &mCallback);
+        mRooted = false;
     }
+}
 
-    if (NS_FAILED(rv) || !scriptObj)
+nsresult
+AsyncSubScriptLoad::Start(JSContext *cx, const char *url, JSObject *target,
+                          const nsAString &charset, const jsval &callback)
+{
+    nsresult rv;
+
+    mCharset.Assign(charset);
+    const jschar *charsetChars = nsnull;
+    if (!mCharset.IsEmpty())
+        charsetChars = reinterpret_cast<const jschar*>(mCharset.get());
+
+    LoadEnvironment env(cx);
+    rv = InitLoadEnvironment(env, target, mSystemPrincipal, mOwner);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    {
+        JSAutoEnterCompartment ac;
+        if (!ac.enter(cx, env.targetObj))
+            return NS_ERROR_UNEXPECTED;
+
+        if (!env.serv) {
+            return ReportError(cx, LOAD_ERROR_NOSERVICE);
+        }
+
+        rv = PrepareSubScript(env, url, charsetChars, mScript);
+        if (NS_FAILED(rv) || JS_IsExceptionPending(cx))
+            return rv;
+    }
+
+    mTarget = target;
+    mCallback = callback;
+    mVersion = env.version;
+    AddRoots(cx);
+
+    // Cache hits skip the I/O entirely. We still finish on a later turn
+    // of the event loop, so that the callback is always asynchronous.
+    if (mScript.HaveCacheEntry()) {
+        rv = NS_DispatchToMainThread(
+            NS_NewRunnableMethod(this, &AsyncSubScriptLoad::Finish));
+        if (NS_FAILED(rv))
+            RemoveRoots();
         return rv;
+    }
 
-    ok = false;
-    if (scriptObj)
-        ok = JS_ExecuteScriptVersion(cx, target_obj, scriptObj, rval, version);
+    mReadStart = PR_Now();
 
-    if (ok) {
-        JSAutoEnterCompartment rac;
-        if (!rac.enter(cx, result_obj) || !JS_WrapValue(cx, rval))
+    // Instead of calling NS_OpenURI, we create the channel ourselves and call
+    // SetContentType, to avoid expensive MIME type lookups (bug 632490).
+    nsCOMPtr<nsIChannel> chan;
+    rv = NS_NewChannel(getter_AddRefs(chan), mScript.uri, env.serv,
+                       nsnull, nsnull, nsIRequest::LOAD_NORMAL);
+    if (NS_SUCCEEDED(rv)) {
+        chan->SetContentType(NS_LITERAL_CSTRING("application/javascript"));
+
+        nsCOMPtr<nsIStreamLoader> loader;
+        rv = NS_NewStreamLoader(getter_AddRefs(loader), this);
+        if (NS_SUCCEEDED(rv))
+            rv = chan->AsyncOpen(loader, nsnull);
+    }
+
+    if (NS_FAILED(rv)) {
+        RemoveRoots();
+
+        JSAutoEnterCompartment ac;
+        if (!ac.enter(cx, env.targetObj))
             return NS_ERROR_UNEXPECTED;
+        return ReportError(cx, LOAD_ERROR_NOSTREAM);
+    }
+
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+AsyncSubScriptLoad::OnStreamComplete(nsIStreamLoader *aLoader,
+                                     nsISupports *aContext,
+                                     nsresult aStatus,
+                                     PRUint32 aLength,
+                                     const PRUint8 *aData)
+{
+    mScript.stats.readTime += PR_Now() - mReadStart;
+
+    if (NS_FAILED(aStatus)) {
+        mError = LOAD_ERROR_NOSTREAM;
+        Finish();
+        return NS_OK;
     }
 
-    if (cache && ok && writeScript) {
-        WriteCachedScript(cache, cachePath, cx, scriptObj);
+    mScript.source.Assign(reinterpret_cast<const char*>(aData), aLength);
+    mScript.haveSource = true;
+    mScript.stats.sourceSize += aLength;
+
+    // Without a charset, the engine inflates the source itself.
+    if (mCharset.IsEmpty()) {
+        Finish();
+        return NS_OK;
     }
 
-    cc->SetReturnValueWasSet (ok);
+    nsresult rv = mDecodeThread->Dispatch(
+        NS_NewRunnableMethod(this, &AsyncSubScriptLoad::Decode),
+        NS_DISPATCH_NORMAL);
+    if (NS_FAILED(rv))
+        Finish();
+
+    return NS_OK;
+}
+
+/* Runs on the decoder thread. */
+void
+AsyncSubScriptLoad::Decode()
+{
+    PRTime start = PR_Now();
+    nsresult rv = ConvertToUTF16(
+            nsnull, reinterpret_cast<const PRUint8*>(mScript.source.get()),
+            mScript.source.Length(), mCharset, mScript.decoded);
+    mScript.stats.decodeTime += PR_Now() - start;
+
+    if (NS_SUCCEEDED(rv))
+        mScript.haveDecoded = true;
+    else
+        mError = LOAD_ERROR_BADCHARSET;
+
+    // This only fails once the main thread has stopped taking events.
+    // Our roots, owner and principal can only be let go of there, so
+    // rather than have our last reference dropped here, we leak.
+    rv = NS_DispatchToMainThread(
+        NS_NewRunnableMethod(this, &AsyncSubScriptLoad::Finish));
+    if (NS_FAILED(rv)) {
+        NS_WARNING("Leaking an async subscript load at shutdown");
+        NS_ADDREF_THIS();
+    }
+}
+
+void
+AsyncSubScriptLoad::Finish()
+{
+    nsresult rv;
+
+    nsCOMPtr<nsIThreadJSContextStack> stack =
+        do_GetService("@mozilla.org/js/xpc/ContextStack;1");
+
+    JSContext *cx = nsnull;
+    if (stack)
+        stack->GetSafeJSContext(&cx);
+
+    // Without a context, there's no calling the callback, so the error
+    // console has to do.
+    if (!cx || NS_FAILED(stack->Push(cx))) {
+        nsCOMPtr<nsIConsoleService> consoleService =
+            do_GetService(NS_CONSOLESERVICE_CONTRACTID);
+        if (consoleService) {
+            nsCAutoString message("loadSubScriptAsync: no context to finish loading ");
+            message.Append(mScript.uriStr);
+            consoleService->LogStringMessage(
+                    NS_ConvertUTF8toUTF16(message).get());
+        }
+
+        mScript.stats.loads = 1;
+        mScript.stats.failures = 1;
+        mOwner->RecordLoad(mScript.uriStr, mScript.stats);
+
+        RemoveRoots();
+        mScript.uri = nsnull;
+        mOwner = nsnull;
+        return;
+    }
+
+    {
+        JSAutoRequest ar(cx);
+
+        const jschar *charset = nsnull;
+        if (!mCharset.IsEmpty())
+            charset = reinterpret_cast<const jschar*>(mCharset.get());
+
+        jsval result = JSVAL_VOID;
+        jsval error = JSVAL_VOID;
+
+        LoadEnvironment env(cx);
+        rv = InitLoadEnvironment(env, mTarget, mSystemPrincipal, mOwner);
+        if (NS_SUCCEEDED(rv)) {
+            env.version = mVersion;
+
+            JSAutoEnterCompartment ac;
+            if (!ac.enter(cx, env.targetObj))
+                rv = NS_ERROR_UNEXPECTED;
+            else if (mError) {
+                ReportError(cx, mError);
+                RecordSubScript(env, mScript, false);
+            }
+            else {
+                bool writeScript;
+                JSScriptType *scriptObj = nsnull;
+                rv = CompileSubScript(env, mScript, charset, &scriptObj,
+                                      &writeScript);
+                if (NS_SUCCEEDED(rv) && scriptObj) {
+                    JSBool ok;
+                    rv = ExecuteSubScript(env, mScript, scriptObj, writeScript,
+                                          &result, &ok);
+                }
+            }
+
+            if (JS_GetPendingException(cx, &error))
+                JS_ClearPendingException(cx);
+            else if (NS_FAILED(rv))
+                error = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, LOAD_ERROR_BADREAD));
+        }
+
+        if (!JSVAL_IS_PRIMITIVE(mCallback)) {
+            JSObject *callback = JSVAL_TO_OBJECT(mCallback);
+
+            JSAutoEnterCompartment ac;
+            if (ac.enter(cx, callback) &&
+                JS_WrapValue(cx, &result) && JS_WrapValue(cx, &error)) {
+                jsval argv[] = { result, error };
+                jsval rval;
+                if (!JS_CallFunctionValue(cx, JS_GetGlobalForObject(cx, callback),
+                                          mCallback, 2, argv, &rval))
+                    JS_ReportPendingException(cx);
+            }
+        }
+    }
+
+    stack->Pop(nsnull);
+
+    RemoveRoots();
+
+    // Neither of these is threadsafe, and we may be released off of the
+    // main thread.
+    mScript.uri = nsnull;
+    mOwner = nsnull;
+}
+
+NS_IMETHODIMP
+dactylUtils::LoadSubScriptAsync(const nsAString &aURL,
+                                const jsval &aTarget,
+                                const nsAString &aCharset,
+                                const jsval &aCallback,
+                                JSContext *cx)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    JSObject *target_obj;
+    if (JSVAL_IS_PRIMITIVE(aTarget)) {
+        target_obj = JS_GetGlobalForScopeChain(cx);
+        NS_ENSURE_TRUE(target_obj, NS_ERROR_FAILURE);
+    }
+    else
+        target_obj = JSVAL_TO_OBJECT(aTarget);
+
+    NS_ENSURE_TRUE(JSVAL_IS_VOID(aCallback) ||
+                   (!JSVAL_IS_PRIMITIVE(aCallback) &&
+                    JS_ObjectIsCallable(cx, JSVAL_TO_OBJECT(aCallback))),
+                   NS_ERROR_XPC_BAD_CONVERT_JS);
+
+    nsCOMPtr<nsIThread> thread;
+    rv = GetDecodeThread(getter_AddRefs(thread));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    nsRefPtr<AsyncSubScriptLoad> load =
+        new AsyncSubScriptLoad(this, mRuntime, mSystemPrincipal, thread);
+
+    return load->Start(cx, NS_ConvertUTF16toUTF8(aURL).get(), target_obj,
+                       aCharset, aCallback);
+}
+
+/*
+ * A warmScriptCache request. It waits for the user to go idle, then
+ * compiles one script per event, so that anything else queued gets its
+ * turn in between. It stops as soon as the idle service reports the user
+ * back, or the user's idle time goes backwards between two scripts,
+ * which catches input before that notification arrives.
+ */
+class ScriptCacheWarmer : public nsIObserver
+{
+public:
+    NS_DECL_ISUPPORTS
+    NS_DECL_NSIOBSERVER
+
+    ScriptCacheWarmer(dactylUtils *owner, JSRuntime *runtime)
+        : mOwner(owner), mRuntime(runtime), mTarget(nsnull),
+          mCallback(JSVAL_VOID), mRooted(false), mRunning(false),
+          mInterrupted(false), mNext(0), mProduced(0), mLastIdleTime(0)
+    {}
+
+    ~ScriptCacheWarmer() {
+        NS_ASSERTION(!mRooted, "Cache warmer destroyed while still rooted");
+    }
+
+    nsresult Start(JSContext *cx, nsTArray<nsCString> &urls, JSObject *target,
+                   const nsAString &charset, const jsval &callback);
+
+    void Step();
+
+private:
+    // How long, in seconds, the user must be idle before we start.
+    static const PRUint32 kIdleSeconds = 3;
+
+    bool InputArrived();
+    void Warm(JSContext *cx, const nsCString &url);
+    void Finish(bool complete);
+
+    nsRefPtr<dactylUtils>     mOwner;
+    JSRuntime                *mRuntime;
+    nsCOMPtr<nsIIdleService>  mIdleService;
+
+    JSObject                 *mTarget;
+    jsval                     mCallback;
+    bool                      mRooted;
+
+    bool                      mRunning;
+    bool                      mInterrupted;
+
+    nsTArray<nsCString>       mURLs;
+    nsString                  mCharset;
+    PRUint32                  mNext;
+    PRUint32                  mProduced;
+    PRUint32                  mLastIdleTime;
+};
+
+NS_IMPL_ISUPPORTS1(ScriptCacheWarmer, nsIObserver)
+
+nsresult
+ScriptCacheWarmer::Start(JSContext *cx, nsTArray<nsCString> &urls,
+                         JSObject *target, const nsAString &charset,
+                         const jsval &callback)
+{
+    mURLs.SwapElements(urls);
+    mCharset.Assign(charset);
+
+    mTarget = target;
+    mCallback = callback;
+    JS_AddNamedObjectRoot(cx, &mTarget, "ScriptCacheWarmer::mTarget");
+    JS_AddNamedValueRoot(cx, &mCallback, "ScriptCacheWarmer::mCallback");
+    mRooted = true;
+
+    // Without an idle service, there's nothing to wait for.
+    mIdleService = do_GetService("@mozilla.org/widget/idleservice;1");
+    if (mIdleService &&
+        NS_SUCCEEDED(mIdleService->AddIdleObserver(this, kIdleSeconds)))
+        return NS_OK;
+
+    mIdleService = nsnull;
+    return Observe(nsnull, "idle", nsnull);
+}
+
+NS_IMETHODIMP
+ScriptCacheWarmer::Observe(nsISupports *aSubject, const char *aTopic,
+                           const PRUnichar *aData)
+{
+    if (!strcmp(aTopic, "idle") && !mRunning) {
+        mRunning = true;
+        if (mIdleService)
+            mIdleService->GetIdleTime(&mLastIdleTime);
+
+        return NS_DispatchToCurrentThread(
+            NS_NewRunnableMethod(this, &ScriptCacheWarmer::Step));
+    }
+    if (!strcmp(aTopic, "back"))
+        mInterrupted = true;
+    return NS_OK;
+}
+
+bool
+ScriptCacheWarmer::InputArrived()
+{
+    if (mInterrupted)
+        return true;
+
+    PRUint32 idleTime;
+    if (mIdleService && NS_SUCCEEDED(mIdleService->GetIdleTime(&idleTime))) {
+        if (idleTime < mLastIdleTime)
+            return true;
+        mLastIdleTime = idleTime;
+    }
+    return false;
+}
+
+void
+ScriptCacheWarmer::Step()
+{
+    if (InputArrived() || mNext >= mURLs.Length()) {
+        Finish(mNext >= mURLs.Length());
+        return;
+    }
+
+    nsCOMPtr<nsIThreadJSContextStack> stack =
+        do_GetService("@mozilla.org/js/xpc/ContextStack;1");
+
+    JSContext *cx = nsnull;
+    if (stack)
+        stack->GetSafeJSContext(&cx);
+
+    if (!cx || NS_FAILED(stack->Push(cx))) {
+        Finish(false);
+        return;
+    }
+
+    Warm(cx, mURLs[mNext++]);
+
+    stack->Pop(nsnull);
+
+    nsresult rv = NS_DispatchToCurrentThread(
+        NS_NewRunnableMethod(this, &ScriptCacheWarmer::Step));
+    if (NS_FAILED(rv))
+        Finish(false);
+}
+
+/*
+ * Whether *s* is already compiled in memory, or has an up to date entry
+ * in the bundle, our store, or the startup cache. Entries are checked by
+ * their stamps alone, rather than decoded.
+ */
+static bool
+IsWarm(LoadEnvironment &env, SubScript &s)
+{
+    if (env.scripts && env.scripts->Has(env.cx, s.cachePath, s.stamp))
+        return true;
+
+    if (!s.HaveCacheEntry())
+        return false;
+
+    const char *data = s.bundleData ? s.bundleData : s.cacheBuffer;
+    return NS_SUCCEEDED(CheckCachedScript(data, s.cacheLength, s.stamp));
+}
+
+/* Compiles *url*, if it isn't cached already, and caches it. */
+void
+ScriptCacheWarmer::Warm(JSContext *cx, const nsCString &url)
+{
+    JSAutoRequest ar(cx);
+
+    const jschar *charset = nsnull;
+    if (!mCharset.IsEmpty())
+        charset = reinterpret_cast<const jschar*>(mCharset.get());
+
+    LoadEnvironment env(cx);
+    nsresult rv = InitLoadEnvironment(env, mTarget, mOwner->SystemPrincipal(),
+                                      mOwner);
+    if (NS_FAILED(rv) || !env.cache || !env.serv)
+        return;
+
+    JSAutoEnterCompartment ac;
+    if (!ac.enter(cx, env.targetObj))
+        return;
+
+    SubScript s;
+    rv = PrepareSubScript(env, url.get(), charset, s);
+    if (NS_SUCCEEDED(rv) && !JS_IsExceptionPending(cx) && !IsWarm(env, s)) {
+        bool writeScript;
+        JSScriptType *scriptObj = nsnull;
+        rv = CompileSubScript(env, s, charset, &scriptObj, &writeScript);
+        if (NS_SUCCEEDED(rv) && scriptObj && writeScript &&
+            NS_SUCCEEDED(WriteSubScript(env, s, scriptObj)))
+            mProduced++;
+    }
+
+    // Scripts which fail to load will fail again when they're loaded
+    // for real, and report it then.
+    JS_ClearPendingException(cx);
+}
+
+void
+ScriptCacheWarmer::Finish(bool complete)
+{
+    if (mIdleService)
+        mIdleService->RemoveIdleObserver(this, kIdleSeconds);
+    mIdleService = nsnull;
+
+    nsCOMPtr<nsIThreadJSContextStack> stack =
+        do_GetService("@mozilla.org/js/xpc/ContextStack;1");
+
+    JSContext *cx = nsnull;
+    if (stack)
+        stack->GetSafeJSContext(&cx);
+
+    if (cx && !JSVAL_IS_PRIMITIVE(mCallback) && NS_SUCCEEDED(stack->Push(cx))) {
+        {
+            JSAutoRequest ar(cx);
+
+            JSObject *callback = JSVAL_TO_OBJECT(mCallback);
+
+            JSAutoEnterCompartment ac;
+            if (ac.enter(cx, callback)) {
+                jsval argv[] = { INT_TO_JSVAL(mProduced), BOOLEAN_TO_JSVAL(complete) };
+                jsval rval;
+                if (!JS_CallFunctionValue(cx, JS_GetGlobalForObject(cx, callback),
+                                          mCallback, 2, argv, &rval))
+                    JS_ReportPendingException(cx);
+            }
+        }
+        stack->Pop(nsnull);
+    }
+
+    if (mRooted) {
+        JS_RemoveObjectRootRT(mRuntime, &mTarget);
+        JS_RemoveValueRootRT(mRuntime, &mCallback);
+        mRooted = false;
+    }
+    mOwner = nsnull;
+}
+
+NS_IMETHODIMP
+dactylUtils::WarmScriptCache(const jsval &aURLs,
+                             const jsval &aTarget,
+                             const nsAString &aCharset,
+                             const jsval &aCallback,
+                             JSContext *cx)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsTArray<nsCString> urls;
+    rv = GetURLList(cx, aURLs, urls);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    JSObject *target_obj;
+    if (JSVAL_IS_PRIMITIVE(aTarget)) {
+        target_obj = JS_GetGlobalForScopeChain(cx);
+        NS_ENSURE_TRUE(target_obj, NS_ERROR_FAILURE);
+    }
+    else
+        target_obj = JSVAL_TO_OBJECT(aTarget);
+
+    NS_ENSURE_TRUE(JSVAL_IS_VOID(aCallback) ||
+                   (!JSVAL_IS_PRIMITIVE(aCallback) &&
+                    JS_ObjectIsCallable(cx, JSVAL_TO_OBJECT(aCallback))),
+                   NS_ERROR_XPC_BAD_CONVERT_JS);
+
+    nsRefPtr<ScriptCacheWarmer> warmer = new ScriptCacheWarmer(this, mRuntime);
+    return warmer->Start(cx, urls, target_obj, aCharset, aCallback);
+}
+
+/*
+ * Compiles the file at the native *path*, without running it, and encodes
+ * it into *script* as it would be stored in a bundle, under the *stamp*
+ * it will have when it's read from our jar. The caller must clear
+ * JSOPTION_COMPILE_N_GO, as CompileScriptSource does for the scripts it
+ * keeps in memory. Syntax errors are left pending, and reported as
+ * NS_ERROR_ABORT.
+ */
+static nsresult
+CompileFile(JSContext *cx, JSObject *global, JSPrincipals *jsPrincipals,
+            const nsCString &path, ScriptBundle::Script *script,
+            ScriptStamp *stamp)
+{
+    nsresult rv;
+
+    nsCOMPtr<nsILocalFile> file;
+    rv = NS_NewNativeLocalFile(path, PR_TRUE, getter_AddRefs(file));
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    nsRefPtr<MappedFile> source = new MappedFile();
+    rv = source->Init(file);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    const char *data = source->Data();
+    PRUint32 length = source->Length();
+
+    *stamp = ScriptStamp();
+    stamp->size = length;
+    stamp->crc = UpdateCRC32(0, data, length);
+
+    script->ascii = ASCIIPrefixLength(data, length) == length;
+
+    JSScriptType *scriptObj;
+    if (script->ascii)
+        scriptObj = JS_CompileScriptForPrincipals(cx, global, jsPrincipals,
+                                                  data, length,
+                                                  script->url.get(), 1);
+    else {
+        nsString decoded;
+        rv = ConvertToUTF16(nsnull, reinterpret_cast<const PRUint8*>(data),
+                            length, NS_LITERAL_STRING("UTF-8"), decoded);
+        NS_ENSURE_SUCCESS(rv, rv);
+
+        scriptObj = JS_CompileUCScriptForPrincipals(cx, global, jsPrincipals,
+                                                    reinterpret_cast<const jschar*>(decoded.get()),
+                                                    decoded.Length(),
+                                                    script->url.get(), 1);
+    }
+
+    if (!scriptObj)
+        return JS_IsExceptionPending(cx) ? NS_ERROR_ABORT : NS_ERROR_FAILURE;
+
+    return EncodeCachedScript(*stamp, cx, scriptObj,
+                              getter_Transfers(script->data), &script->length);
+}
+
+NS_IMETHODIMP
+dactylUtils::WriteScriptBundle(nsIFile *aFile,
+                               const jsval &aURLs,
+                               const jsval &aPaths,
+                               JSContext *cx)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsTArray<nsCString> urls, paths;
+    rv = GetURLList(cx, aURLs, urls);
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = GetURLList(cx, aPaths, paths);
+    NS_ENSURE_SUCCESS(rv, rv);
+    NS_ENSURE_TRUE(urls.Length() == paths.Length(), NS_ERROR_INVALID_ARG);
+
+    JSObject *global = JS_GetGlobalForScopeChain(cx);
+    NS_ENSURE_TRUE(global, NS_ERROR_FAILURE);
+
+    JSPrincipals *jsPrincipals;
+    rv = mSystemPrincipal->GetJSPrincipals(cx, &jsPrincipals);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    // As in CompileScriptSource.
+    uint32 options = JS_GetOptions(cx);
+    JS_SetOptions(cx, options & ~JSOPTION_COMPILE_N_GO);
+
+    nsTArray<nsAutoPtr<ScriptBundle::Script> > scripts;
+    for (PRUint32 i = 0; i < urls.Length() && NS_SUCCEEDED(rv); i++) {
+        nsAutoPtr<ScriptBundle::Script> script(new ScriptBundle::Script());
+        script->url = urls[i];
+
+        ScriptStamp stamp;
+        rv = CompileFile(cx, global, jsPrincipals, paths[i], script, &stamp);
+        if (NS_SUCCEEDED(rv))
+            scripts.AppendElement(script.forget());
+    }
+
+    JS_SetOptions(cx, options);
+    JSPRINCIPALS_DROP(cx, jsPrincipals);
+
+    if (rv == NS_ERROR_ABORT)
+        return NS_OK;
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    return ScriptBundle::Write(aFile, JS_GetVersion(cx), scripts);
+}
+
+/*
+ * The getter of a lazy subscript stub. Everything it needs is kept in
+ * properties of the getter itself, so that the garbage collector sees
+ * its reference to the target. The stub's name is kept as *property*,
+ * since functions already have a *name* of their own.
+ */
+static JSBool
+LazySubScriptGetter(JSContext *cx, uintN argc, jsval *vp)
+{
+    JSObject *callee = JSVAL_TO_OBJECT(JS_CALLEE(cx, vp));
+
+    jsval target, name, url, charset;
+    if (!JS_GetProperty(cx, callee, "target", &target) ||
+        !JS_GetProperty(cx, callee, "property", &name) ||
+        !JS_GetProperty(cx, callee, "url", &url) ||
+        !JS_GetProperty(cx, callee, "charset", &charset))
+        return JS_FALSE;
+
+    dactylUtils *utils = dactylUtils::GetService();
+    if (!utils || JSVAL_IS_PRIMITIVE(target) || !JSVAL_IS_STRING(url)) {
+        JS_ReportError(cx, "Invalid lazy subscript");
+        return JS_FALSE;
+    }
+    JSObject *target_obj = JSVAL_TO_OBJECT(target);
+
+    jsid id;
+    if (!JS_ValueToId(cx, name, &id))
+        return JS_FALSE;
+
+    JSAutoByteString urlbytes(cx, JSVAL_TO_STRING(url));
+    if (!urlbytes)
+        return JS_FALSE;
+
+    const jschar *charsetChars = nsnull;
+    if (JSVAL_IS_STRING(charset))
+        charsetChars = JS_GetStringCharsZ(cx, JSVAL_TO_STRING(charset));
+
+    jsval result = JSVAL_VOID;
+    {
+        LoadEnvironment env(cx);
+        nsresult rv = InitLoadEnvironment(env, target_obj,
+                                          utils->SystemPrincipal(), utils);
+        if (NS_FAILED(rv)) {
+            JS_ReportError(cx, "%s", LOAD_ERROR_NOSERVICE);
+            return JS_FALSE;
+        }
+
+        JSAutoEnterCompartment ac;
+        if (!ac.enter(cx, target_obj))
+            return JS_FALSE;
+
+        // The stub goes first, so that the script can define the real
+        // thing in its place.
+        jsval junk;
+        if (!JS_DeletePropertyById2(cx, target_obj, id, &junk))
+            return JS_FALSE;
+
+        JSBool ok = JS_FALSE;
+        if (!env.serv)
+            ReportError(cx, LOAD_ERROR_NOSERVICE);
+        else
+            rv = LoadOneSubScript(env, urlbytes.ptr(), charsetChars,
+                                  &result, &ok);
+        if (NS_FAILED(rv) && !JS_IsExceptionPending(cx))
+            JS_ReportError(cx, "%s", LOAD_ERROR_BADREAD);
+        if (!ok) {
+            // Put the stub back, unless the script got as far as defining
+            // the name, so that the next access tries again.
+            JSBool found;
+            if (JS_AlreadyHasOwnPropertyById(cx, target_obj, id, &found) && !found)
+                JS_DefinePropertyById(cx, target_obj, id, JSVAL_VOID,
+                                      JS_DATA_TO_FUNC_PTR(JSPropertyOp, callee),
+                                      nsnull,
+                                      JSPROP_GETTER | JSPROP_SHARED | JSPROP_ENUMERATE);
+            return JS_FALSE;
+        }
+
+        utils->LazySubScriptLoaded(nsDependentCString(urlbytes.ptr()));
+
+        // If the script didn't define the name itself, its result is
+        // what the name refers to.
+        JSBool found;
+        if (!JS_AlreadyHasOwnPropertyById(cx, target_obj, id, &found))
+            return JS_FALSE;
+        if (found) {
+            if (!JS_GetPropertyById(cx, target_obj, id, &result))
+                return JS_FALSE;
+        }
+        else if (!JS_WrapValue(cx, &result) ||
+                 !JS_DefinePropertyById(cx, target_obj, id, result,
+                                        nsnull, nsnull, JSPROP_ENUMERATE))
+            return JS_FALSE;
+    }
+
+    if (!JS_WrapValue(cx, &result))
+        return JS_FALSE;
+
+    JS_SET_RVAL(cx, vp, result);
+    return JS_TRUE;
+}
+
+NS_IMETHODIMP
+dactylUtils::DefineLazySubScript(const nsAString &aName,
+                                 const nsAString &aURL,
+                                 const jsval &aTarget,
+                                 const nsAString &aCharset,
+                                 JSContext *cx)
+{
+    JSAutoRequest ar(cx);
+
+    JSObject *target_obj;
+    if (JSVAL_IS_PRIMITIVE(aTarget)) {
+        target_obj = JS_GetGlobalForScopeChain(cx);
+        NS_ENSURE_TRUE(target_obj, NS_ERROR_FAILURE);
+    }
+    else
+        target_obj = JSVAL_TO_OBJECT(aTarget);
+
+    NS_ConvertUTF16toUTF8 url(aURL);
+    NS_ConvertUTF16toUTF8 name(aName);
+
+    JSAutoEnterCompartment ac;
+    NS_ENSURE_TRUE(ac.enter(cx, target_obj), NS_ERROR_UNEXPECTED);
+
+    JSFunction *fun = JS_NewFunction(cx, LazySubScriptGetter, 0, 0,
+                                     JS_GetGlobalForObject(cx, target_obj),
+                                     name.get());
+    NS_ENSURE_TRUE(fun, NS_ERROR_OUT_OF_MEMORY);
+    JSObject *getter = JS_GetFunctionObject(fun);
+
+    JSString *nameStr = JS_NewUCStringCopyN(cx,
+            reinterpret_cast<const jschar*>(aName.BeginReading()), aName.Length());
+    JSString *urlStr = JS_NewStringCopyN(cx, url.get(), url.Length());
+    NS_ENSURE_TRUE(nameStr && urlStr, NS_ERROR_OUT_OF_MEMORY);
+
+    jsval charset = JSVAL_VOID;
+    if (!aCharset.IsEmpty()) {
+        JSString *str = JS_NewUCStringCopyN(cx,
+                reinterpret_cast<const jschar*>(aCharset.BeginReading()),
+                aCharset.Length());
+        NS_ENSURE_TRUE(str, NS_ERROR_OUT_OF_MEMORY);
+        charset = STRING_TO_JSVAL(str);
+    }
+
+    const uintN attrs = JSPROP_READONLY | JSPROP_PERMANENT;
+    NS_ENSURE_TRUE(JS_DefineProperty(cx, getter, "target", OBJECT_TO_JSVAL(target_obj),
+                                     nsnull, nsnull, attrs) &&
+                   JS_DefineProperty(cx, getter, "property", STRING_TO_JSVAL(nameStr),
+                                     nsnull, nsnull, attrs) &&
+                   JS_DefineProperty(cx, getter, "url", STRING_TO_JSVAL(urlStr),
+                                     nsnull, nsnull, attrs) &&
+                   JS_DefineProperty(cx, getter, "charset", charset,
+                                     nsnull, nsnull, attrs),
+                   NS_ERROR_FAILURE);
+
+    NS_ENSURE_TRUE(JS_DefineUCProperty(cx, target_obj,
+                                       reinterpret_cast<const jschar*>(aName.BeginReading()),
+                                       aName.Length(), JSVAL_VOID,
+                                       JS_DATA_TO_FUNC_PTR(JSPropertyOp, getter),
+                                       nsnull,
+                                       JSPROP_GETTER | JSPROP_SHARED | JSPROP_ENUMERATE),
+                   NS_ERROR_FAILURE);
+
+    mLazySubScripts.PutEntry(url);
+    return NS_OK;
+}
+
+void
+dactylUtils::LazySubScriptLoaded(const nsACString &url)
+{
+    mLazySubScripts.RemoveEntry(url);
+}
+
+static PLDHashOperator
+AppendLazySubScript(nsCStringHashKey *aEntry, void *aClosure)
+{
+    static_cast<nsTArray<nsCString>*>(aClosure)->AppendElement(aEntry->GetKey());
+    return PL_DHASH_NEXT;
+}
+
+NS_IMETHODIMP
+dactylUtils::GetUnloadedLazySubScripts(JSContext *cx, jsval *retval)
+{
+    JSAutoRequest ar(cx);
+
+    nsTArray<nsCString> urls;
+    mLazySubScripts.EnumerateEntries(AppendLazySubScript, &urls);
+
+    JSObject *array = JS_NewArrayObject(cx, 0, nsnull);
+    NS_ENSURE_TRUE(array, NS_ERROR_OUT_OF_MEMORY);
+    *retval = OBJECT_TO_JSVAL(array);
+
+    for (PRUint32 i = 0; i < urls.Length(); i++) {
+        JSString *str = JS_NewStringCopyN(cx, urls[i].get(), urls[i].Length());
+        NS_ENSURE_TRUE(str, NS_ERROR_OUT_OF_MEMORY);
+
+        jsval v = STRING_TO_JSVAL(str);
+        NS_ENSURE_TRUE(JS_SetElement(cx, array, i, &v), NS_ERROR_FAILURE);
+    }
+    return NS_OK;
+}
+
+static bool
+SetNumberProperty(JSContext *cx, JSObject *obj, const char *name, jsdouble n)
+{
+    jsval v;
+    return JS_NewNumberValue(cx, n, &v) &&
+           JS_DefineProperty(cx, obj, name, v, nsnull, nsnull, JSPROP_ENUMERATE);
+}
+
+/* Converts a PRTime interval to milliseconds. */
+static jsdouble
+ToMilliseconds(PRTime time)
+{
+    return jsdouble(time) / PR_USEC_PER_MSEC;
+}
+
+NS_IMETHODIMP
+dactylUtils::GetCacheStatistics(JSContext *cx, jsval *retval)
+{
+    JSAutoRequest ar(cx);
+
+    JSObject *obj = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    NS_ENSURE_TRUE(obj, NS_ERROR_OUT_OF_MEMORY);
+    *retval = OBJECT_TO_JSVAL(obj);
+
+    const ScriptCompressionStats &compression = CompressionStats();
+    GlobalPool *pool = mGlobalPool;
+    NS_ENSURE_TRUE(SetNumberProperty(cx, obj, "hits", gCacheStats.hits) &&
+                   SetNumberProperty(cx, obj, "misses", gCacheStats.misses) &&
+                   SetNumberProperty(cx, obj, "stale", gCacheStats.stale) &&
+                   SetNumberProperty(cx, obj, "inPlaceDecodes", gCacheStats.inPlace) &&
+                   SetNumberProperty(cx, obj, "memoryHits", mScriptCache.Hits()) &&
+                   SetNumberProperty(cx, obj, "memoryMisses", mScriptCache.Misses()) &&
+                   SetNumberProperty(cx, obj, "memoryEvictions", mScriptCache.Evictions()) &&
+                   SetNumberProperty(cx, obj, "memoryEntries", mScriptCache.Count()) &&
+                   SetNumberProperty(cx, obj, "memorySize", mScriptCache.Size()) &&
+                   SetNumberProperty(cx, obj, "storeHits", mScriptStore.Hits()) &&
+                   SetNumberProperty(cx, obj, "storeMisses", mScriptStore.Misses()) &&
+                   SetNumberProperty(cx, obj, "storeCorrupt", mScriptStore.Corrupt()) &&
+                   SetNumberProperty(cx, obj, "storeCompactions", mScriptStore.Compactions()) &&
+                   SetNumberProperty(cx, obj, "storeSize", mScriptStore.DataSize()) &&
+                   SetNumberProperty(cx, obj, "bundleHits", mScriptBundle.Hits()) &&
+                   SetNumberProperty(cx, obj, "compressedWrites", compression.compressed) &&
+                   SetNumberProperty(cx, obj, "uncompressedWrites", compression.uncompressed) &&
+                   SetNumberProperty(cx, obj, "compressionSaved", compression.savedSize) &&
+                   SetNumberProperty(cx, obj, "compressedReads", compression.decompressed) &&
+                   SetNumberProperty(cx, obj, "compressedCorrupt", compression.corrupt) &&
+                   SetNumberProperty(cx, obj, "decompressTime",
+                                     ToMilliseconds(compression.decompressTime)) &&
+                   SetNumberProperty(cx, obj, "evalHits", mEvalCache.Hits()) &&
+                   SetNumberProperty(cx, obj, "evalMisses", mEvalCache.Misses()) &&
+                   SetNumberProperty(cx, obj, "evalEvictions", mEvalCache.Evictions()) &&
+                   SetNumberProperty(cx, obj, "evalEntries", mEvalCache.Count()) &&
+                   SetNumberProperty(cx, obj, "evalSize", mEvalCache.Size()) &&
+                   SetNumberProperty(cx, obj, "globalPoolHits", pool ? pool->Hits() : 0) &&
+                   SetNumberProperty(cx, obj, "globalPoolMisses", pool ? pool->Misses() : 0) &&
+                   SetNumberProperty(cx, obj, "globalPoolAvailable", pool ? pool->Available() : 0) &&
+                   SetNumberProperty(cx, obj, "foldHits", mFoldCache.Hits()) &&
+                   SetNumberProperty(cx, obj, "foldMisses", mFoldCache.Misses()) &&
+                   SetNumberProperty(cx, obj, "foldEntries", mFoldCache.Count()) &&
+                   SetNumberProperty(cx, obj, "propertyHits", mPropertyCache.Hits()) &&
+                   SetNumberProperty(cx, obj, "propertyMisses", mPropertyCache.Misses()) &&
+                   SetNumberProperty(cx, obj, "propertyEntries", mPropertyCache.Count()),
+                   NS_ERROR_FAILURE);
+
     return NS_OK;
 }
 
+NS_IMETHODIMP
+dactylUtils::BenchmarkScriptDecoding(const jsval &aPaths,
+                                     PRUint32 iterations,
+                                     JSContext *cx,
+                                     jsval *retval)
+{
+    nsresult rv;
+
+    JSAutoRequest ar(cx);
+
+    nsTArray<nsCString> paths;
+    rv = GetURLList(cx, aPaths, paths);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    JSObject *global = JS_GetGlobalForScopeChain(cx);
+    NS_ENSURE_TRUE(global, NS_ERROR_FAILURE);
+
+    JSPrincipals *jsPrincipals;
+    rv = mSystemPrincipal->GetJSPrincipals(cx, &jsPrincipals);
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    uint32 options = JS_GetOptions(cx);
+    JS_SetOptions(cx, options & ~JSOPTION_COMPILE_N_GO);
+
+    // Entries are encoded just as they are for the startup cache, with
+    // their principals interleaved in them.
+    nsTArray<nsAutoPtr<ScriptBundle::Script> > scripts;
+    nsTArray<ScriptStamp> stamps;
+    for (PRUint32 i = 0; i < paths.Length() && NS_SUCCEEDED(rv); i++) {
+        nsAutoPtr<ScriptBundle::Script> script(new ScriptBundle::Script());
+        script->url = paths[i];
+
+        ScriptStamp stamp;
+        rv = CompileFile(cx, global, jsPrincipals, paths[i], script, &stamp);
+        if (NS_SUCCEEDED(rv)) {
+            scripts.AppendElement(script.forget());
+            stamps.AppendElement(stamp);
+        }
+    }
+
+    JS_SetOptions(cx, options);
+    JSPRINCIPALS_DROP(cx, jsPrincipals);
+
+    if (rv == NS_ERROR_ABORT)
+        return NS_OK;
+    NS_ENSURE_SUCCESS(rv, rv);
+
+    // Each decode starts from a fresh copy of the entry, as it would from
+    // the startup cache's GetBuffer, which the stream then copies again.
+    PRTime streamTime = 0, inPlaceTime = 0;
+    PRUint32 bytes = 0, inPlace = 0;
+    for (PRUint32 i = 0; i < scripts.Length(); i++) {
+        const ScriptBundle::Script &script = *scripts[i];
+        bytes += script.length;
+
+        JSScriptType *scriptObj;
+        PRTime start = PR_Now();
+        for (PRUint32 j = 0; j < iterations; j++) {
+            char *buf = new char[script.length];
+            memcpy(buf, script.data, script.length);
+            rv = DecodeCachedScriptStream(buf, script.length, stamps[i], cx,
+                                          &scriptObj);
+            NS_ENSURE_SUCCESS(rv, rv);
+        }
+        streamTime += PR_Now() - start;
+
+        // What the loader does now, which falls back to the stream for
+        // entries it can't decode in place.
+        start = PR_Now();
+        for (PRUint32 j = 0; j < iterations; j++) {
+            char *buf = new char[script.length];
+            memcpy(buf, script.data, script.length);
+            rv = DecodeCachedScript(buf, script.length, stamps[i], cx,
+                                    &scriptObj);
+            NS_ENSURE_SUCCESS(rv, rv);
+        }
+        inPlaceTime += PR_Now() - start;
+
+        rv = DecodeCachedScriptInPlace(script.data, script.length, stamps[i],
+                                       cx, &scriptObj);
+        if (NS_SUCCEEDED(rv))
+            inPlace++;
+
+        JS_MaybeGC(cx);
+    }
+
+    JSObject *obj = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    NS_ENSURE_TRUE(obj, NS_ERROR_OUT_OF_MEMORY);
+    *retval = OBJECT_TO_JSVAL(obj);
+
+    NS_ENSURE_TRUE(SetNumberProperty(cx, obj, "scripts", scripts.Length()) &&
+                   SetNumberProperty(cx, obj, "bytes", bytes) &&
+                   SetNumberProperty(cx, obj, "inPlace", inPlace) &&
+                   SetNumberProperty(cx, obj, "streamTime", ToMilliseconds(streamTime)) &&
+                   SetNumberProperty(cx, obj, "inPlaceTime", ToMilliseconds(inPlaceTime)),
+                   NS_ERROR_FAILURE);
+    return NS_OK;
+}
+
+struct LoadStatisticsClosure {
+    JSContext *cx;
+    JSObject  *result;
+};
+
+static PLDHashOperator
+DefineLoadStatistics(const nsACString &aURL, ScriptLoadStatistics *aStats,
+                     void *aClosure)
+{
+    LoadStatisticsClosure *closure = static_cast<LoadStatisticsClosure*>(aClosure);
+    JSContext *cx = closure->cx;
+    JSObject *result = closure->result;
+
+    JSObject *obj = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    if (!obj ||
+        !JS_DefineProperty(cx, result, PromiseFlatCString(aURL).get(),
+                           OBJECT_TO_JSVAL(obj), nsnull, nsnull,
+                           JSPROP_ENUMERATE))
+        return PL_DHASH_STOP;
+
+    // Times are kept in microseconds, but reported in milliseconds.
+    if (!SetNumberProperty(cx, obj, "loads", aStats->loads) ||
+        !SetNumberProperty(cx, obj, "failures", aStats->failures) ||
+        !SetNumberProperty(cx, obj, "cacheHits", aStats->cacheHits) ||
+        !SetNumberProperty(cx, obj, "cacheMisses", aStats->cacheMisses) ||
+        !SetNumberProperty(cx, obj, "cacheStale", aStats->cacheStale) ||
+        !SetNumberProperty(cx, obj, "memoryHits", aStats->memoryHits) ||
+        !SetNumberProperty(cx, obj, "readTime", ToMilliseconds(aStats->readTime)) ||
+        !SetNumberProperty(cx, obj, "decodeTime", ToMilliseconds(aStats->decodeTime)) ||
+        !SetNumberProperty(cx, obj, "xdrTime", ToMilliseconds(aStats->xdrTime)) ||
+        !SetNumberProperty(cx, obj, "compileTime", ToMilliseconds(aStats->compileTime)) ||
+        !SetNumberProperty(cx, obj, "executeTime", ToMilliseconds(aStats->executeTime)) ||
+        !SetNumberProperty(cx, obj, "sourceSize", aStats->sourceSize) ||
+        !SetNumberProperty(cx, obj, "cacheSize", aStats->cacheSize))
+        return PL_DHASH_STOP;
+
+    return PL_DHASH_NEXT;
+}
+
+NS_IMETHODIMP
+dactylUtils::GetLoadStatistics(JSContext *cx, jsval *retval)
+{
+    JSAutoRequest ar(cx);
+
+    JSObject *obj = JS_NewObject(cx, nsnull, nsnull, nsnull);
+    NS_ENSURE_TRUE(obj, NS_ERROR_OUT_OF_MEMORY);
+    *retval = OBJECT_TO_JSVAL(obj);
+
+    LoadStatisticsClosure closure = { cx, obj };
+    PRUint32 count = mLoadStatistics.EnumerateRead(DefineLoadStatistics, &closure);
+    NS_ENSURE_TRUE(count == mLoadStatistics.Count(), NS_ERROR_FAILURE);
+
+    return NS_OK;
+}
+
+NS_IMETHODIMP
+dactylUtils::ResetLoadStatistics()
+{
+    mLoadStatistics.Clear();
+    return NS_OK;
+}
@@ -0,0 +1,206 @@
+#include "trigramIndex.h"
+#include "stringSearch.h"
+
+#include "nsQuickSort.h"
+
+static inline bool
+Contains(const nsAString &text, const nsAString &filter)
+{
+    return FindSubstring(reinterpret_cast<const uint16_t*>(text.BeginReading()),
+                         text.Length(),
+                         reinterpret_cast<const uint16_t*>(filter.BeginReading()),
+                         filter.Length()) != kNotFound;
+}
+
+static int
+CompareKeys(const void *a, const void *b, void *)
+{
+    PRUint64 x = *static_cast<const PRUint64*>(a);
+    PRUint64 y = *static_cast<const PRUint64*>(b);
+    return x < y ? -1 : x > y;
+}
+
+static int
+CompareIds(const void *a, const void *b, void *)
+{
+    PRUint32 x = *static_cast<const PRUint32*>(a);
+    PRUint32 y = *static_cast<const PRUint32*>(b);
+    return x < y ? -1 : x > y;
+}
+
+static int
+CompareLengths(const void *a, const void *b, void *)
+{
+    PRUint32 x = (*static_cast<nsTArray<PRUint32>* const*>(a))->Length();
+    PRUint32 y = (*static_cast<nsTArray<PRUint32>* const*>(b))->Length();
+    return x < y ? -1 : x > y;
+}
+
+/* The index of the first of the sorted *ids* not less than *id*. */
+static PRUint32
+LowerBound(const nsTArray<PRUint32> &ids, PRUint32 id)
+{
+    PRUint32 low = 0, high = ids.Length();
+    while (low < high) {
+        PRUint32 mid = low + (high - low) / 2;
+        if (ids[mid] < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+TrigramIndex::TrigramIndex()
+{
+}
+
+TrigramIndex::~TrigramIndex()
+{
+}
+
+bool
+TrigramIndex::Init()
+{
+    return mTexts.Init(256) && mPostings.Init(4096);
+}
+
+void
+TrigramIndex::GetTrigrams(const nsAString &text, nsTArray<PRUint64> &keys)
+{
+    keys.Clear();
+
+    const PRUnichar *chars = text.BeginReading();
+    for (PRUint32 i = 0; i + 3 <= text.Length(); i++)
+        keys.AppendElement(PRUint64(chars[i]) << 32 |
+                           PRUint64(chars[i + 1]) << 16 |
+                           PRUint64(chars[i + 2]));
+
+    NS_QuickSort(keys.Elements(), keys.Length(), sizeof(PRUint64),
+                 CompareKeys, nsnull);
+
+    PRUint32 n = 0;
+    for (PRUint32 i = 0; i < keys.Length(); i++)
+        if (!n || keys[i] != keys[n - 1])
+            keys[n++] = keys[i];
+    keys.SetLength(n);
+}
+
+bool
+TrigramIndex::Add(PRUint32 id, const nsAString &text)
+{
+    Remove(id);
+
+    nsTArray<PRUint64> keys;
+    GetTrigrams(text, keys);
+
+    for (PRUint32 i = 0; i < keys.Length(); i++) {
+        Postings *postings;
+        if (!mPostings.Get(keys[i], &postings)) {
+            postings = new Postings();
+            mPostings.Put(keys[i], postings);
+        }
+
+        // Ids are mostly handed out in order, so this is nearly always
+        // an append.
+        if (postings->IsEmpty() || postings->ElementAt(postings->Length() - 1) < id)
+            postings->AppendElement(id);
+        else
+            postings->InsertElementAt(LowerBound(*postings, id), id);
+    }
+
+    mTexts.Put(id, new nsString(text));
+    return true;
+}
+
+void
+TrigramIndex::Remove(PRUint32 id)
+{
+    nsString *text;
+    if (!mTexts.Get(id, &text))
+        return;
+
+    nsTArray<PRUint64> keys;
+    GetTrigrams(*text, keys);
+
+    for (PRUint32 i = 0; i < keys.Length(); i++) {
+        Postings *postings;
+        if (!mPostings.Get(keys[i], &postings))
+            continue;
+
+        PRUint32 index = LowerBound(*postings, id);
+        if (index < postings->Length() && postings->ElementAt(index) == id)
+            postings->RemoveElementAt(index);
+        if (postings->IsEmpty())
+            mPostings.Remove(keys[i]);
+    }
+
+    mTexts.Remove(id);
+}
+
+struct CollectClosure {
+    const nsAString *filter;
+    nsTArray<PRUint32> *ids;
+};
+
+PLDHashOperator
+TrigramIndex::CollectMatch(const PRUint32 &id, nsString *text, void *closure)
+{
+    CollectClosure *c = static_cast<CollectClosure*>(closure);
+    if (Contains(*text, *c->filter))
+        c->ids->AppendElement(id);
+    return PL_DHASH_NEXT;
+}
+
+bool
+TrigramIndex::Query(const nsAString &filter, nsTArray<PRUint32> &ids)
+{
+    ids.Clear();
+
+    // Filters too short to have a trigram match whatever contains them.
+    if (filter.Length() < 3) {
+        CollectClosure closure = { &filter, &ids };
+        mTexts.EnumerateRead(CollectMatch, &closure);
+        NS_QuickSort(ids.Elements(), ids.Length(), sizeof(PRUint32),
+                     CompareIds, nsnull);
+        return true;
+    }
+
+    nsTArray<PRUint64> keys;
+    GetTrigrams(filter, keys);
+
+    nsTArray<Postings*> lists(keys.Length());
+    for (PRUint32 i = 0; i < keys.Length(); i++) {
+        Postings *postings;
+        if (!mPostings.Get(keys[i], &postings))
+            return true;
+        lists.AppendElement(postings);
+    }
+
+    // Intersects the lists from the shortest up, by searching each for
+    // what's left of the candidates.
+    NS_QuickSort(lists.Elements(), lists.Length(), sizeof(Postings*),
+                 CompareLengths, nsnull);
+
+    nsTArray<PRUint32> candidates(*lists[0]);
+    for (PRUint32 i = 1; i < lists.Length() && !candidates.IsEmpty(); i++) {
+        const Postings &list = *lists[i];
+        PRUint32 n = 0;
+        for (PRUint32 j = 0; j < candidates.Length(); j++) {
+            PRUint32 index = LowerBound(list, candidates[j]);
+            if (index < list.Length() && list[index] == candidates[j])
+                candidates[n++] = candidates[j];
+        }
+        candidates.SetLength(n);
+    }
+
+    // Sharing every trigram doesn't make them contiguous.
+    for (PRUint32 i = 0; i < candidates.Length(); i++) {
+        nsString *text;
+        if (mTexts.Get(candidates[i], &text) && Contains(*text, filter))
+            ids.AppendElement(candidates[i]);
+    }
+    return true;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "config.h"
+
+#include "nsClassHashtable.h"
+#include "nsHashKeys.h"
+#include "nsStringAPI.h"
+#include "nsTArray.h"
+
+/*
+ * An inverted index from each three-unit run of text to the ids of the
+ * entries containing it, so that entries containing a filter can be
+ * found without scanning every one. Texts are indexed as given, so
+ * callers wanting matches without regard to case must fold both the
+ * texts and the filters.
+ *
+ * Entries can be added, replaced and removed at any time. Each keeps
+ * its text, both to remove it and to check the candidates which share
+ * a filter's trigrams, but might not contain the filter itself.
+ */
+class TrigramIndex {
+public:
+    TrigramIndex() NS_HIDDEN;
+    ~TrigramIndex() NS_HIDDEN;
+
+    NS_HIDDEN_(bool) Init();
+
+    /* Indexes *text* for *id*, replacing whatever was indexed for it. */
+    NS_HIDDEN_(bool) Add(PRUint32 id, const nsAString &text);
+
+    NS_HIDDEN_(void) Remove(PRUint32 id);
+
+    /* Sets *ids* to those of the entries containing *filter*, in order. */
+    NS_HIDDEN_(bool) Query(const nsAString &filter, nsTArray<PRUint32> &ids);
+
+    PRUint32 Count() const { return mTexts.Count(); }
+
+private:
+    typedef nsTArray<PRUint32> Postings;
+
+    /* Sets *keys* to the distinct trigrams of *text*, in order. */
+    static void GetTrigrams(const nsAString &text, nsTArray<PRUint64> &keys);
+
+    static PLDHashOperator CollectMatch(const PRUint32 &id, nsString *text,
+                                        void *closure);
+
+    // The text of each entry, and the sorted ids of those containing
+    // each trigram.
+    nsClassHashtable<nsUint32HashKey, nsString> mTexts;
+    nsClassHashtable<nsUint64HashKey, Postings> mPostings;
+};
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
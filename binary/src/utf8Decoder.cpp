@@ -0,0 +1,360 @@
+#include "utf8Decoder.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define DECODER_SSE2 1
+#  include <emmintrin.h>
+#endif
+
+#if defined(DECODER_SSE2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#  define DECODER_AVX2 1
+#  include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#  define CountTrailingZeros(n) __builtin_ctz(n)
+#elif defined(_MSC_VER)
+#  include <intrin.h>
+   static inline unsigned
+   CountTrailingZeros(unsigned long n) {
+       unsigned long index;
+       _BitScanForward(&index, n);
+       return index;
+   }
+#endif
+
+/*
+ * Each kernel widens as long a run of leading ASCII from *src* into *dst*
+ * as it can, and returns its length.
+ */
+typedef size_t (*WidenASCIIFn)(const uint8_t *src, size_t length, uint16_t *dst);
+typedef size_t (*ASCIILengthFn)(const uint8_t *src, size_t length);
+typedef void (*WidenLatin1Fn)(const uint8_t *src, size_t length, uint16_t *dst);
+
+static size_t
+WidenASCIIScalar(const uint8_t *src, size_t length, uint16_t *dst)
+{
+    size_t i = 0;
+    for (; i < length && src[i] < 0x80; i++)
+        dst[i] = src[i];
+    return i;
+}
+
+static size_t
+ASCIILengthScalar(const uint8_t *src, size_t length)
+{
+    size_t i = 0;
+
+    // A word at a time while we can.
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, src + i, sizeof(word));
+        if (word & 0x8080808080808080ULL)
+            break;
+    }
+
+    for (; i < length && src[i] < 0x80; i++)
+        ;
+    return i;
+}
+
+static void
+WidenLatin1Scalar(const uint8_t *src, size_t length, uint16_t *dst)
+{
+    for (size_t i = 0; i < length; i++)
+        dst[i] = src[i];
+}
+
+#ifdef DECODER_SSE2
+static size_t
+WidenASCIISSE2(const uint8_t *src, size_t length, uint16_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        int mask = _mm_movemask_epi8(bytes);
+        if (mask) {
+            size_t n = CountTrailingZeros(mask);
+            return i + WidenASCIIScalar(src + i, n, dst + i);
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_unpacklo_epi8(bytes, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8),
+                         _mm_unpackhi_epi8(bytes, zero));
+    }
+
+    return i + WidenASCIIScalar(src + i, length - i, dst + i);
+}
+
+static size_t
+ASCIILengthSSE2(const uint8_t *src, size_t length)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        int mask = _mm_movemask_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        if (mask)
+            return i + CountTrailingZeros(mask);
+    }
+
+    return i + ASCIILengthScalar(src + i, length - i);
+}
+
+static void
+WidenLatin1SSE2(const uint8_t *src, size_t length, uint16_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_unpacklo_epi8(bytes, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8),
+                         _mm_unpackhi_epi8(bytes, zero));
+    }
+
+    WidenLatin1Scalar(src + i, length - i, dst + i);
+}
+#endif
+
+#ifdef DECODER_AVX2
+__attribute__((target("avx2")))
+static size_t
+WidenASCIIAVX2(const uint8_t *src, size_t length, uint16_t *dst)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        unsigned mask = unsigned(_mm256_movemask_epi8(bytes));
+        if (mask) {
+            size_t n = CountTrailingZeros(mask);
+            return i + WidenASCIIScalar(src + i, n, dst + i);
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 16),
+                            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)));
+    }
+
+    return i + WidenASCIISSE2(src + i, length - i, dst + i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+ASCIILengthAVX2(const uint8_t *src, size_t length)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        unsigned mask = unsigned(_mm256_movemask_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i))));
+        if (mask)
+            return i + CountTrailingZeros(mask);
+    }
+
+    return i + ASCIILengthSSE2(src + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void
+WidenLatin1AVX2(const uint8_t *src, size_t length, uint16_t *dst)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            _mm256_cvtepu8_epi16(
+                                _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+
+    WidenLatin1SSE2(src + i, length - i, dst + i);
+}
+
+static bool
+HaveAVX2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static WidenASCIIFn  gWidenASCII;
+static ASCIILengthFn gASCIILength;
+static WidenLatin1Fn gWidenLatin1;
+
+bool
+SetDecoderKernel(DecoderKernel kernel)
+{
+    if (kernel == DECODER_KERNEL_BEST) {
+#ifdef DECODER_AVX2
+        if (HaveAVX2())
+            return SetDecoderKernel(DECODER_KERNEL_AVX2);
+#endif
+#ifdef DECODER_SSE2
+        return SetDecoderKernel(DECODER_KERNEL_SSE2);
+#else
+        return SetDecoderKernel(DECODER_KERNEL_SCALAR);
+#endif
+    }
+
+    switch (kernel) {
+    case DECODER_KERNEL_SCALAR:
+        gWidenASCII  = WidenASCIIScalar;
+        gASCIILength = ASCIILengthScalar;
+        gWidenLatin1 = WidenLatin1Scalar;
+        return true;
+
+#ifdef DECODER_SSE2
+    case DECODER_KERNEL_SSE2:
+        gWidenASCII  = WidenASCIISSE2;
+        gASCIILength = ASCIILengthSSE2;
+        gWidenLatin1 = WidenLatin1SSE2;
+        return true;
+#endif
+
+#ifdef DECODER_AVX2
+    case DECODER_KERNEL_AVX2:
+        if (!HaveAVX2())
+            return false;
+        gWidenASCII  = WidenASCIIAVX2;
+        gASCIILength = ASCIILengthAVX2;
+        gWidenLatin1 = WidenLatin1AVX2;
+        return true;
+#endif
+
+    default:
+        return false;
+    }
+}
+
+static inline void
+EnsureKernel()
+{
+    if (!gWidenASCII)
+        SetDecoderKernel(DECODER_KERNEL_BEST);
+}
+
+size_t
+ASCIIPrefixLength(const char *data, size_t length)
+{
+    EnsureKernel();
+    return gASCIILength(reinterpret_cast<const uint8_t*>(data), length);
+}
+
+void
+WidenLatin1(const char *src, size_t length, uint16_t *dst)
+{
+    EnsureKernel();
+    gWidenLatin1(reinterpret_cast<const uint8_t*>(src), length, dst);
+}
+
+static inline bool
+IsContinuation(uint8_t c, uint8_t lower = 0x80, uint8_t upper = 0xBF)
+{
+    return c >= lower && c <= upper;
+}
+
+/*
+ * Decodes the single non-ASCII sequence at the head of *src*, writing one
+ * or two units to *dst*. Returns the number of bytes consumed, and sets
+ * *written* to the number of units written.
+ */
+static size_t
+DecodeSequence(const uint8_t *src, size_t length, uint16_t *dst,
+               size_t *written)
+{
+    uint8_t c = src[0];
+    size_t need;
+    uint32_t ch;
+    uint8_t lower = 0x80, upper = 0xBF;
+
+    if (c >= 0xC2 && c <= 0xDF) {
+        need = 1;
+        ch = c & 0x1F;
+    }
+    else if (c >= 0xE0 && c <= 0xEF) {
+        need = 2;
+        ch = c & 0x0F;
+        // Reject overlong forms and surrogates.
+        if (c == 0xE0)
+            lower = 0xA0;
+        else if (c == 0xED)
+            upper = 0x9F;
+    }
+    else if (c >= 0xF0 && c <= 0xF4) {
+        need = 3;
+        ch = c & 0x07;
+        // Reject overlong forms and anything past U+10FFFF.
+        if (c == 0xF0)
+            lower = 0x90;
+        else if (c == 0xF4)
+            upper = 0x8F;
+    }
+    else {
+        *dst = 0xFFFD;
+        *written = 1;
+        return 1;
+    }
+
+    size_t i = 1;
+    for (; i <= need; i++) {
+        if (i >= length || !IsContinuation(src[i], lower, upper)) {
+            // Replace the maximal valid prefix with a single U+FFFD.
+            *dst = 0xFFFD;
+            *written = 1;
+            return i;
+        }
+        ch = ch << 6 | (src[i] & 0x3F);
+        lower = 0x80;
+        upper = 0xBF;
+    }
+
+    if (ch >= 0x10000) {
+        ch -= 0x10000;
+        dst[0] = uint16_t(0xD800 | ch >> 10);
+        dst[1] = uint16_t(0xDC00 | (ch & 0x3FF));
+        *written = 2;
+    }
+    else {
+        dst[0] = uint16_t(ch);
+        *written = 1;
+    }
+    return i;
+}
+
+size_t
+DecodeUTF8(const char *aSrc, size_t length, uint16_t *dst)
+{
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(aSrc);
+
+    EnsureKernel();
+
+    if (length >= 3 && src[0] == 0xEF && src[1] == 0xBB && src[2] == 0xBF) {
+        src += 3;
+        length -= 3;
+    }
+
+    size_t in = 0, out = 0;
+    while (in < length) {
+        size_t n = gWidenASCII(src + in, length - in, dst + out);
+        in += n;
+        out += n;
+
+        if (in < length) {
+            size_t written;
+            in += DecodeSequence(src + in, length - in, dst + out, &written);
+            out += written;
+        }
+    }
+    return out;
+}
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
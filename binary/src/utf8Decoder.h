@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+ * Decoders for the charsets nearly all of our sources are written in.
+ * These have no XPCOM dependencies, so that decodeBench can be built
+ * without the Gecko SDK.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum DecoderKernel {
+    DECODER_KERNEL_BEST,
+    DECODER_KERNEL_SCALAR,
+    DECODER_KERNEL_SSE2,
+    DECODER_KERNEL_AVX2
+};
+
+/*
+ * Selects the implementation used by the functions below. Returns false
+ * if *kernel* isn't supported by this build or CPU, in which case the
+ * selection is unchanged.
+ */
+bool
+SetDecoderKernel(DecoderKernel kernel);
+
+/* Returns the number of leading ASCII bytes in *data*. */
+size_t
+ASCIIPrefixLength(const char *data, size_t length);
+
+/* Widens ISO-8859-1 *src* into *dst*, which must hold *length* units. */
+void
+WidenLatin1(const char *src, size_t length, uint16_t *dst);
+
+/*
+ * Decodes UTF-8 *src* into *dst*, which must hold *length* units. A
+ * leading byte order mark is skipped, and each maximal invalid
+ * subsequence is replaced with U+FFFD. Returns the number of units
+ * written.
+ */
+size_t
+DecodeUTF8(const char *src, size_t length, uint16_t *dst);
+
+/* vim:se sts=4 sw=4 et cin ft=cpp: */
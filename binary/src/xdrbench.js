@@ -0,0 +1,35 @@
+// Compares the two ways of decoding cached bytecode over a set of
+// scripts. Run by `make xdrbench` under the SDK's xpcshell:
+//
+//   xpcshell xdrbench.js <components.manifest> <iterations> <script>...
+"use strict";
+
+var { classes: Cc, interfaces: Ci, utils: Cu } = Components;
+
+function File(path) {
+    let file = Cc["@mozilla.org/file/local;1"].createInstance(Ci.nsILocalFile);
+    file.initWithPath(path);
+    return file;
+}
+
+let [manifest, iterations] = arguments;
+let paths = arguments.slice(2);
+
+Components.manager.QueryInterface(Ci.nsIComponentRegistrar)
+          .autoRegister(File(manifest));
+
+let utils = Cc["@dactyl.googlecode.com/extra/utils"]
+                .getService(Ci.dactylIUtils);
+
+let result = utils.benchmarkScriptDecoding(paths, Number(iterations));
+
+function rate(time) (result.bytes * iterations / (1 << 20) / (time / 1000)).toFixed(1);
+
+dump(result.scripts + " scripts, " + result.bytes + " bytes of bytecode, " +
+     result.inPlace + " decodable in place\n");
+dump("stream:   " + result.streamTime.toFixed(1) + " ms, " +
+     rate(result.streamTime) + " MB/s\n");
+dump("in place: " + result.inPlaceTime.toFixed(1) + " ms, " +
+     rate(result.inPlaceTime) + " MB/s\n");
+
+// vim: set fdm=marker sw=4 sts=4 ts=8 et ft=javascript: